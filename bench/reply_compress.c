@@ -0,0 +1,221 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Sends replies through the compressing reply context, for a request that
+// accepts gzip and for one that accepts deflate, and checks each body
+// inflates back to the original one. Then measures the time spent per
+// reply and the ratio achieved.
+//
+// Usage: metacd_bench_compress [REPLIES [BODY_SIZE]]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <json.h>
+
+#include <metautils/lib/metautils.h>
+#include <server/network_server.h>
+#include <server/transport_http.h>
+#include <server/stats_holder.h>
+
+static guint compress_min_size = 1024;
+static gint compress_level = 6;
+
+// Only the compression is measured, the other helpers stay unused
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../server/arena.c"
+#include "../server/json.c"
+#include "../server/msgpack.c"
+#include "../server/reply.c"
+#include "../server/compress.c"
+#pragma GCC diagnostic pop
+
+// A reply context that keeps what the handler sent ---------------------------
+
+static GString *sent_body = NULL;
+static gchar *sent_encoding = NULL;
+static guint sent_bodies = 0;
+
+static void
+_sent_reset (void)
+{
+	if (sent_body)
+		g_string_free (sent_body, TRUE);
+	sent_body = NULL;
+	g_free (sent_encoding);
+	sent_encoding = NULL;
+	sent_bodies = 0;
+}
+
+static void _set_status (int code, const gchar *msg) { (void) code, (void) msg; }
+static void _set_content_type (const gchar *type) { (void) type; }
+static void _add_header_gstr (const gchar *n, GString *v) { (void) n; g_string_free (v, TRUE); }
+static void _set_body (guint8 *b, gsize len) { (void) b, (void) len; }
+static void _finalize (void) {}
+
+static void
+_add_header (const gchar *n, gchar *v)
+{
+	if (!g_ascii_strcasecmp (n, "Content-Encoding")) {
+		g_free (sent_encoding);
+		sent_encoding = v;
+	} else {
+		g_free (v);
+	}
+}
+
+static void
+_set_body_gstr (GString *gstr)
+{
+	if (sent_body)
+		g_string_free (sent_body, TRUE);
+	sent_body = gstr;
+	++ sent_bodies;
+}
+
+static GString *
+_inflate (const GString *in)
+{
+	z_stream zs;
+	memset (&zs, 0, sizeof (zs));
+	if (Z_OK != inflateInit2 (&zs, MAX_WBITS + 32)) // gzip or zlib
+		return NULL;
+	GString *out = g_string_sized_new (in->len * 8);
+	guint8 buf[65536];
+	zs.next_in = (Bytef *) in->str;
+	zs.avail_in = in->len;
+	int rc;
+	do {
+		zs.next_out = buf;
+		zs.avail_out = sizeof (buf);
+		rc = inflate (&zs, Z_NO_FLUSH);
+		g_string_append_len (out, (gchar *) buf, sizeof (buf) - zs.avail_out);
+	} while (rc == Z_OK);
+	inflateEnd (&zs);
+	if (rc != Z_STREAM_END) {
+		g_string_free (out, TRUE);
+		return NULL;
+	}
+	return out;
+}
+
+//------------------------------------------------------------------------------
+
+static GString *
+_body (guint size)
+{
+	GString *gs = g_string_sized_new (size + 64);
+	g_string_append_c (gs, '[');
+	for (guint i = 0; gs->len < size; ++i)
+		g_string_append_printf (gs, "%s{\"seq\":%u,\"type\":\"meta2\","
+				"\"host\":\"127.0.0.1:%u\",\"args\":\"\"}", i ? "," : "", i,
+				6000 + (i % 64));
+	g_string_append_c (gs, ']');
+	return gs;
+}
+
+/* One reply of 'body' to a request with 'accept' as Accept-Encoding */
+static void
+_reply (struct http_request_s *rq, struct http_reply_ctx_s *rp,
+		const gchar *accept, const GString *body)
+{
+	enum http_rc_e _handler (struct http_reply_ctx_s *rpz) {
+		return _reply_success_json (rpz, g_string_new_len (body->str, body->len));
+	}
+	_reply_compressing (rq, rp, _http_encoding_negotiate (accept), _handler);
+}
+
+static int
+_check (struct http_request_s *rq, struct http_reply_ctx_s *rp,
+		const gchar *accept, const gchar *expected, const GString *body)
+{
+	_sent_reset ();
+	_reply (rq, rp, accept, body);
+	GString *plain = NULL;
+	if (sent_bodies != 1 || !sent_body) {
+		fprintf (stderr, "%s: %u bodies sent\n", accept, sent_bodies);
+		return 1;
+	}
+	if (g_strcmp0 (sent_encoding, expected)) {
+		fprintf (stderr, "%s: encoding [%s]\n", accept, sent_encoding);
+		return 1;
+	}
+	if (!(plain = _inflate (sent_body)) || plain->len != body->len
+			|| memcmp (plain->str, body->str, body->len)) {
+		fprintf (stderr, "%s: body does not inflate back\n", accept);
+		if (plain)
+			g_string_free (plain, TRUE);
+		return 1;
+	}
+	g_string_free (plain, TRUE);
+	return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+	guint replies = argc > 1 ? atoi (argv[1]) : 10000;
+	guint size = argc > 2 ? atoi (argv[2]) : 16384;
+
+	struct network_client_s client;
+	memset (&client, 0, sizeof (client));
+	client.main_stats = grid_stats_holder_init ();
+	struct http_request_s rq;
+	memset (&rq, 0, sizeof (rq));
+	rq.client = &client;
+	struct http_reply_ctx_s rp;
+	memset (&rp, 0, sizeof (rp));
+	rp.set_status = _set_status;
+	rp.set_content_type = _set_content_type;
+	rp.add_header = _add_header;
+	rp.add_header_gstr = _add_header_gstr;
+	rp.set_body = _set_body;
+	rp.set_body_gstr = _set_body_gstr;
+	rp.finalize = _finalize;
+
+	GString *body = _body (size);
+	if (_check (&rq, &rp, "gzip", "gzip", body)
+			|| _check (&rq, &rp, "deflate", "deflate", body)
+			|| _check (&rq, &rp, "br, gzip;q=0.5", "gzip", body)) {
+		fprintf (stderr, "FAILED\n");
+		return 1;
+	}
+
+	const gchar *accepts[] = { "identity", "deflate", "gzip", NULL };
+	for (const gchar **pa = accepts; *pa; ++pa) {
+		gsize out = 0;
+		gint64 pre = g_get_monotonic_time ();
+		for (guint i = 0; i < replies; ++i) {
+			_sent_reset ();
+			_reply (&rq, &rp, *pa, body);
+			out += sent_body->len;
+		}
+		gint64 spent = g_get_monotonic_time () - pre;
+		printf ("%-8s %8.2f us/reply  %6.1f%% of %u bytes\n", *pa,
+				(gdouble) spent / replies,
+				100.0 * out / ((gdouble) replies * body->len), (guint) body->len);
+	}
+
+	_sent_reset ();
+	g_string_free (body, TRUE);
+	grid_stats_holder_clean (client.main_stats);
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Measures the lookup throughput of the resolver front cache, with an
+// increasing number of threads, for a single shard (i.e. a global lock like
+// the resolver's) and for the sharded configuration. All the lookups hit.
+//
+// Usage: metacd_bench_front [SHARDS [LOOKUPS_PER_THREAD [MAX_THREADS]]]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+// Only the lookups are measured, the other helpers stay unused
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../server/twheel.c"
+#include "../server/shardcache.c"
+#pragma GCC diagnostic pop
+
+#define NB_REFS 65536
+
+static gchar *refs[NB_REFS];
+static gchar *urlv_meta2[] = { "1|meta2|127.0.0.1:6005|", NULL };
+
+struct worker_s {
+	struct shardcache_s *sc;
+	guint lookups;
+	guint32 seed;
+	guint64 hits;
+};
+
+static gpointer
+_worker (gpointer p)
+{
+	struct worker_s *w = p;
+	guint32 x = w->seed;
+	for (guint i = 0; i < w->lookups; ++i) {
+		// xorshift, cheaper than g_random_*() that has its own lock
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		gchar **v = shardcache_get (w->sc, refs[x % NB_REFS], "meta2", NULL);
+		if (v) {
+			++ w->hits;
+			g_strfreev (v);
+		}
+	}
+	return NULL;
+}
+
+static gdouble
+_run (struct shardcache_s *sc, guint nb_threads, guint lookups)
+{
+	struct worker_s workers[nb_threads];
+	GThread *threads[nb_threads];
+
+	gint64 pre = g_get_monotonic_time ();
+	for (guint i = 0; i < nb_threads; ++i) {
+		workers[i].sc = sc;
+		workers[i].lookups = lookups;
+		workers[i].seed = 2463534242U + i * 7919;
+		workers[i].hits = 0;
+		threads[i] = g_thread_create (_worker, workers + i, TRUE, NULL);
+	}
+	for (guint i = 0; i < nb_threads; ++i) {
+		g_thread_join (threads[i]);
+		g_assert (workers[i].hits == lookups);
+	}
+	gint64 elapsed = g_get_monotonic_time () - pre;
+
+	return ((gdouble) nb_threads * lookups) / ((gdouble) elapsed / G_TIME_SPAN_SECOND);
+}
+
+int
+main (int argc, char **argv)
+{
+	guint shards = argc > 1 ? atoi (argv[1]) : 64;
+	guint lookups = argc > 2 ? atoi (argv[2]) : 1000000;
+	guint max_threads = argc > 3 ? atoi (argv[3]) : sysconf (_SC_NPROCESSORS_ONLN);
+	if (!max_threads)
+		max_threads = 1;
+
+	if (!g_thread_supported ())
+		g_thread_init (NULL);
+
+	struct shardcache_s *single = shardcache_create (1, NB_REFS, 3600, 0);
+	struct shardcache_s *sharded = shardcache_create (shards, NB_REFS * 2, 3600, 0);
+	for (guint i = 0; i < NB_REFS; ++i) {
+		refs[i] = g_strdup_printf ("%08X%056X", i * 2654435761U, i);
+		shardcache_put (single, refs[i], "meta2", urlv_meta2);
+		shardcache_put (sharded, refs[i], "meta2", urlv_meta2);
+	}
+
+	printf ("%8s %16s %16s %10s %10s\n", "threads",
+			"1 shard/s", "sharded/s", "speedup", "scaling");
+	gdouble base = 0;
+	for (guint t = 1; ; t = MIN (t * 2, max_threads)) {
+		gdouble s1 = _run (single, t, lookups);
+		gdouble sn = _run (sharded, t, lookups);
+		if (t == 1)
+			base = sn;
+		printf ("%8u %16.0f %16.0f %10.2f %10.2f\n", t, s1, sn, sn / s1, sn / base);
+		if (t >= max_threads)
+			break;
+	}
+
+	shardcache_destroy (single);
+	shardcache_destroy (sharded);
+	for (guint i = 0; i < NB_REFS; ++i)
+		g_free (refs[i]);
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Counts the heap allocations and the time spent tokenizing the URI of a
+// request, with the legacy g_strsplit() based parser and with the current
+// in-place tokenizer. The allocations are counted by interposing the libc
+// allocator, so this only works with the GNU libc.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <json.h>
+
+#include <metautils/lib/metautils.h>
+#include <server/transport_http.h>
+
+#define BADREQ(M,...) NEWERROR(CODE_BAD_REQUEST,M,##__VA_ARGS__)
+
+static gboolean validate_namespace (const gchar * ns) { (void) ns; return TRUE; }
+static gboolean validate_srvtype (const gchar * n) { (void) n; return TRUE; }
+
+// Only the tokenizer is measured, the other helpers stay unused
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../server/arena.c"
+#include "../server/json.c"
+#include "../server/msgpack.c"
+#include "../server/reply.c"
+#include "../server/url.c"
+#pragma GCC diagnostic pop
+
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+
+static gboolean counting = FALSE;
+static guint64 allocations = 0;
+
+void *
+malloc (size_t s)
+{
+	if (counting) ++ allocations;
+	return __libc_malloc (s);
+}
+
+void *
+calloc (size_t n, size_t s)
+{
+	if (counting) ++ allocations;
+	return __libc_calloc (n, s);
+}
+
+void *
+realloc (void *p, size_t s)
+{
+	if (counting) ++ allocations;
+	return __libc_realloc (p, s);
+}
+
+// The parser as it was before the in-place tokenizer -------------------------
+
+struct legacy_args_s {
+	gchar *ns, *ref, *path, *type;
+	gchar *tagk, *tagv, *size, *action, *version;
+	gchar *stgpol, *verpol, *stgcls, *key;
+};
+
+struct legacy_action_s {
+	const gchar *token;
+	gchar **to;
+};
+
+static GError *
+_legacy_parse_pair (gchar ** t, struct legacy_action_s *pa)
+{
+	if (0 == strlen (t[0]))
+		return BADREQ ("empty key");
+	if (0 == strlen (t[1]))
+		return BADREQ ("empty value");
+
+	gchar *escaped = g_uri_unescape_string (t[1], NULL);
+	for (; pa->token; ++pa) {
+		if (!g_ascii_strcasecmp (t[0], pa->token)) {
+			metautils_str_reuse (pa->to, escaped);
+			return NULL;
+		}
+	}
+	g_free (escaped);
+	return BADREQ ("Unexpected URI token [%s]", t[0]);
+}
+
+static GError *
+_legacy_parse (const gchar *str, gsize prefix, struct legacy_args_s *args)
+{
+	gchar *pq = strchr (str, '?');
+	gchar *pa = pq ? strchr (pq, '#') : strchr (str, '#');
+	gchar *path, *query, *fragment;
+
+	if (pq || pa)
+		path = g_strndup (str, (pq ? pq : pa) - str);
+	else
+		path = g_strdup (str);
+	if (pq)
+		query = pa ? g_strndup (pq + 1, pa - pq) : g_strdup (pq + 1);
+	else
+		query = g_strdup("");
+	fragment = g_strdup (pa ? pa + 1 : "");
+
+	struct legacy_action_s tokens[] = {
+		{"ns", &args->ns}, {"ref", &args->ref},
+		{"path", &args->path}, {"type", &args->type},
+		{NULL, NULL}
+	};
+	struct legacy_action_s options[] = {
+		{"action", &args->action}, {"tagk", &args->tagk},
+		{"tagv", &args->tagv}, {"size", &args->size},
+		{"stgcls", &args->stgcls}, {"stgpol", &args->stgpol},
+		{"verpol", &args->verpol}, {"version", &args->version},
+		{"key", &args->key},
+		{NULL, NULL}
+	};
+
+	GError *e = NULL;
+	gchar **tv = g_strsplit (path + prefix, "/", 0);
+	for (gchar ** t = tv; !e && *t; t += 2) {
+		if (!*(t + 1))
+			e = NEWERROR (400, "Invalid URI");
+		else
+			e = _legacy_parse_pair (t, tokens);
+	}
+	g_strfreev (tv);
+
+	gchar **pairs = g_strsplit (query, "&", 0);
+	for (gchar **pair = pairs; !e && *pair; pair++) {
+		if (strchr(*pair, '=')) {
+			gchar **kv = g_strsplit(*pair, "=", 2);
+			e = _legacy_parse_pair (kv, options);
+			g_strfreev(kv);
+		} else {
+			gchar *kv[3] = { *pair, "", NULL };
+			e = _legacy_parse_pair (kv, options);
+		}
+	}
+	g_strfreev (pairs);
+
+	g_free (path);
+	g_free (query);
+	g_free (fragment);
+	return e;
+}
+
+static void
+_legacy_clear (struct legacy_args_s *args)
+{
+	gchar **fields = (gchar **) args;
+	for (guint i = 0; i < sizeof (*args) / sizeof (gchar *); ++i)
+		metautils_str_clean (fields + i);
+}
+
+// The current parser ----------------------------------------------------------
+
+static GError *
+_current_parse (const gchar *str, gsize prefix)
+{
+	struct req_arena_s arena;
+	struct req_uri_s ruri;
+	struct req_args_s args;
+
+	memset (&args, 0, sizeof (args));
+	req_arena_init (&arena);
+	_req_uri_extract_components (str, &ruri, &arena);
+	args.req_uri = &ruri;
+	args.arena = &arena;
+	args.uri = ruri.path + prefix;
+
+	GError *e = _req_path_extract_tokens (&args);
+	if (!e)
+		e = _req_query_extract_args (&args);
+
+	_req_uri_free_components (&ruri);
+	return e;
+}
+
+//------------------------------------------------------------------------------
+
+static struct {
+	const gchar *uri;
+	gsize prefix;
+} samples[] = {
+	{"/dir/srv/ns/NS/ref/JFS/type/meta2", 9},
+	{"/m2/container/ns/NS/ref/JFS?action=touch", 14},
+	{"/m2/content/ns/NS/ref/JFS/path/plop", 12},
+	{"/m2/content/ns/NS/ref/JFS/path/dir%2Fsub%2Fplop?version=1", 12},
+	{"/lb/rr/ns/NS/type/rawx?size=3&tagk=tag.loc&tagv=room1", 7},
+	{NULL, 0}
+};
+
+int
+main (int argc, char **argv)
+{
+	guint rounds = argc > 1 ? atoi (argv[1]) : 1000000;
+	if (!rounds)
+		rounds = 1;
+
+	printf ("%-60s %12s %12s %12s %12s\n", "URI",
+			"legacy/req", "current/req", "legacy ns", "current ns");
+
+	for (guint i = 0; samples[i].uri; ++i) {
+		const gchar *uri = samples[i].uri;
+		gsize prefix = samples[i].prefix;
+		guint64 legacy_allocs, current_allocs;
+		gint64 legacy_time, current_time, pre;
+
+		allocations = 0;
+		counting = TRUE;
+		pre = g_get_monotonic_time ();
+		for (guint r = 0; r < rounds; ++r) {
+			struct legacy_args_s args;
+			memset (&args, 0, sizeof (args));
+			GError *e = _legacy_parse (uri, prefix, &args);
+			if (e)
+				g_error_free (e);
+			_legacy_clear (&args);
+		}
+		legacy_time = g_get_monotonic_time () - pre;
+		counting = FALSE;
+		legacy_allocs = allocations;
+
+		allocations = 0;
+		counting = TRUE;
+		pre = g_get_monotonic_time ();
+		for (guint r = 0; r < rounds; ++r) {
+			GError *e = _current_parse (uri, prefix);
+			if (e)
+				g_error_free (e);
+		}
+		current_time = g_get_monotonic_time () - pre;
+		counting = FALSE;
+		current_allocs = allocations;
+
+		printf ("%-60s %12.2f %12.2f %12.1f %12.1f\n", uri,
+				(gdouble) legacy_allocs / rounds,
+				(gdouble) current_allocs / rounds,
+				(legacy_time * 1000.0) / rounds,
+				(current_time * 1000.0) / rounds);
+	}
+
+	return 0;
+}
@@ -47,9 +47,21 @@ suite_cs  = [
 	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/NOTFOUND', 'body':None },
 	  { 'status':404, 'body':None }),
 	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/meta0', 'body':None },
-	  { 'status':200, 'body':None }),
+	  { 'status':200, 'body':None, 'ctype':'application/json' }),
 	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/replicator', 'body':None },
 	  { 'status':200, 'body':None }),
+	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/meta0', 'body':None,
+		'hdr':{'Accept':'application/x-msgpack'} },
+	  { 'status':200, 'body':None, 'ctype':'application/x-msgpack' }),
+	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/meta0', 'body':None,
+		'hdr':{'Cache-Control':'no-cache'} },
+	  { 'status':200, 'body':None, 'ctype':'application/json' }),
+	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/meta0', 'body':None,
+		'hdr':{'Cache-Control':'no-cache', 'Accept':'application/x-msgpack'} },
+	  { 'status':200, 'body':None, 'ctype':'application/x-msgpack' }),
+	( { 'method':'GET', 'url':'/cs/srv/ns/NS/type/NOTFOUND', 'body':None,
+		'hdr':{'Cache-Control':'no-cache'} },
+	  { 'status':404, 'body':None }),
 
 	( { 'method':'DELETE', 'url':'/cs/srv/ns/NS/type/replicator', 'body':None },
 	  { 'status':200, 'body':None }),
@@ -186,6 +198,38 @@ suite_meta2 = [
 	  { 'status':400, 'body':None }),
 	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None },
 	  { 'status':404, 'body':None }),
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS?max=0', 'body':None },
+	  { 'status':400, 'body':None }),
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS?max=plop', 'body':None },
+	  { 'status':400, 'body':None }),
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS?prefix=a&delimiter=%2F&max=10', 'body':None },
+	  { 'status':404, 'body':None }),
+
+	### Request deadline
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None, 'hdr':{
+			'X-Deadline-Ms':'plop',
+		}},
+	  { 'status':400, 'body':None }),
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None, 'hdr':{
+			'X-Deadline-Ms':'0',
+		}},
+	  { 'status':400, 'body':None }),
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None, 'hdr':{
+			'X-Deadline-Ms':'-1000',
+		}},
+	  { 'status':400, 'body':None }),
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None, 'hdr':{
+			'X-Deadline-Ms':'99999999999999999999',
+		}},
+	  { 'status':400, 'body':None }), # Overflows
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None, 'hdr':{
+			'X-Deadline-Ms':'9223372036854776',
+		}},
+	  { 'status':400, 'body':None }), # Overflows once in microseconds
+	( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None, 'hdr':{
+			'X-Deadline-Ms':'60000',
+		}},
+	  { 'status':404, 'body':None }),
 
 	( { 'method':'POST', 'url':'/m2/container/ns/NS/ref/JFS?action=touch', 'body':None },
 	  { 'status':404, 'body':None }),
@@ -305,7 +349,15 @@ suite_meta2 = [
 					},
 				  {'status':200}),
 				( { 'method':'GET', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None },
-				  { 'status':200, 'body':None }),
+				  { 'status':200, 'body':None, 'ctype':'application/json' }),
+				# Again, from the content cache when it is enabled
+				( { 'method':'GET', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None },
+				  { 'status':200, 'body':None, 'ctype':'application/json' }),
+				# Bypassing the content cache
+				( { 'method':'GET', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None, 'hdr':{
+						'Cache-Control':'no-cache',
+					}},
+				  { 'status':200, 'body':None, 'ctype':'application/json' }),
 				( { 'method':'GET', 'url':'/m2/container/ns/NS/ref/JFS', 'body':None },
 				  { 'status':200, 'body':None }),
 
@@ -314,6 +366,13 @@ suite_meta2 = [
 
 				( { 'method':'DELETE', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None },
 				  { 'status':200, 'body':None }),
+				# The DELETE dropped the cached content
+				( { 'method':'GET', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None },
+				  { 'status':404, 'body':None }),
+				( { 'method':'GET', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None, 'hdr':{
+						'Cache-Control':'no-cache',
+					}},
+				  { 'status':404, 'body':None }),
 
 				( { 'method':'POST', 'url':'/m2/content/ns/NS/ref/JFS/path/plop', 'body':None },
 				  { 'status':400, 'body':None }), # Missing action
@@ -420,13 +479,16 @@ def run_test_suite (addr, suite):
 		cnx.request(i['method'], u, _body(i), _headers(i))
 		resp = cnx.getresponse()
 		status, reason, body = resp.status, resp.reason, resp.read()
+		ctype = resp.getheader('content-type')
 		cnx.close()
 		print '***', status, reason, repr(body)
 		decoded = None
-		if body is not None and body:
+		if body is not None and body and ctype == 'application/json':
 			decoded = json.loads(body)
 		if status != o['status']:
 			raise Exception('Bad status at {0}, {1} instead of {2}'.format(count, status, o['status']))
+		if 'ctype' in o and o['ctype'] != ctype:
+			raise Exception('Bad content type at {0}, {1} instead of {2}'.format(count, ctype, o['ctype']))
 		if 'body' in o and o['body'] is not None:
 			for k in o['body']:
 				if o['body'][k] != decoded[k]:
@@ -0,0 +1,149 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A bump allocator for the transient data of a single request. The first
+// block is embedded in the arena, that lives on the stack of the worker, so
+// that most requests never reach malloc(). Nothing is freed individually,
+// everything is released at once by req_arena_clear().
+
+#ifndef REQ_ARENA_INLINE_SIZE
+#define REQ_ARENA_INLINE_SIZE 4096
+#endif
+
+#ifndef REQ_ARENA_BLOCK_SIZE
+#define REQ_ARENA_BLOCK_SIZE 16384
+#endif
+
+#define REQ_ARENA_ALIGN(S) (((S) + 7) & ~((gsize)7))
+
+struct req_arena_block_s {
+	struct req_arena_block_s *next;
+	guint64 pad; // keeps the payload 8-bytes aligned
+};
+
+struct req_arena_s {
+	guint8 *cur;
+	gsize used;
+	gsize size;
+	struct req_arena_block_s *blocks;
+	guint64 inline_block[REQ_ARENA_INLINE_SIZE / sizeof (guint64)];
+};
+
+static void
+req_arena_init (struct req_arena_s *a)
+{
+	a->cur = (guint8 *) a->inline_block;
+	a->used = 0;
+	a->size = sizeof (a->inline_block);
+	a->blocks = NULL;
+}
+
+/* Frees the overflow blocks and makes the inline block available again.
+ * Can be called several times. */
+static void
+req_arena_clear (struct req_arena_s *a)
+{
+	while (a->blocks) {
+		struct req_arena_block_s *b = a->blocks;
+		a->blocks = b->next;
+		g_free (b);
+	}
+	req_arena_init (a);
+}
+
+static gpointer
+_arena_block_new (struct req_arena_s *a, gsize len)
+{
+	struct req_arena_block_s *b = g_malloc (sizeof (*b) + len);
+	b->next = a->blocks;
+	a->blocks = b;
+	return b + 1;
+}
+
+static gpointer
+req_arena_alloc (struct req_arena_s *a, gsize len)
+{
+	len = REQ_ARENA_ALIGN (len ? len : 1);
+	if (a->used + len > a->size) {
+		// Big chunks get their own block, the current one is kept for
+		// the smaller chunks that will follow.
+		if (len > REQ_ARENA_BLOCK_SIZE / 4)
+			return _arena_block_new (a, len);
+		a->cur = _arena_block_new (a, REQ_ARENA_BLOCK_SIZE);
+		a->used = 0;
+		a->size = REQ_ARENA_BLOCK_SIZE;
+	}
+	gpointer p = a->cur + a->used;
+	a->used += len;
+	return p;
+}
+
+static gpointer
+req_arena_alloc0 (struct req_arena_s *a, gsize len)
+{
+	gpointer p = req_arena_alloc (a, len);
+	memset (p, 0, len);
+	return p;
+}
+
+static gchar *
+req_arena_strndup (struct req_arena_s *a, const gchar *s, gsize len)
+{
+	gchar *p = req_arena_alloc (a, len + 1);
+	memcpy (p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+static gchar *
+req_arena_strdup (struct req_arena_s *a, const gchar *s)
+{
+	return req_arena_strndup (a, s, strlen (s));
+}
+
+/* Same parsing as meta1_unpack_url(), but the service URL is allocated in
+ * the arena and must not be cleaned. Format: "SEQ|TYPE|HOST|ARGS" */
+static struct meta1_service_url_s *
+req_arena_unpack_m1url (struct req_arena_s *a, const gchar *packed)
+{
+	gchar *end = NULL;
+	gint64 seq = g_ascii_strtoll (packed, &end, 10);
+	if (!end || *end != '|')
+		return NULL;
+
+	const gchar *type = end + 1;
+	const gchar *host = strchr (type, '|');
+	if (!host)
+		return NULL;
+	++host;
+	const gchar *args = strchr (host, '|');
+	if (!args)
+		return NULL;
+	++args;
+
+	gsize args_len = strlen (args);
+	struct meta1_service_url_s *m1 = req_arena_alloc0 (a,
+			sizeof (struct meta1_service_url_s) + args_len);
+	m1->seq = seq;
+	g_strlcpy (m1->srvtype, type, MIN (sizeof (m1->srvtype),
+			(gsize) (host - type)));
+	g_strlcpy (m1->host, host, MIN (sizeof (m1->host),
+			(gsize) (args - host)));
+	memcpy (m1->args, args, args_len + 1);
+	return m1;
+}
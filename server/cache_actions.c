@@ -11,6 +11,22 @@ static enum http_rc_e
 action_cache_flush_low (const struct cache_args_s *args)
 {
 	hc_resolver_flush_services (resolver);
+	shardcache_flush (dir_front);
+	negcache_flush (dir_negcache);
+	return _reply_success_json (args->rp, NULL);
+}
+
+static enum http_rc_e
+action_cache_flush_negative (const struct cache_args_s *args)
+{
+	negcache_flush (dir_negcache);
+	return _reply_success_json (args->rp, NULL);
+}
+
+static enum http_rc_e
+action_cache_flush_content (const struct cache_args_s *args)
+{
+	contentcache_flush (m2_cache);
 	return _reply_success_json (args->rp, NULL);
 }
 
@@ -18,6 +34,7 @@ static enum http_rc_e
 action_cache_flush_high (const struct cache_args_s *args)
 {
 	hc_resolver_flush_csm0 (resolver);
+	shardcache_flush (dir_front);
 	return _reply_success_json (args->rp, NULL);
 }
 
@@ -25,6 +42,7 @@ static enum http_rc_e
 action_cache_set_max_high (const struct cache_args_s *args)
 {
 	hc_resolver_set_max_csm0 (resolver, args->count);
+	shardcache_set_max (dir_front, SHARDCACHE_TIER_HIGH, MAX (args->count, 0));
 	return _reply_success_json (args->rp, NULL);
 }
 
@@ -32,13 +50,51 @@ static enum http_rc_e
 action_cache_set_max_low (const struct cache_args_s *args)
 {
 	hc_resolver_set_max_services (resolver, args->count);
+	shardcache_set_max (dir_front, SHARDCACHE_TIER_LOW, MAX (args->count, 0));
 	return _reply_success_json (args->rp, NULL);
 }
 
+static enum http_rc_e
+action_cache_set_max_negative (const struct cache_args_s *args)
+{
+	negcache_set_max (dir_negcache, args->count);
+	return _reply_success_json (args->rp, NULL);
+}
+
+static enum http_rc_e
+action_cache_set_max_content (const struct cache_args_s *args)
+{
+	contentcache_set_max (m2_cache, args->count);
+	return _reply_success_json (args->rp, NULL);
+}
+
+static enum http_rc_e
+action_cache_set_bytes_high (const struct cache_args_s *args)
+{
+	shardcache_set_bytes (dir_front, SHARDCACHE_TIER_HIGH, MAX (args->count, 0));
+	return _reply_success_json (args->rp, NULL);
+}
+
+static enum http_rc_e
+action_cache_set_bytes_low (const struct cache_args_s *args)
+{
+	shardcache_set_bytes (dir_front, SHARDCACHE_TIER_LOW, MAX (args->count, 0));
+	return _reply_success_json (args->rp, NULL);
+}
+
+/* As at startup, the stale entries are only kept with refresh threads */
+static void
+_cache_set_front_ttl (guint tier, gint64 ttl)
+{
+	shardcache_set_ttl (dir_front, tier, CLAMP (ttl, 0, G_MAXINT),
+			dir_refresh_threads > 0 ? dir_front_hard_ttl : 0);
+}
+
 static enum http_rc_e
 action_cache_set_ttl_high (const struct cache_args_s *args)
 {
 	hc_resolver_set_ttl_csm0 (resolver, args->count);
+	_cache_set_front_ttl (SHARDCACHE_TIER_HIGH, args->count);
 	return _reply_success_json (args->rp, NULL);
 }
 
@@ -46,9 +102,66 @@ static enum http_rc_e
 action_cache_set_ttl_low (const struct cache_args_s *args)
 {
 	hc_resolver_set_ttl_services (resolver, args->count);
+	_cache_set_front_ttl (SHARDCACHE_TIER_LOW, args->count);
 	return _reply_success_json (args->rp, NULL);
 }
 
+static enum http_rc_e
+action_cache_set_ttl_negative (const struct cache_args_s *args)
+{
+	negcache_set_ttl (dir_negcache, args->count);
+	return _reply_success_json (args->rp, NULL);
+}
+
+static enum http_rc_e
+action_cache_set_ttl_content (const struct cache_args_s *args)
+{
+	contentcache_set_ttl (m2_cache, args->count);
+	return _reply_success_json (args->rp, NULL);
+}
+
+static void
+_cache_append_counters (GString *gstr, const struct shardcache_counters_s *c)
+{
+	_json_append_pair_int (gstr, "hits", c->hits, FALSE);
+	_json_append_pair_int (gstr, "misses", c->misses, FALSE);
+	_json_append_pair_int (gstr, "inserts", c->inserts, FALSE);
+	_json_append_pair_int (gstr, "evictions", c->evictions, FALSE);
+	_json_append_pair_int (gstr, "expiries", c->expiries, FALSE);
+	_json_append_pair_int (gstr, "decaches", c->decaches, FALSE);
+	_json_append_pair_int (gstr, "stale", c->stale, FALSE);
+	_json_append_pair_int (gstr, "refreshes", c->refreshes, FALSE);
+	_json_append_pair_int (gstr, "refresh_failures", c->refresh_failures, FALSE);
+}
+
+/* The counters of a tier of the front cache, and the latencies of the
+ * resolutions of that tier */
+static void
+_cache_append_tier (GString *gstr, const gchar *name,
+		const struct shardcache_stats_s *fs, guint tier,
+		struct resolve_latency_s *lat)
+{
+	const struct shardcache_counters_s *c = fs->tiers + tier;
+	_json_append_key (gstr, name, FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", fs->counts[tier], TRUE);
+	_json_append_pair_int (gstr, "bytes", fs->bytes[tier], FALSE);
+	_json_append_pair_int (gstr, "max_bytes", fs->max_bytes[tier], FALSE);
+	_json_append_pair_int (gstr, "max", fs->max_counts[tier], FALSE);
+	_json_append_pair_int (gstr, "ttl", fs->ttls[tier], FALSE);
+	_json_append_pair_int (gstr, "hard_ttl", fs->hard_ttls[tier], FALSE);
+	_json_append_pair_int (gstr, "lookups", c->hits + c->misses, FALSE);
+	_cache_append_counters (gstr, c);
+	_json_append_key (gstr, "latency", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_key (gstr, "cached", TRUE);
+	histogram_json (gstr, &lat->cached);
+	_json_append_key (gstr, "upstream", FALSE);
+	histogram_json (gstr, &lat->upstream);
+	g_string_append_c (gstr, '}');
+	g_string_append_c (gstr, '}');
+}
+
 static enum http_rc_e
 action_cache_status (const struct cache_args_s *args)
 {
@@ -56,59 +169,129 @@ action_cache_status (const struct cache_args_s *args)
 	memset (&s, 0, sizeof (s));
 	hc_resolver_info (resolver, &s);
 
-	GString *gstr = g_string_new ("{");
-	g_string_append_printf (gstr, " \"clock\":%lu,", s.clock);
-	g_string_append_printf (gstr, " \"csm0\":{"
-		"\"count\":%" G_GINT64_FORMAT ",\"max\":%u,\"ttl\":%lu},",
-		s.csm0.count, s.csm0.max, s.csm0.ttl);
-	g_string_append_printf (gstr, " \"meta1\":{"
-		"\"count\":%" G_GINT64_FORMAT ",\"max\":%u,\"ttl\":%lu}",
-		s.services.count, s.services.max, s.services.ttl);
+	GString *gstr = g_string_sized_new (128);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "clock", s.clock, TRUE);
+	_json_append_key (gstr, "csm0", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", s.csm0.count, TRUE);
+	_json_append_pair_int (gstr, "max", s.csm0.max, FALSE);
+	_json_append_pair_int (gstr, "ttl", s.csm0.ttl, FALSE);
+	g_string_append_c (gstr, '}');
+	_json_append_key (gstr, "meta1", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", s.services.count, TRUE);
+	_json_append_pair_int (gstr, "max", s.services.max, FALSE);
+	_json_append_pair_int (gstr, "ttl", s.services.ttl, FALSE);
+	g_string_append_c (gstr, '}');
+
+	struct shardcache_stats_s fs;
+	shardcache_info (dir_front, &fs);
+	_json_append_key (gstr, "front", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "shards", fs.shards, TRUE);
+	_json_append_pair_int (gstr, "count", fs.count, FALSE);
+	_json_append_pair_int (gstr, "max", fs.max, FALSE);
+	_json_append_pair_int (gstr, "ttl", fs.ttl, FALSE);
+	_json_append_pair_int (gstr, "hard_ttl", fs.hard_ttl, FALSE);
+	_cache_append_counters (gstr, &fs.total);
+	_json_append_pair_int (gstr, "refresh_pending",
+			dir_refresher ? g_thread_pool_unprocessed (dir_refresher) : 0, FALSE);
+	_cache_append_tier (gstr, "high", &fs, SHARDCACHE_TIER_HIGH,
+			dir_latency + SHARDCACHE_TIER_HIGH);
+	_cache_append_tier (gstr, "low", &fs, SHARDCACHE_TIER_LOW,
+			dir_latency + SHARDCACHE_TIER_LOW);
+	g_string_append_c (gstr, '}');
+
+	struct singleflight_stats_s is;
+	singleflight_info (dir_inflight, &is);
+	_json_append_key (gstr, "inflight", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "pending", is.pending, TRUE);
+	_json_append_pair_int (gstr, "wait", is.wait, FALSE);
+	_json_append_pair_int (gstr, "leaders", is.leaders, FALSE);
+	_json_append_pair_int (gstr, "coalesced", is.coalesced, FALSE);
+	_json_append_pair_int (gstr, "timeouts", is.timeouts, FALSE);
+	g_string_append_c (gstr, '}');
+
+	struct negcache_stats_s ns;
+	negcache_info (dir_negcache, &ns);
+	_json_append_key (gstr, "negative", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", ns.count, TRUE);
+	_json_append_pair_int (gstr, "max", ns.max, FALSE);
+	_json_append_pair_int (gstr, "ttl", ns.ttl, FALSE);
+	_json_append_pair_int (gstr, "hits", ns.hits, FALSE);
+	_json_append_pair_int (gstr, "misses", ns.misses, FALSE);
+	_json_append_pair_int (gstr, "evictions", ns.evictions, FALSE);
+	_json_append_pair_int (gstr, "outdated", ns.outdated, FALSE);
+	g_string_append_c (gstr, '}');
+
+	struct srvlists_stats_s ls;
+	srvlists_info (cs_srvlists, &ls);
+	_json_append_key (gstr, "srvlists", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", ls.count, TRUE);
+	_json_append_pair_int (gstr, "hits", ls.hits, FALSE);
+	_json_append_pair_int (gstr, "live", ls.live, FALSE);
+	_json_append_pair_int (gstr, "errors", ls.errors, FALSE);
+	g_string_append_c (gstr, '}');
+
+	struct contentcache_stats_s cs;
+	contentcache_info (m2_cache, &cs);
+	_json_append_key (gstr, "content", FALSE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", cs.count, TRUE);
+	_json_append_pair_int (gstr, "bytes", cs.bytes, FALSE);
+	_json_append_pair_int (gstr, "max", cs.max, FALSE);
+	_json_append_pair_int (gstr, "ttl", cs.ttl, FALSE);
+	_json_append_pair_int (gstr, "hits", cs.hits, FALSE);
+	_json_append_pair_int (gstr, "misses", cs.misses, FALSE);
+	_json_append_pair_int (gstr, "evictions", cs.evictions, FALSE);
+	_json_append_pair_int (gstr, "invalidations", cs.invalidations, FALSE);
+	g_string_append_c (gstr, '}');
 	g_string_append_c (gstr, '}');
 	return _reply_success_json (args->rp, gstr);
 }
 
+struct cache_action_s {
+	const gchar *method;
+	const gchar *prefix;
+	enum http_rc_e (*hook) (const struct cache_args_s * args);
+};
+
+static struct cache_action_s cache_actions[] = {
+	{"GET", "status/", action_cache_status},
+	{"POST", "flush/high/", action_cache_flush_high},
+	{"POST", "flush/low/", action_cache_flush_low},
+	{"POST", "flush/negative/", action_cache_flush_negative},
+	{"POST", "set/ttl/high/", action_cache_set_ttl_high},
+	{"POST", "set/ttl/low/", action_cache_set_ttl_low},
+	{"POST", "set/max/high/", action_cache_set_max_high},
+	{"POST", "set/max/low/", action_cache_set_max_low},
+	{"POST", "set/bytes/high/", action_cache_set_bytes_high},
+	{"POST", "set/bytes/low/", action_cache_set_bytes_low},
+	{"POST", "set/ttl/negative/", action_cache_set_ttl_negative},
+	{"POST", "set/max/negative/", action_cache_set_max_negative},
+	{"POST", "flush/content/", action_cache_flush_content},
+	{"POST", "set/ttl/content/", action_cache_set_ttl_content},
+	{"POST", "set/max/content/", action_cache_set_max_content},
+	{NULL, NULL, NULL}
+};
+
 static enum http_rc_e
-action_cache (struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar *path)
+cache_args_call (struct http_request_s *rq, struct http_reply_ctx_s *rp,
+	struct req_uri_s *uri, const gchar *path, gconstpointer action)
 {
-	struct cache_action_s {
-		const gchar *method;
-		const gchar *prefix;
-		enum http_rc_e (*hook) (const struct cache_args_s * args);
-	};
-	static struct cache_action_s dir_actions[] = {
-		{"GET", "status/", action_cache_status},
-		{"POST", "flush/high/", action_cache_flush_high},
-		{"POST", "flush/low/", action_cache_flush_low},
-		{"POST", "set/ttl/high/", action_cache_set_ttl_high},
-		{"POST", "set/ttl/low/", action_cache_set_ttl_low},
-		{"POST", "set/max/high/", action_cache_set_max_high},
-		{"POST", "set/max/low/", action_cache_set_max_low},
-		{NULL, NULL, NULL}
-	};
-
-	gboolean matched = FALSE;
+	const struct cache_action_s *pa = action;
 	(void) uri;
 
-	for (struct cache_action_s * pa = dir_actions; pa->prefix; ++pa) {
-		if (!g_str_has_prefix (path, pa->prefix))
-			continue;
-		matched = TRUE;
-		if (0 != strcmp (rq->cmd, pa->method))
-			continue;
-
-		struct cache_args_s args;
-		memset (&args, 0, sizeof (args));
-		args.uri = path + strlen (pa->prefix);
-		args.count = atoi (args.uri);
-		args.rq = rq;
-		args.rp = rp;
-
-		return pa->hook (&args);
-	}
-
-	if (matched)
-		return _reply_method_error (rp);
-	return _reply_no_handler (rp);
+	struct cache_args_s args;
+	memset (&args, 0, sizeof (args));
+	args.uri = path;
+	args.count = g_ascii_strtoll (args.uri, NULL, 10);
+	args.rq = rq;
+	args.rp = rp;
+
+	return pa->hook (&args);
 }
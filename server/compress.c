@@ -0,0 +1,161 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compression of the reply bodies, negotiated with the Accept-Encoding
+// header of the request. Only the bodies larger than compress_min_size are
+// compressed, the small ones would not save enough to pay for the CPU.
+
+#include <time.h>
+#include <zlib.h>
+
+enum http_encoding_e {
+	HTTP_ENCODING_IDENTITY = 0,
+	HTTP_ENCODING_GZIP,
+	HTTP_ENCODING_DEFLATE,
+};
+
+/* Returns the preferred encoding among the ones we support. gzip wins over
+ * deflate, and the codings explicitly refused with "q=0" are ignored. */
+static enum http_encoding_e
+_http_encoding_negotiate (const gchar *accept)
+{
+	enum http_encoding_e best = HTTP_ENCODING_IDENTITY;
+	if (!accept)
+		return best;
+
+	gchar **tokv = g_strsplit (accept, ",", -1);
+	for (gchar **ptok = tokv; *ptok; ++ptok) {
+		gchar *tok = g_strstrip (*ptok);
+		gchar *params = strchr (tok, ';');
+		if (params) {
+			*(params++) = '\0';
+			g_strchomp (tok);
+			params = g_strstrip (params);
+			if (!g_ascii_strncasecmp (params, "q=", 2)
+					&& g_ascii_strtod (params + 2, NULL) <= 0.0)
+				continue;
+		}
+		if (!g_ascii_strcasecmp (tok, "gzip")
+				|| !g_ascii_strcasecmp (tok, "x-gzip"))
+			best = HTTP_ENCODING_GZIP;
+		else if (!g_ascii_strcasecmp (tok, "deflate")
+				&& best == HTTP_ENCODING_IDENTITY)
+			best = HTTP_ENCODING_DEFLATE;
+	}
+	g_strfreev (tokv);
+	return best;
+}
+
+static gint64
+_thread_cpu_usec (void)
+{
+	struct timespec ts;
+	if (0 != clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts))
+		return 0;
+	return ((gint64) ts.tv_sec) * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Returns the compressed form of 'in', or NULL if the compression failed.
+ * The 'deflate' content-coding is the zlib format (RFC 1950), not the raw
+ * deflate stream. */
+static GString *
+_compress_gstr (const GString *in, enum http_encoding_e enc, gint level)
+{
+	z_stream zs;
+	memset (&zs, 0, sizeof (zs));
+	int wbits = enc == HTTP_ENCODING_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+	if (Z_OK != deflateInit2 (&zs, CLAMP (level, 1, 9), Z_DEFLATED, wbits,
+				8, Z_DEFAULT_STRATEGY))
+		return NULL;
+
+	uLong bound = deflateBound (&zs, in->len);
+	GString *out = g_string_sized_new (bound);
+	zs.next_in = (Bytef *) in->str;
+	zs.avail_in = in->len;
+	zs.next_out = (Bytef *) out->str;
+	zs.avail_out = bound;
+
+	int rc = deflate (&zs, Z_FINISH);
+	if (rc == Z_STREAM_END) {
+		g_string_set_size (out, zs.total_out);
+	} else {
+		g_string_free (out, TRUE);
+		out = NULL;
+	}
+	deflateEnd (&zs);
+	return out;
+}
+
+/* Compresses the body if it is worth it, and accounts the bytes saved and
+ * the CPU spent in the stats of the server. Takes ownership of 'gstr'. */
+static GString *
+_reply_compress (struct http_request_s *rq, struct http_reply_ctx_s *rp,
+		enum http_encoding_e enc, GString *gstr)
+{
+	if (!gstr || enc == HTTP_ENCODING_IDENTITY || compress_level <= 0
+			|| gstr->len < compress_min_size)
+		return gstr;
+
+	// Whatever the outcome, the reply depends on the header
+	rp->add_header ("Vary", g_strdup ("Accept-Encoding"));
+
+	gint64 pre = _thread_cpu_usec ();
+	GString *z = _compress_gstr (gstr, enc, compress_level);
+	gint64 spent = _thread_cpu_usec () - pre;
+
+	if (!z || z->len >= gstr->len) {
+		grid_stats_holder_increment (rq->client->main_stats,
+				"compress.skipped", (guint64) 1,
+				"compress.cpu.usec", (guint64) MAX (spent, 0),
+				NULL);
+		if (z)
+			g_string_free (z, TRUE);
+		return gstr;
+	}
+
+	grid_stats_holder_increment (rq->client->main_stats,
+			"compress.count", (guint64) 1,
+			"compress.bytes.in", (guint64) gstr->len,
+			"compress.bytes.out", (guint64) z->len,
+			"compress.bytes.saved", (guint64) (gstr->len - z->len),
+			"compress.cpu.usec", (guint64) MAX (spent, 0),
+			NULL);
+
+	rp->add_header ("Content-Encoding", g_strdup (
+				enc == HTTP_ENCODING_GZIP ? "gzip" : "deflate"));
+	g_string_free (gstr, TRUE);
+	return z;
+}
+
+/* Calls 'hook' with a copy of 'rp' whose bodies are compressed with 'enc'
+ * on their way to 'rp'. The copy lives in the frame of this call, and 'rp'
+ * keeps its own callbacks: the wrapper must not call itself. */
+static enum http_rc_e
+_reply_compressing (struct http_request_s *rq, struct http_reply_ctx_s *rp,
+		enum http_encoding_e enc,
+		enum http_rc_e (*hook) (struct http_reply_ctx_s *rpz))
+{
+	if (enc == HTTP_ENCODING_IDENTITY)
+		return hook (rp);
+	void _set_body_gstr (GString *gstr) {
+		rp->set_body_gstr (_reply_compress (rq, rp, enc, gstr));
+	}
+	struct http_reply_ctx_s rpz = *rp;
+	rpz.set_body_gstr = _set_body_gstr;
+	return hook (&rpz);
+}
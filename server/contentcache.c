@@ -0,0 +1,381 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Cache of the encoded bean sets of the contents, served to the GET of a
+// content without asking the meta2. An entry holds all the variants of a
+// content (version asked, encoding) so that a write on the content drops
+// them at once. The capacity is in bytes, the entries share the same TTL,
+// so the insertion order is also the expiration order.
+//
+// Only the writes going through this proxy invalidate the entries, the TTL
+// bounds the staleness of the contents modified elsewhere.
+//
+// A body read from the meta2 is only cached if its container was not
+// invalidated since the read started. The invalidations are stamped per
+// stripe of containers, so a write only holds back the caching of the
+// reads in the same container (or in one sharing its stripe).
+
+#define CONTENTCACHE_STRIPES 1024
+
+struct contentcache_variant_s {
+	gchar *version; // NULL for the latest
+	gboolean msgpack;
+	GString *body;
+};
+
+struct contentcache_entry_s {
+	gint64 expiry;
+	gsize bytes;
+	GList *lru;  // most recently used first
+	GList *fifo; // oldest first
+	GSList *variants;
+	gchar key[]; // "HEXID/PATH"
+};
+
+struct contentcache_s {
+	GStaticMutex lock;
+	GHashTable *entries; // key -> contentcache_entry_s, the key is in the entry
+	GQueue lru;
+	GQueue fifo;
+	gsize bytes;
+	gsize max; // bytes, 0 disables the cache
+	gint64 ttl; // microseconds, 0 disables the cache
+	guint64 generation; // bumped by each invalidation
+	guint64 flushed; // generation of the last flush
+	guint64 stamps[CONTENTCACHE_STRIPES]; // of the last invalidation
+
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+	guint64 invalidations;
+};
+
+struct contentcache_stats_s {
+	guint count;
+	guint64 bytes;
+	guint64 max;
+	gint64 ttl; // seconds
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+	guint64 invalidations;
+};
+
+static void
+_contentcache_entry_free (struct contentcache_entry_s *e)
+{
+	for (GSList *l = e->variants; l; l = l->next) {
+		struct contentcache_variant_s *v = l->data;
+		g_free (v->version);
+		g_string_free (v->body, TRUE);
+		g_free (v);
+	}
+	g_slist_free (e->variants);
+	g_free (e);
+}
+
+static struct contentcache_s *
+contentcache_create (gsize max, guint ttl)
+{
+	struct contentcache_s *cc = g_malloc0 (sizeof (*cc));
+	g_static_mutex_init (&cc->lock);
+	cc->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify) _contentcache_entry_free);
+	g_queue_init (&cc->lru);
+	g_queue_init (&cc->fifo);
+	cc->max = max;
+	cc->ttl = ((gint64) ttl) * G_TIME_SPAN_SECOND;
+	return cc;
+}
+
+static void
+contentcache_destroy (struct contentcache_s *cc)
+{
+	if (!cc)
+		return;
+	g_queue_clear (&cc->lru);
+	g_queue_clear (&cc->fifo);
+	g_hash_table_destroy (cc->entries);
+	g_static_mutex_free (&cc->lock);
+	g_free (cc);
+}
+
+/* Must be called under the lock */
+static void
+_contentcache_remove (struct contentcache_s *cc,
+		struct contentcache_entry_s *e)
+{
+	cc->bytes -= e->bytes;
+	g_queue_delete_link (&cc->lru, e->lru);
+	g_queue_delete_link (&cc->fifo, e->fifo);
+	g_hash_table_remove (cc->entries, e->key);
+}
+
+/* Must be called under the lock */
+static void
+_contentcache_shrink (struct contentcache_s *cc)
+{
+	while (cc->bytes > cc->max && cc->lru.length) {
+		_contentcache_remove (cc, g_queue_peek_tail (&cc->lru));
+		++ cc->evictions;
+	}
+}
+
+/* Returns "HEXID/PATH" in 'buf' when it fits, else in a new string that
+ * _contentcache_key_free() releases. Never truncated, the keys of two long
+ * paths would collide. */
+static gchar *
+_contentcache_key (const gchar *hexid, const gchar *path, gchar *buf, gsize len)
+{
+	if (!path)
+		path = "";
+	gsize lh = strlen (hexid), lp = strlen (path);
+	if (lh + lp + 2 > len)
+		return g_strconcat (hexid, "/", path, NULL);
+	memcpy (buf, hexid, lh);
+	buf[lh] = '/';
+	memcpy (buf + lh + 1, path, lp + 1);
+	return buf;
+}
+
+static void
+_contentcache_key_free (gchar *key, gchar *buf)
+{
+	if (key != buf)
+		g_free (key);
+}
+
+static gboolean
+_contentcache_variant_match (struct contentcache_variant_s *v,
+		const gchar *version, gboolean msgpack)
+{
+	return BOOL (v->msgpack) == BOOL (msgpack)
+		&& ((!v->version && !version)
+				|| (v->version && version && !strcmp (v->version, version)));
+}
+
+/* Returns a copy of the cached body, or NULL */
+static GString *
+contentcache_get (struct contentcache_s *cc, const gchar *hexid,
+		const gchar *path, const gchar *version, gboolean msgpack)
+{
+	gchar buf[1024];
+	if (!cc || !hexid || !path)
+		return NULL;
+
+	gchar *key = _contentcache_key (hexid, path, buf, sizeof (buf));
+	GString *result = NULL;
+	gint64 now = g_get_monotonic_time ();
+
+	g_static_mutex_lock (&cc->lock);
+	if (cc->max > 0 && cc->ttl > 0) {
+		struct contentcache_entry_s *e = g_hash_table_lookup (cc->entries, key);
+		if (e && e->expiry <= now) {
+			_contentcache_remove (cc, e);
+			e = NULL;
+		}
+		for (GSList *l = e ? e->variants : NULL; l && !result; l = l->next) {
+			struct contentcache_variant_s *v = l->data;
+			if (_contentcache_variant_match (v, version, msgpack))
+				result = g_string_new_len (v->body->str, v->body->len);
+		}
+		if (result) {
+			++ cc->hits;
+			if (cc->lru.head != e->lru) {
+				g_queue_unlink (&cc->lru, e->lru);
+				g_queue_push_head_link (&cc->lru, e->lru);
+			}
+		} else {
+			++ cc->misses;
+		}
+	}
+	g_static_mutex_unlock (&cc->lock);
+	_contentcache_key_free (key, buf);
+	return result;
+}
+
+static guint
+_contentcache_stripe (const gchar *hexid)
+{
+	return g_str_hash (hexid) % CONTENTCACHE_STRIPES;
+}
+
+/* To be read before querying the meta2, then passed to contentcache_put() */
+static guint64
+contentcache_generation (struct contentcache_s *cc)
+{
+	if (!cc)
+		return 0;
+	g_static_mutex_lock (&cc->lock);
+	guint64 gen = cc->generation;
+	g_static_mutex_unlock (&cc->lock);
+	return gen;
+}
+
+/* Caches a copy of 'body', unless the container was invalidated since 'gen'
+ * was read: the body could then be older than the write that invalidated. */
+static void
+contentcache_put (struct contentcache_s *cc, const gchar *hexid,
+		const gchar *path, const gchar *version, gboolean msgpack,
+		const GString *body, guint64 gen)
+{
+	gchar buf[1024];
+	if (!cc || !hexid || !path || !body)
+		return;
+
+	gchar *key = _contentcache_key (hexid, path, buf, sizeof (buf));
+	gint64 now = g_get_monotonic_time ();
+
+	g_static_mutex_lock (&cc->lock);
+	if (cc->max > 0 && cc->ttl > 0 && body->len < cc->max
+			&& gen >= cc->flushed
+			&& gen >= cc->stamps[_contentcache_stripe (hexid)]) {
+		struct contentcache_entry_s *e = g_hash_table_lookup (cc->entries, key);
+		if (e && e->expiry <= now) {
+			_contentcache_remove (cc, e);
+			e = NULL;
+		}
+		if (!e) {
+			gsize len = strlen (key);
+			e = g_malloc0 (sizeof (*e) + len + 1);
+			memcpy (e->key, key, len + 1);
+			e->bytes = sizeof (*e) + len + 1;
+			e->expiry = now + cc->ttl;
+			g_queue_push_head (&cc->lru, e);
+			e->lru = cc->lru.head;
+			g_queue_push_tail (&cc->fifo, e);
+			e->fifo = cc->fifo.tail;
+			g_hash_table_insert (cc->entries, e->key, e);
+			cc->bytes += e->bytes;
+		}
+
+		struct contentcache_variant_s *v = NULL;
+		for (GSList *l = e->variants; l && !v; l = l->next) {
+			if (_contentcache_variant_match (l->data, version, msgpack))
+				v = l->data;
+		}
+		if (!v) {
+			v = g_malloc0 (sizeof (*v));
+			v->version = g_strdup (version);
+			v->msgpack = msgpack;
+			v->body = g_string_new_len (body->str, body->len);
+			e->variants = g_slist_prepend (e->variants, v);
+			gsize bytes = sizeof (*v) + body->len
+				+ (version ? strlen (version) + 1 : 0);
+			e->bytes += bytes;
+			cc->bytes += bytes;
+		}
+		_contentcache_shrink (cc);
+	}
+	g_static_mutex_unlock (&cc->lock);
+	_contentcache_key_free (key, buf);
+}
+
+/* Forgets all the variants of the content at 'path', or all the contents
+ * of the container if 'path' is NULL. The container-wide invalidations
+ * scan the whole cache, they only follow the rare container operations. */
+static void
+contentcache_drop (struct contentcache_s *cc, const gchar *hexid,
+		const gchar *path)
+{
+	gchar buf[1024];
+	if (!cc || !hexid)
+		return;
+
+	g_static_mutex_lock (&cc->lock);
+	cc->stamps[_contentcache_stripe (hexid)] = ++ cc->generation;
+	++ cc->invalidations;
+	if (path) {
+		gchar *key = _contentcache_key (hexid, path, buf, sizeof (buf));
+		struct contentcache_entry_s *e = g_hash_table_lookup (cc->entries, key);
+		if (e)
+			_contentcache_remove (cc, e);
+		_contentcache_key_free (key, buf);
+	} else {
+		gchar *prefix = _contentcache_key (hexid, "", buf, sizeof (buf));
+		gsize len = strlen (prefix);
+		for (GList *l = cc->fifo.head; l ;) {
+			struct contentcache_entry_s *e = l->data;
+			l = l->next;
+			if (!strncmp (e->key, prefix, len))
+				_contentcache_remove (cc, e);
+		}
+		_contentcache_key_free (prefix, buf);
+	}
+	g_static_mutex_unlock (&cc->lock);
+}
+
+static void
+contentcache_flush (struct contentcache_s *cc)
+{
+	g_static_mutex_lock (&cc->lock);
+	cc->flushed = ++ cc->generation;
+	g_queue_clear (&cc->lru);
+	g_queue_clear (&cc->fifo);
+	g_hash_table_remove_all (cc->entries);
+	cc->bytes = 0;
+	g_static_mutex_unlock (&cc->lock);
+}
+
+static guint
+contentcache_expire (struct contentcache_s *cc)
+{
+	guint count = 0;
+	gint64 now = g_get_monotonic_time ();
+	g_static_mutex_lock (&cc->lock);
+	struct contentcache_entry_s *e;
+	while ((e = g_queue_peek_head (&cc->fifo)) && e->expiry <= now) {
+		_contentcache_remove (cc, e);
+		++ count;
+	}
+	g_static_mutex_unlock (&cc->lock);
+	return count;
+}
+
+/* The entries already cached keep their expiry */
+static void
+contentcache_set_ttl (struct contentcache_s *cc, guint ttl)
+{
+	g_static_mutex_lock (&cc->lock);
+	cc->ttl = ((gint64) ttl) * G_TIME_SPAN_SECOND;
+	g_static_mutex_unlock (&cc->lock);
+}
+
+static void
+contentcache_set_max (struct contentcache_s *cc, gsize max)
+{
+	g_static_mutex_lock (&cc->lock);
+	cc->max = max;
+	_contentcache_shrink (cc);
+	g_static_mutex_unlock (&cc->lock);
+}
+
+static void
+contentcache_info (struct contentcache_s *cc, struct contentcache_stats_s *s)
+{
+	g_static_mutex_lock (&cc->lock);
+	s->count = cc->lru.length;
+	s->bytes = cc->bytes;
+	s->max = cc->max;
+	s->ttl = cc->ttl / G_TIME_SPAN_SECOND;
+	s->hits = cc->hits;
+	s->misses = cc->misses;
+	s->evictions = cc->evictions;
+	s->invalidations = cc->invalidations;
+	g_static_mutex_unlock (&cc->lock);
+}
@@ -18,14 +18,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 // XXX Pay attention, the format here is different from the format of
 // the output of the legacy /lb/sl handler.
+// 'mtime' is the wall-clock time of the list, in seconds.
 static GString *
-_cs_pack_and_free_srvinfo_list (GSList * svc)
+_cs_pack_srvinfo_list (GSList * svc, gint64 mtime)
 {
 	GString *gstr = g_string_sized_new (64 + 32 * g_slist_length (svc));
 
 	g_string_append_c (gstr, '{');
 	_append_status (gstr, 200, "OK");
-	g_string_append (gstr, ",\"srv\":[");
+	_json_append_pair_int (gstr, "mtime", mtime, FALSE);
+	_json_append_key (gstr, "srv", FALSE);
+	g_string_append_c (gstr, '[');
 
 	for (GSList * l = svc; l; l = l->next) {
 		if (l != svc)
@@ -34,10 +37,74 @@ _cs_pack_and_free_srvinfo_list (GSList * svc)
 	}
 
 	g_string_append (gstr, "]}");
-	g_slist_free_full (svc, (GDestroyNotify) service_info_clean);
 	return gstr;
 }
 
+static GString *
+_cs_mp_pack_srvinfo_list (GSList * svc, gint64 mtime)
+{
+	GString *gstr = g_string_sized_new (64 + 32 * g_slist_length (svc));
+
+	_mp_append_map (gstr, 4);
+	_mp_append_status (gstr, 200, "OK");
+	_mp_append_key (gstr, "mtime");
+	_mp_append_int (gstr, mtime);
+	_mp_append_key (gstr, "srv");
+	_mp_append_array (gstr, g_slist_length (svc));
+	for (GSList * l = svc; l; l = l->next)
+		_mp_append_service_info (gstr, l->data);
+	return gstr;
+}
+
+/* Asks the conscience for the services of 'type', and keeps the list in
+ * the snapshots. Returns the snapshot encodings when asked. */
+static GError *
+_cs_fetch_srvlist (const gchar *type, gint64 *mtime, GString **json,
+		GString **mp)
+{
+	GError *err = NULL;
+	GSList *sl = list_namespace_services2 (nsname, type, &err);
+	if (NULL == err) {
+		gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+		GString *j = _cs_pack_srvinfo_list (sl, now);
+		GString *m = _cs_mp_pack_srvinfo_list (sl, now);
+		if (json)
+			*json = g_string_new_len (j->str, j->len);
+		if (mp)
+			*mp = g_string_new_len (m->str, m->len);
+		if (mtime)
+			*mtime = now;
+		if (cs_srvlists)
+			srvlists_set (cs_srvlists, type, now, j, m);
+		else {
+			g_string_free (j, TRUE);
+			g_string_free (m, TRUE);
+		}
+	}
+	g_slist_free_full (sl, (GDestroyNotify) service_info_clean);
+	return err;
+}
+
+/* Run by the downstream thread, for all the known service types */
+static void
+_cs_reload_srvlists (void)
+{
+	const struct nsinfo_snapshot_s *snap = _nsinfo_get ();
+	gchar **types = snap->srvtypes ? g_strdupv (snap->srvtypes) : NULL;
+	for (gchar **pt = types; pt && *pt; ++pt) {
+		GError *err = _cs_fetch_srvlist (*pt, NULL, NULL, NULL);
+		if (err) {
+			GRID_NOTICE ("SRVLIST reload error [%s] : (%d) %s", *pt,
+					err->code, err->message);
+			g_clear_error (&err);
+		}
+	}
+	if (types) {
+		srvlists_retain (cs_srvlists, types);
+		g_strfreev (types);
+	}
+}
+
 enum reg_op_e {
 	REGOP_PUSH,
 	REGOP_LOCK,
@@ -95,13 +162,9 @@ action_cs_nscheck (const struct req_args_s *args)
 static enum http_rc_e
 action_cs_info (const struct req_args_s *args)
 {
-	struct namespace_info_s ni;
-	memset (&ni, 0, sizeof (ni));
-	NSINFO_DO(namespace_info_copy (&nsinfo, &ni, NULL));
-
+	const struct nsinfo_snapshot_s *snap = _nsinfo_get ();
 	GString *gstr = g_string_sized_new (1024);
-	namespace_info_encode_json (gstr, &ni);
-	namespace_info_clear (&ni);
+	namespace_info_encode_json (gstr, (struct namespace_info_s *) &snap->ni);
 	return _reply_success_json (args->rp, gstr);
 }
 
@@ -111,17 +174,34 @@ action_cs_put (const struct req_args_s *args)
 	return _registration (args, REGOP_PUSH);
 }
 
+/* Served from the snapshot of the type, unless the client asks for a live
+ * list with "Cache-Control: no-cache" or there is no snapshot yet. The
+ * 'mtime' of the list and its Age header tell its freshness. */
 static enum http_rc_e
 action_cs_get (const struct req_args_s *args)
 {
-	GError *err = NULL;
-	GSList *sl = list_namespace_services2 (args->ns, args->type, &err);
-	if (NULL != err) {
-		g_slist_free_full (sl, (GDestroyNotify) service_info_clean);
-		g_prefix_error (&err, "Agent error: ");
-		return _reply_soft_error (args->rp, err);
+	gboolean msgpack = BOOL (args->flags & FLAG_MSGPACK);
+	GString *body = NULL;
+	gint64 mtime = 0;
+
+	if (!(args->flags & FLAG_NOCACHE))
+		body = srvlists_get (cs_srvlists, args->type, msgpack, &mtime);
+	if (!body) {
+		GError *err = _cs_fetch_srvlist (args->type, &mtime,
+				msgpack ? NULL : &body, msgpack ? &body : NULL);
+		srvlists_count_live (cs_srvlists, err != NULL);
+		if (NULL != err) {
+			g_prefix_error (&err, "Agent error: ");
+			return _reply_soft_error (args->rp, err);
+		}
 	}
-	return _reply_success_json (args->rp, _cs_pack_and_free_srvinfo_list (sl));
+
+	gint64 age = g_get_real_time () / G_USEC_PER_SEC - mtime;
+	args->rp->add_header ("Age", g_strdup_printf ("%"G_GINT64_FORMAT,
+				MAX (age, 0)));
+	if (msgpack)
+		return _reply_success_msgpack (args->rp, body);
+	return _reply_success_json (args->rp, body);
 }
 
 static enum http_rc_e
@@ -136,6 +216,7 @@ action_cs_del (const struct req_args_s *args)
 {
 	GError *err = NULL;
 	gboolean rc = clear_namespace_services (args->ns, args->type, &err);
+	srvlists_drop (cs_srvlists, args->type);
 	if (!rc) {
 		g_prefix_error (&err, "Agent error: ");
 		return _reply_soft_error (args->rp, err);
@@ -158,38 +239,27 @@ action_cs_srvtypes (const struct req_args_s *args)
 {
 	GString *out = g_string_sized_new(128);
 	g_string_append_c(out, '[');
-	NSINFO_DO(if (srvtypes && *srvtypes) {
-		g_string_append_c(out, '"');
-		g_string_append(out, *srvtypes);
-		g_string_append_c(out, '"');
-		for (gchar **ps = srvtypes+1; *ps ;ps++) {
+	gchar **srvtypes = _nsinfo_get ()->srvtypes;
+	for (gchar **ps = srvtypes; ps && *ps ;ps++) {
+		if (ps != srvtypes)
 			g_string_append_c(out, ',');
-			g_string_append_c(out, '"');
-			g_string_append(out, *ps);
-			g_string_append_c(out, '"');
-		}
-	});
+		_json_append_string(out, *ps);
+	}
 	g_string_append_c(out, ']');
 	return _reply_success_json (args->rp, out);
 }
 
-static enum http_rc_e
-action_conscience (struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar *path)
-{
-	static struct req_action_s cs_actions[] = {
-		{"GET", "info/", action_cs_info, TOK_NS, 0, 0},
-		{"HEAD", "info/", action_cs_nscheck, TOK_NS, 0, 0},
-
-		{"GET", "types/", action_cs_srvtypes, TOK_NS, 0, 0},
-
-		{"PUT", "srv/", action_cs_put, TOK_NS | TOK_TYPE, 0, 0},
-		{"GET", "srv/", action_cs_get, TOK_NS | TOK_TYPE, 0, 0},
-		{"HEAD", "srv/", action_cs_srvcheck, TOK_NS | TOK_TYPE, 0, 0},
-		{"POST", "srv/", action_cs_post, TOK_NS | TOK_TYPE, TOK_ACTION, 0},
-		{"DELETE", "srv/", action_cs_del, TOK_NS | TOK_TYPE, 0, 0},
-		/// lock, unlock
-		{NULL, NULL, NULL, 0, 0, 0}
-	};
-	return req_args_call (rq, rp, uri, path, cs_actions);
-}
+static struct req_action_s cs_actions[] = {
+	{"GET", "info/", action_cs_info, TOK_NS, 0, 0, 0},
+	{"HEAD", "info/", action_cs_nscheck, TOK_NS, 0, 0, 0},
+
+	{"GET", "types/", action_cs_srvtypes, TOK_NS, 0, 0, 0},
+
+	{"PUT", "srv/", action_cs_put, TOK_NS | TOK_TYPE, 0, 0, 0},
+	{"GET", "srv/", action_cs_get, TOK_NS | TOK_TYPE, 0, 0, 0},
+	{"HEAD", "srv/", action_cs_srvcheck, TOK_NS | TOK_TYPE, 0, 0, 0},
+	{"POST", "srv/", action_cs_post, TOK_NS | TOK_TYPE, TOK_ACTION, 0, 0},
+	{"DELETE", "srv/", action_cs_del, TOK_NS | TOK_TYPE, 0, 0, 0},
+	/// lock, unlock
+	{NULL, NULL, NULL, 0, 0, 0, 0}
+};
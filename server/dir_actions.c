@@ -16,73 +16,144 @@ You should have received a copy of the GNU Affero General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* Same output as meta1_service_url_encode_json(), with the strings escaped */
+static void
+_append_m1url (GString * gstr, struct meta1_service_url_s *m1)
+{
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "seq", m1->seq, TRUE);
+	_json_append_pair_string (gstr, "type", m1->srvtype, FALSE);
+	_json_append_pair_string (gstr, "host", m1->host, FALSE);
+	_json_append_pair_string (gstr, "args", m1->args, FALSE);
+	g_string_append_c (gstr, '}');
+}
+
 static GString *
-_pack_m1url_list (gchar ** urlv)
+_pack_m1url_list (struct req_arena_s *arena, gchar ** urlv)
 {
-	GString *gstr = g_string_new ("[");
+	GString *gstr = g_string_sized_new (2 + 96 * (urlv ? g_strv_length (urlv) : 0));
+	g_string_append_c (gstr, '[');
 	for (gchar ** v = urlv; v && *v; v++) {
-		struct meta1_service_url_s *m1 = meta1_unpack_url (*v);
-		meta1_service_url_encode_json (gstr, m1);
-		meta1_service_url_clean (m1);
-		if (*(v + 1))
+		struct meta1_service_url_s *m1 = req_arena_unpack_m1url (arena, *v);
+		if (!m1)
+			continue;
+		if (gstr->len > 1)
 			g_string_append_c (gstr, ',');
+		_append_m1url (gstr, m1);
 	}
 	g_string_append (gstr, "]");
 	return gstr;
 }
 
+/* The MessagePack array is prefixed with its size, so the URL are all
+ * unpacked before the encoding. */
 static GString *
-_pack_and_freev_m1url_list (gchar ** urlv)
+_mp_pack_m1url_list (struct req_arena_s *arena, gchar ** urlv)
+{
+	guint max = urlv ? g_strv_length (urlv) : 0, count = 0;
+	struct meta1_service_url_s **m1v = req_arena_alloc (arena,
+			max * sizeof (struct meta1_service_url_s *));
+	for (gchar ** v = urlv; v && *v; v++) {
+		if (NULL != (m1v[count] = req_arena_unpack_m1url (arena, *v)))
+			++ count;
+	}
+
+	GString *gstr = g_string_sized_new (2 + 64 * count);
+	_mp_append_array (gstr, count);
+	for (guint i = 0; i < count; ++i) {
+		_mp_append_map (gstr, 4);
+		_mp_append_key (gstr, "seq");
+		_mp_append_int (gstr, m1v[i]->seq);
+		_mp_append_key (gstr, "type");
+		_mp_append_str (gstr, m1v[i]->srvtype);
+		_mp_append_key (gstr, "host");
+		_mp_append_str (gstr, m1v[i]->host);
+		_mp_append_key (gstr, "args");
+		_mp_append_str (gstr, m1v[i]->args);
+	}
+	return gstr;
+}
+
+/* Replies the URL in the encoding negotiated with the client */
+static enum http_rc_e
+_reply_m1url_list (const struct req_args_s *args, gchar ** urlv)
 {
-	GString *result = _pack_m1url_list (urlv);
+	enum http_rc_e rc;
+	if (args->flags & FLAG_MSGPACK)
+		rc = _reply_success_msgpack (args->rp,
+				_mp_pack_m1url_list (args->arena, urlv));
+	else
+		rc = _reply_success_json (args->rp,
+				_pack_m1url_list (args->arena, urlv));
 	g_strfreev (urlv);
-	return result;
+	return rc;
 }
 
 static GString *
 _pack_and_freev_pairs (gchar ** pairs)
 {
-	GString *out = g_string_new ("{");
+	GString *out = g_string_sized_new (256);
+	g_string_append_c (out, '{');
 	for (gchar ** pp = pairs; pp && *pp; ++pp) {
-		if (pp != pairs)
-			g_string_append_c (out, ',');
 		gchar *k = *pp;
 		gchar *sep = strchr (k, '=');
-		gchar *v = sep + 1;
-		g_string_append_printf (out, "\"%.*s\":\"%s\"", (int) (sep - k), k, v);
+		if (!sep)
+			continue;
+		if (out->len > 1)
+			g_string_append_c (out, ',');
+		_json_append_string_len (out, k, sep - k);
+		g_string_append_c (out, ':');
+		_json_append_string (out, sep + 1);
 	}
 	g_string_append_c (out, '}');
 	g_strfreev (pairs);
 	return out;
 }
 
+/* The meta1 whose circuit is open are tried after the others, and fail at
+ * once if they are reached */
 static GError *
 _m1_action (const struct req_args_s *args, gchar ** m1v,
 	GError * (*hook) (const gchar * m1))
 {
-	for (gchar ** pm1 = m1v; *pm1; ++pm1) {
-		struct meta1_service_url_s *m1 = meta1_unpack_url (*pm1);
-		if (!m1)
-			continue;
+	GError *err = NULL;
+	gboolean _try (struct meta1_service_url_s *m1) {
+		if (NULL != (err = _req_check_deadline (args)))
+			return TRUE;
 
 		struct addr_info_s m1a;
 		if (!grid_string_to_addrinfo (m1->host, NULL, &m1a)) {
 			GRID_INFO ("Invalid META1 [%s] for [%s]",
 				m1->host, hc_url_get (args->url, HCURL_WHOLE));
-			meta1_service_url_clean (m1);
-			continue;
+			return FALSE;
 		}
 
-		GError *err = hook (m1->host);
-		meta1_service_url_clean (m1);
+		err = upstream_call (upstreams, m1->host, args->deadline, hook);
 		if (!err)
-			return NULL;
-		else if (err->code == CODE_REDIRECT)
+			return TRUE;
+		else if (err->code == CODE_REDIRECT) {
 			g_clear_error (&err);
-		else {
-			g_prefix_error (&err, "META1 error: ");
-			return err;
+			return FALSE;
 		}
+		g_prefix_error (&err, "META1 error: ");
+		return TRUE;
+	}
+
+	struct meta1_service_url_s *later[g_strv_length (m1v) + 1];
+	guint nb_later = 0;
+	for (gchar ** pm1 = m1v; *pm1; ++pm1) {
+		struct meta1_service_url_s *m1 =
+			req_arena_unpack_m1url (args->arena, *pm1);
+		if (!m1)
+			continue;
+		if (!upstream_healthy (upstreams, m1->host))
+			later[nb_later++] = m1;
+		else if (_try (m1))
+			return err;
+	}
+	for (guint i = 0; i < nb_later; ++i) {
+		if (_try (later[i]))
+			return err;
 	}
 	return NEWERROR (CODE_UNAVAILABLE, "No meta1 answered");
 }
@@ -91,40 +162,56 @@ static GError *
 _m1_locate_and_action (const struct req_args_s *args, GError * (*hook) ())
 {
 	gchar **m1v = NULL;
-	GError *err = hc_resolve_reference_directory (resolver, args->url, &m1v);
+	GError *err = _resolve_reference_directory (args, &m1v);
+	if (NULL != err) {
+		g_prefix_error (&err, "No META1: ");
+		return err;
+	}
+	g_assert (m1v != NULL);
+	err = _m1_action (args, m1v, hook);
+	g_strfreev (m1v);
+	return err;
+}
+
+/* For the reads that any meta1 of the reference may serve, tried fastest
+ * first */
+static GError *
+_m1_locate_and_read (const struct req_args_s *args, GError * (*hook) ())
+{
+	gchar **m1v = NULL;
+	GError *err = _resolve_reference_directory (args, &m1v);
 	if (NULL != err) {
 		g_prefix_error (&err, "No META1: ");
 		return err;
 	}
 	g_assert (m1v != NULL);
+	_sort_by_latency (args, m1v);
 	err = _m1_action (args, m1v, hook);
 	g_strfreev (m1v);
 	return err;
 }
 
 static GError *
-decode_json_m1url (struct meta1_service_url_s **out, void *b, gsize blen)
+decode_json_m1url (const struct req_args_s *args,
+		struct meta1_service_url_s **out)
 {
-	struct json_tokener *parser = json_tokener_new ();
-	struct json_object *jbody =
-		json_tokener_parse_ex (parser, (char *) b, blen);
+	struct json_object *jbody = _req_json_parse (args);
 	GError *err = meta1_service_url_load_json_object (jbody, out);
 	json_object_put (jbody);
-	json_tokener_free (parser);
 	return err;
 }
 
+/* The array and the keys are allocated in the arena of the request */
 static GError *
-decode_json_string_array (const gchar * k, gchar *** pkeys, void *b, gsize blen)
+decode_json_string_array (const struct req_args_s *args, const gchar * k,
+		gchar *** pkeys)
 {
-	struct json_tokener *parser;
 	struct json_object *jbody;
 	gchar **keys = NULL;
 	GError *err = NULL;
 
 	// Parse the keys
-	parser = json_tokener_new ();
-	jbody = json_tokener_parse_ex (parser, (char *) b, blen);
+	jbody = _req_json_parse (args);
 	if (!json_object_is_type (jbody, json_type_object)) {
 		err = BADREQ ("Invalid/Unexpected JSON");
 	} else {
@@ -133,28 +220,25 @@ decode_json_string_array (const gchar * k, gchar *** pkeys, void *b, gsize blen)
 			|| !json_object_is_type (jkeys, json_type_array)) {
 			err = BADREQ ("No/Invalid '%s' section", k);
 		} else {
-			GPtrArray *v = g_ptr_array_new ();
+			gint max = json_object_array_length (jkeys);
+			gchar **v = req_arena_alloc (args->arena, (max + 1) * sizeof (gchar *));
 			guint count = 0;
-			for (gint i = json_object_array_length (jkeys); i > 0; --i) {
-				++count;
+			for (gint i = max; i > 0; --i) {
 				struct json_object *item =
 					json_object_array_get_idx (jkeys, i - 1);
 				if (!json_object_is_type (item, json_type_string)) {
-					err = BADREQ ("Invalid key at body['%s'][%u]", k, count);
+					err = BADREQ ("Invalid key at body['%s'][%u]", k, count + 1);
 					break;
 				}
-				g_ptr_array_add (v, g_strdup (json_object_get_string (item)));
-			}
-			if (!err) {
-				g_ptr_array_add (v, NULL);
-				keys = (gchar **) g_ptr_array_free (v, FALSE);
-			} else {
-				g_ptr_array_free (v, TRUE);
+				v[count++] = req_arena_strdup (args->arena,
+						json_object_get_string (item));
 			}
+			v[count] = NULL;
+			if (!err)
+				keys = v;
 		}
 	}
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 	*pkeys = keys;
 	return err;
@@ -166,8 +250,7 @@ static enum http_rc_e
 action_dir_srv_list (const struct req_args_s *args)
 {
 	gchar **urlv = NULL;
-	GError *err = hc_resolve_reference_service (resolver,
-		args->url, args->type, &urlv);
+	GError *err = _resolve_reference_service (args, args->type, &urlv);
 	g_assert ((err != NULL) ^ (urlv != NULL));
 
 	if (!err) {
@@ -178,8 +261,7 @@ action_dir_srv_list (const struct req_args_s *args)
 			return _reply_notfound_error (args->rp,
 				NEWERROR (CODE_NOT_FOUND, "No service linked"));
 		}
-		return _reply_success_json (args->rp,
-			_pack_and_freev_m1url_list (urlv));
+		return _reply_m1url_list (args, urlv);
 	}
 
 	if (err->code == CODE_CONTAINER_NOTFOUND)
@@ -197,7 +279,8 @@ action_dir_srv_unlink (const struct req_args_s *args)
 		GError *err = NULL;
 		meta1v2_remote_unlink_service (&m1a, &err,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			args->type, 30.0, 60.0, NULL);
+			args->type,
+			_req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return err;
 	}
 
@@ -206,7 +289,7 @@ action_dir_srv_unlink (const struct req_args_s *args)
 	if (!err || err->code < 100) {
 		/* Also decache on timeout, a majority of request succeed,
 		 * and it will probably silently succeed  */
-		hc_decache_reference_service (resolver, args->url, args->type);
+		_decache_reference_service (args, args->type);
 	}
 
 	if (!err)
@@ -225,21 +308,24 @@ action_dir_srv_link (const struct req_args_s *args)
 		GError *err = NULL;
 		urlv = meta1v2_remote_link_service (&m1a, &err,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			args->type, 30.0, 60.0, NULL);
+			args->type,
+			_req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return err;
 	}
 
 	GError *err = _m1_locate_and_action (args, hook);
-	if (!err || err->code < 100) {
-		/* Also decache on timeout, a majority of request succeed,
+	if (!err)
+		_install_reference_service (args, args->type, urlv);
+	else if (err->code < 100) {
+		/* Decache on timeout, a majority of request succeed,
 		 * and it will probably silently succeed  */
-		hc_decache_reference_service (resolver, args->url, args->type);
+		_decache_reference_service (args, args->type);
 	}
 
 	if (err)
 		return _reply_soft_error (args->rp, err);
 	g_assert (urlv != NULL);
-	return _reply_success_json (args->rp, _pack_and_freev_m1url_list (urlv));
+	return _reply_m1url_list (args, urlv);
 }
 
 static enum http_rc_e
@@ -255,24 +341,24 @@ action_dir_srv_force (const struct req_args_s *args)
 		GError *e = NULL;
 		meta1v2_remote_force_reference_service (&m1a, &e,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			"", 30.0, 60.0, NULL);
+			"", _req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return e;
 	}
 
 	struct meta1_service_url_s *m1u = NULL;
-	err = decode_json_m1url (&m1u, args->rq->body->data, args->rq->body->len);
-	if (!err || err->code < 100) {
-		/* Also decache on timeout, a majority of request succeed,
-		 * and it will probably silently succeed  */
-		hc_decache_reference_service (resolver, args->url, args->type);
-	}
-
+	err = decode_json_m1url (args, &m1u);
 	if (!err) {
 		url = meta1_pack_url (m1u);
 		meta1_service_url_clean (m1u);
 		err = _m1_locate_and_action (args, hook);
 		g_free (url);
 		url = NULL;
+
+		/* The meta1 does not return the whole list, it is resolved again
+		 * at the next request. Also decache on timeout, a majority of
+		 * request succeed, and it will probably silently succeed */
+		if (!err || err->code < 100)
+			_decache_reference_service (args, args->type);
 	}
 	if (err)
 		return _reply_soft_error (args->rp, err);
@@ -290,22 +376,24 @@ action_dir_srv_renew (const struct req_args_s *args)
 		GError *err = NULL;
 		urlv = meta1v2_remote_poll_reference_service (&m1a, &err,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			args->type, 30.0, 60.0, NULL);
+			args->type,
+			_req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return err;
 	}
 
 	GError *err = _m1_locate_and_action (args, hook);
-
-	if (!err || err->code < 100) {
-		/* Also decache on timeout, a majority of request succeed,
+	if (!err)
+		_install_reference_service (args, args->type, urlv);
+	else if (err->code < 100) {
+		/* Decache on timeout, a majority of request succeed,
 		 * and it will probably silently succeed  */
-		hc_decache_reference_service (resolver, args->url, args->type);
+		_decache_reference_service (args, args->type);
 	}
 
 	if (err)
 		return _reply_soft_error (args->rp, err);
 	g_assert (urlv != NULL);
-	return _reply_success_json (args->rp, _pack_and_freev_m1url_list (urlv));
+	return _reply_m1url_list (args, urlv);
 }
 
 static enum http_rc_e
@@ -332,14 +420,21 @@ action_dir_ref_has (const struct req_args_s *args)
 		GError *err = NULL;
 		meta1v2_remote_has_reference (&m1a, &err,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			30.0, 60.0);
+			_req_timeout (args, 30.0), _req_timeout (args, 60.0));
 		return err;
 	}
-	GError *err = _m1_locate_and_action (args, hook);
+	const gchar *key = hc_url_get (args->url, HCURL_HEXID);
+	if (negcache_has (dir_negcache, key))
+		return _reply_notfound_error (args->rp,
+				NEWERROR (CODE_CONTAINER_NOTFOUND, "Reference not found"));
+	guint64 epoch = negcache_epoch (dir_negcache, key);
+	GError *err = _m1_locate_and_read (args, hook);
 	if (!err)
 		return _reply_success_json (args->rp, NULL);
-	if (err->code == CODE_CONTAINER_NOTFOUND)
+	if (err->code == CODE_CONTAINER_NOTFOUND) {
+		negcache_add (dir_negcache, key, epoch);
 		return _reply_notfound_error (args->rp, err);
+	}
 	return _reply_system_error (args->rp, err);
 }
 
@@ -353,10 +448,13 @@ action_dir_ref_create (const struct req_args_s *args)
 		GError *err = NULL;
 		meta1v2_remote_create_reference (&m1a, &err,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			hc_url_get (args->url, HCURL_REFERENCE), 30.0, 60.0, NULL);
+			hc_url_get (args->url, HCURL_REFERENCE),
+			_req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return err;
 	}
 	GError *err = _m1_locate_and_action (args, hook);
+	/* Whatever the outcome, the reference may exist now */
+	negcache_remove (dir_negcache, hc_url_get (args->url, HCURL_HEXID));
 	if (!err)
 		return _reply_success_json (args->rp, NULL);
 	if (err->code == CODE_CONTAINER_EXISTS)
@@ -374,18 +472,19 @@ action_dir_ref_destroy (const struct req_args_s *args)
 		GError *err = NULL;
 		meta1v2_remote_delete_reference (&m1a, &err,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			30.0, 60.0, NULL);
+			_req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return err;
 	}
 	GError *err = _m1_locate_and_action (args, hook);
 	if (!err || err->code < 100) {
 		/* Also decache on timeout, a majority of request succeed,
 		 * and it will probably silently succeed  */
-		NSINFO_DO(if (srvtypes) {
+		gchar **srvtypes = _nsinfo_get ()->srvtypes;
+		if (srvtypes) {
 			for (gchar ** p = srvtypes; *p; ++p)
-				hc_decache_reference_service (resolver, args->url, *p);
-		});
-		hc_decache_reference (resolver, args->url);
+				_decache_reference_service (args, *p);
+		}
+		_decache_reference (args);
 	}
 	if (!err)
 		return _reply_success_json (args->rp, NULL);
@@ -400,8 +499,7 @@ static enum http_rc_e
 action_dir_prop_get (const struct req_args_s *args)
 {
 	gchar **keys = NULL;
-	GError *err = decode_json_string_array ("keys", &keys,
-		args->rq->body->data, args->rq->body->len);
+	GError *err = decode_json_string_array (args, "keys", &keys);
 
 	// Execute the request
 	gchar **pairs = NULL;
@@ -412,15 +510,12 @@ action_dir_prop_get (const struct req_args_s *args)
 		GError *e = NULL;
 		meta1v2_remote_reference_get_property (&m1a, &e,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			keys, &pairs, 30.0, 60.0);
+			keys, &pairs, _req_timeout (args, 30.0), _req_timeout (args, 60.0));
 		return e;
 	}
 
-	if (!err) {
-		err = _m1_locate_and_action (args, hook);
-		g_strfreev (keys);
-		keys = NULL;
-	}
+	if (!err)
+		err = _m1_locate_and_read (args, hook);
 	if (!err)
 		return _reply_success_json (args->rp, _pack_and_freev_pairs (pairs));
 	return _reply_soft_error (args->rp, err);
@@ -429,14 +524,11 @@ action_dir_prop_get (const struct req_args_s *args)
 static enum http_rc_e
 action_dir_prop_set (const struct req_args_s *args)
 {
-	struct json_tokener *parser;
 	struct json_object *jbody;
 	GError *err = NULL;
 	gchar **pairs = NULL;
 
-	parser = json_tokener_new ();
-	jbody = json_tokener_parse_ex (parser, (char *) args->rq->body->data,
-		args->rq->body->len);
+	jbody = _req_json_parse (args);
 	if (!json_object_is_type (jbody, json_type_object)) {
 		err = BADREQ ("Unexpected JSON");
 	} else {
@@ -445,27 +537,28 @@ action_dir_prop_set (const struct req_args_s *args)
 			|| !json_object_is_type (jpairs, json_type_object)) {
 			err = BADREQ ("No/Invalid 'pairs' section");
 		} else {
-			GPtrArray *v = g_ptr_array_new ();
-			guint count = 0;
+			guint count = json_object_get_object (jpairs)->count;
+			gchar **v = req_arena_alloc (args->arena, (count + 1) * sizeof (gchar *));
+			count = 0;
 			json_object_object_foreach (jpairs, key, val) {
-				++count;
 				if (!json_object_is_type (val, json_type_string)) {
 					err = BADREQ ("Invalid property doc['pairs']['%s']", key);
 					break;
 				}
-				g_ptr_array_add (v, g_strdup_printf ("%s=%s", key,
-						json_object_get_string (val)));
-			}
-			if (!err) {
-				g_ptr_array_add (v, NULL);
-				pairs = (gchar **) g_ptr_array_free (v, FALSE);
-			} else {
-				g_ptr_array_free (v, TRUE);
+				const gchar *s = json_object_get_string (val);
+				gsize lk = strlen (key), ls = strlen (s);
+				gchar *pair = req_arena_alloc (args->arena, lk + ls + 2);
+				memcpy (pair, key, lk);
+				pair[lk] = '=';
+				memcpy (pair + lk + 1, s, ls + 1);
+				v[count++] = pair;
 			}
+			v[count] = NULL;
+			if (!err)
+				pairs = v;
 		}
 	}
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 	GError *hook (const gchar * m1) {
 		struct addr_info_s m1a;
@@ -474,14 +567,12 @@ action_dir_prop_set (const struct req_args_s *args)
 		GError *e = NULL;
 		meta1v2_remote_reference_set_property (&m1a, &e,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			pairs, 30.0, 60.0, NULL);
+			pairs, _req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return e;
 	}
 
-	if (!err) {
+	if (!err)
 		err = _m1_locate_and_action (args, hook);
-		g_free (pairs);
-	}
 	if (!err)
 		return _reply_success_json (args->rp, NULL);
 	return _reply_soft_error (args->rp, err);
@@ -491,8 +582,7 @@ static enum http_rc_e
 action_dir_prop_del (const struct req_args_s *args)
 {
 	gchar **keys = NULL;
-	GError *err = decode_json_string_array ("keys", &keys,
-		args->rq->body->data, args->rq->body->len);
+	GError *err = decode_json_string_array (args, "keys", &keys);
 
 	// Execute the request
 	GError *hook (const gchar * m1) {
@@ -502,40 +592,31 @@ action_dir_prop_del (const struct req_args_s *args)
 		GError *e = NULL;
 		meta1v2_remote_reference_del_property (&m1a, &e,
 			hc_url_get (args->url, HCURL_NS), hc_url_get_id (args->url),
-			keys, 30.0, 60.0, NULL);
+			keys, _req_timeout (args, 30.0), _req_timeout (args, 60.0), NULL);
 		return e;
 	}
 
-	if (!err) {
+	if (!err)
 		err = _m1_locate_and_action (args, hook);
-		g_strfreev (keys);
-		keys = NULL;
-	}
 	if (!err)
 		return _reply_success_json (args->rp, NULL);
 	return _reply_soft_error (args->rp, err);
 }
 
-static enum http_rc_e
-action_directory (struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar *path)
-{
-	static struct req_action_s dir_actions[] = {
-		{"HEAD", "ref/", action_dir_ref_has, TOK_NS | TOK_REF, 0, 0},
-		{"GET", "ref/", action_dir_ref_has, TOK_NS | TOK_REF, 0, 0},
-		{"PUT", "ref/", action_dir_ref_create, TOK_NS | TOK_REF, 0, 0},
-		{"DELETE", "ref/", action_dir_ref_destroy, TOK_NS | TOK_REF, 0, 0},
-
-		{"GET", "srv/", action_dir_srv_list, TOK_NS | TOK_REF | TOK_TYPE, 0, 0},
-		{"HEAD", "srv/", action_dir_srv_list, TOK_NS | TOK_REF | TOK_TYPE, 0, 0},
-		{"DELETE", "srv/", action_dir_srv_unlink, TOK_NS | TOK_REF, 0, 0},
-		{"POST", "srv/", action_dir_srv_action, TOK_NS | TOK_REF, TOK_ACTION, 0},
-
-		{"GET", "prop/", action_dir_prop_get, TOK_NS | TOK_REF, 0, 0},
-		{"DELETE", "prop/", action_dir_prop_del, TOK_NS | TOK_REF, 0, 0},
-		{"POST", "prop/", action_dir_prop_set, TOK_NS | TOK_REF, TOK_ACTION, TOK_STGPOL},
-
-		{NULL, NULL, NULL, 0, 0, 0}
-	};
-	return req_args_call (rq, rp, uri, path, dir_actions);
-}
+static struct req_action_s dir_actions[] = {
+	{"HEAD", "ref/", action_dir_ref_has, TOK_NS | TOK_REF, 0, 0, 0},
+	{"GET", "ref/", action_dir_ref_has, TOK_NS | TOK_REF, 0, 0, 0},
+	{"PUT", "ref/", action_dir_ref_create, TOK_NS | TOK_REF, 0, 0, 0},
+	{"DELETE", "ref/", action_dir_ref_destroy, TOK_NS | TOK_REF, 0, 0, 0},
+
+	{"GET", "srv/", action_dir_srv_list, TOK_NS | TOK_REF | TOK_TYPE, 0, 0, 0},
+	{"HEAD", "srv/", action_dir_srv_list, TOK_NS | TOK_REF | TOK_TYPE, 0, 0, 0},
+	{"DELETE", "srv/", action_dir_srv_unlink, TOK_NS | TOK_REF, 0, 0, 0},
+	{"POST", "srv/", action_dir_srv_action, TOK_NS | TOK_REF, TOK_ACTION, 0, 0},
+
+	{"GET", "prop/", action_dir_prop_get, TOK_NS | TOK_REF, 0, 0, 0},
+	{"DELETE", "prop/", action_dir_prop_del, TOK_NS | TOK_REF, 0, 0, 0},
+	{"POST", "prop/", action_dir_prop_set, TOK_NS | TOK_REF, TOK_ACTION, TOK_STGPOL, 0},
+
+	{NULL, NULL, NULL, 0, 0, 0, 0}
+};
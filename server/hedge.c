@@ -0,0 +1,363 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Hedged calls to replicas. The call is sent to the first replica, and if
+// it did not answer after the hedging delay, to the next one, and so on.
+// The first success wins, and so does the first error >= 400, that all the
+// replicas would return alike. The other errors move to the next replica
+// at once. The attempts run in a pool of threads, because the remote calls
+// are blocking: the attempts still running when the call returns cannot be
+// interrupted, their result is discarded when they finish.
+//
+// Against a hung replica, those attempts hold the threads of the pool. So
+// no attempt is queued: when no thread is free, no hedge is sent, and the
+// attempts that must be sent anyway (the first one, those after an error)
+// run in the thread of the caller, without hedging.
+//
+// The delay is fixed, or follows a percentile of the latency of the
+// successful attempts. The fixed delay is then its floor. The latency
+// histogram is halved every HEDGER_WINDOW samples, so the old samples fade.
+
+#define HEDGER_WINDOW 1024
+
+struct hedge_call_s;
+
+struct hedge_attempt_s {
+	struct hedge_call_s *call;
+	gint64 start;
+	gboolean hedged; // launched by the delay, not after a failure
+	gpointer out;
+	GError *err;
+	gchar target[];
+};
+
+struct hedge_call_s {
+	GCond *cond;
+	guint refs; // the caller and the attempts running
+	gboolean abandoned; // the caller returned
+	GQueue finished;
+	GError * (*run) (gpointer ctx, const gchar *target, gpointer *out);
+	gpointer ctx;
+	GDestroyNotify ctx_free;
+	GDestroyNotify out_free;
+};
+
+struct hedger_s {
+	GStaticMutex lock;
+	GThreadPool *pool;
+	guint threads;
+	guint running; // attempts pushed to the pool and not finished
+	volatile gint delay; // milliseconds, 0 disables the hedging
+	volatile gint percentile; // 0 for the fixed delay only
+	struct histogram_s latency; // of the successful attempts, under the lock
+
+	guint64 calls;
+	guint64 hedges;
+	guint64 hedge_wins;
+	guint64 discarded;
+	guint64 expired;
+	guint64 inlined; // attempts run by the caller, the pool being busy
+	guint64 skipped; // hedges not sent, the pool being busy
+};
+
+struct hedger_stats_s {
+	guint delay;
+	guint percentile;
+	gint64 current; // microseconds, the delay in use
+	guint64 calls;
+	guint64 hedges;
+	guint64 hedge_wins;
+	guint64 discarded;
+	guint64 expired;
+	guint64 inlined;
+	guint64 skipped;
+};
+
+/* Must be called under the lock */
+static void
+_hedge_attempt_free (struct hedge_attempt_s *a)
+{
+	if (a->out && a->call->out_free)
+		a->call->out_free (a->out);
+	if (a->err)
+		g_clear_error (&a->err);
+	g_free (a);
+}
+
+/* Must be called under the lock */
+static void
+_hedge_call_unref (struct hedge_call_s *c)
+{
+	if (--c->refs)
+		return;
+	while (c->finished.length)
+		_hedge_attempt_free (g_queue_pop_head (&c->finished));
+	if (c->ctx_free)
+		c->ctx_free (c->ctx);
+	g_cond_free (c->cond);
+	g_free (c);
+}
+
+static void
+_hedge_worker (gpointer p, gpointer u)
+{
+	struct hedge_attempt_s *a = p;
+	struct hedger_s *h = u;
+	struct hedge_call_s *c = a->call;
+
+	a->err = c->run (c->ctx, a->target, &a->out);
+	gint64 elapsed = g_get_monotonic_time () - a->start;
+
+	g_static_mutex_lock (&h->lock);
+	-- h->running;
+	if (!a->err) {
+		histogram_add (&h->latency, elapsed);
+		if (h->latency.count >= 2 * HEDGER_WINDOW)
+			histogram_halve (&h->latency);
+	}
+	if (c->abandoned) {
+		++ h->discarded;
+		_hedge_attempt_free (a);
+	} else {
+		g_queue_push_tail (&c->finished, a);
+		g_cond_signal (c->cond);
+	}
+	_hedge_call_unref (c);
+	g_static_mutex_unlock (&h->lock);
+}
+
+static struct hedger_s *
+hedger_create (guint threads, guint delay, guint percentile, GError **err)
+{
+	struct hedger_s *h = g_malloc0 (sizeof (*h));
+	g_static_mutex_init (&h->lock);
+	h->delay = delay;
+	h->percentile = MIN (percentile, 100);
+	h->threads = MAX (threads, 1);
+	h->pool = g_thread_pool_new (_hedge_worker, h, h->threads, FALSE, err);
+	if (!h->pool) {
+		g_static_mutex_free (&h->lock);
+		g_free (h);
+		return NULL;
+	}
+	return h;
+}
+
+/* The attempts still queued are dropped, those running are waited for */
+static void
+hedger_destroy (struct hedger_s *h)
+{
+	if (!h)
+		return;
+	g_thread_pool_free (h->pool, TRUE, TRUE);
+	g_static_mutex_free (&h->lock);
+	g_free (h);
+}
+
+static gboolean
+hedger_enabled (struct hedger_s *h)
+{
+	return h && g_atomic_int_get (&h->delay) > 0;
+}
+
+/* Must be called under the lock. Microseconds. */
+static gint64
+_hedger_delay (struct hedger_s *h)
+{
+	gint64 delay = ((gint64) g_atomic_int_get (&h->delay)) * 1000;
+	gint pct = g_atomic_int_get (&h->percentile);
+	if (pct > 0 && h->latency.count >= HEDGER_WINDOW / 8)
+		delay = MAX (delay, histogram_percentile (&h->latency, pct));
+	return delay;
+}
+
+/* Must be called under the lock. The attempts lost or abandoned cannot be
+ * interrupted, they keep their thread until their replica answers. */
+static gboolean
+_hedger_saturated (struct hedger_s *h)
+{
+	return h->running >= h->threads || g_thread_pool_unprocessed (h->pool) > 0;
+}
+
+/* Must be called under the lock */
+static void
+_hedge_launch (struct hedger_s *h, struct hedge_call_s *c,
+		const gchar *target, gboolean hedged)
+{
+	gsize len = strlen (target);
+	struct hedge_attempt_s *a = g_malloc0 (sizeof (*a) + len + 1);
+	memcpy (a->target, target, len + 1);
+	a->call = c;
+	a->hedged = hedged;
+	a->start = g_get_monotonic_time ();
+	++ c->refs;
+	++ h->running;
+	if (hedged)
+		++ h->hedges;
+	g_thread_pool_push (h->pool, a, NULL);
+}
+
+/* Calls 'run' on the 'targets' as explained above. On success, '*out' is
+ * set with the result of the winner, if 'out' is not NULL. 'ctx' is freed
+ * with 'ctx_free' once the last attempt finished, it must not refer to the
+ * stack of the caller. When all the targets failed with errors < 400, the
+ * last one is returned. Past 'deadline' (monotonic, 0 for none), the call
+ * returns without waiting for the attempts still running. */
+static GError *
+hedger_run (struct hedger_s *h, gchar **targets,
+		GError * (*run) (gpointer ctx, const gchar *target, gpointer *out),
+		gpointer ctx, GDestroyNotify ctx_free, GDestroyNotify out_free,
+		gpointer *out, gint64 deadline)
+{
+	struct hedge_call_s *c = g_malloc0 (sizeof (*c));
+	c->cond = g_cond_new ();
+	c->refs = 1;
+	g_queue_init (&c->finished);
+	c->run = run;
+	c->ctx = ctx;
+	c->ctx_free = ctx_free;
+	c->out_free = out_free;
+
+	GError *err = NULL;
+	gboolean done = FALSE;
+	guint next = 0, running = 0, total = g_strv_length (targets);
+	gint64 hedge_at = 0; // monotonic, when the next hedge is due
+
+	/* Must be called under the lock. Keeps the outcome of an attempt, tells
+	 * if the call is over. */
+	gboolean _settle (GError *e, gpointer *po, gboolean hedged) {
+		if (!e) {
+			if (hedged)
+				++ h->hedge_wins;
+			if (out) {
+				*out = *po;
+				*po = NULL;
+			}
+			if (err)
+				g_clear_error (&err);
+			return TRUE;
+		}
+		if (err)
+			g_clear_error (&err);
+		err = e;
+		return err->code >= 400;
+	}
+
+	g_static_mutex_lock (&h->lock);
+	++ h->calls;
+	while (!done && (next < total || running)) {
+		if (deadline && g_get_monotonic_time () >= deadline) {
+			++ h->expired;
+			if (err)
+				g_clear_error (&err);
+			err = _error_deadline ();
+			break;
+		}
+
+		if (!running) {
+			// Nothing in flight, the next target goes to the pool only if a
+			// thread is free for it, it would queue behind stuck attempts.
+			if (!_hedger_saturated (h)) {
+				_hedge_launch (h, c, targets[next++], FALSE);
+				++ running;
+				hedge_at = g_get_monotonic_time () + _hedger_delay (h);
+				continue;
+			}
+			++ h->inlined;
+			const gchar *target = targets[next++];
+			gpointer o = NULL;
+			g_static_mutex_unlock (&h->lock);
+			GError *e = run (ctx, target, &o);
+			g_static_mutex_lock (&h->lock);
+			done = _settle (e, &o, FALSE);
+			if (o && out_free)
+				out_free (o);
+			continue;
+		}
+
+		// The wait ends with the hedging delay or the deadline, the sooner
+		gint64 now = g_get_monotonic_time ();
+		gint64 wait = next < total ? MAX (hedge_at - now, 0) : -1;
+		if (deadline) {
+			gint64 left = MAX (deadline - now, 0);
+			wait = wait < 0 ? left : MIN (wait, left);
+		}
+		GTimeVal until;
+		g_get_current_time (&until);
+		g_time_val_add (&until, MAX (wait, 0));
+		while (!c->finished.length) {
+			if (wait < 0)
+				g_cond_wait (c->cond, g_static_mutex_get_mutex (&h->lock));
+			else if (!g_cond_timed_wait (c->cond,
+						g_static_mutex_get_mutex (&h->lock), &until))
+				break;
+		}
+
+		struct hedge_attempt_s *a = g_queue_pop_head (&c->finished);
+		if (!a) {
+			// The wait follows the wall clock, it may end early
+			now = g_get_monotonic_time ();
+			if (next >= total || now < hedge_at
+					|| (deadline && now >= deadline))
+				continue;
+			// Too slow, try the next replica too, unless the pool is busy:
+			// the hedge would wait for a thread and only add load. It is
+			// then retried after another delay.
+			if (_hedger_saturated (h)) {
+				++ h->skipped;
+				hedge_at = now + MAX (_hedger_delay (h), G_TIME_SPAN_MILLISECOND);
+			} else {
+				_hedge_launch (h, c, targets[next++], TRUE);
+				++ running;
+				hedge_at = now + _hedger_delay (h);
+			}
+			continue;
+		}
+
+		-- running;
+		GError *e = a->err;
+		a->err = NULL;
+		done = _settle (e, &a->out, a->hedged);
+		_hedge_attempt_free (a);
+	}
+	c->abandoned = TRUE;
+	h->discarded += c->finished.length;
+	_hedge_call_unref (c);
+	g_static_mutex_unlock (&h->lock);
+	return err;
+}
+
+static void
+hedger_info (struct hedger_s *h, struct hedger_stats_s *s)
+{
+	memset (s, 0, sizeof (*s));
+	if (!h)
+		return;
+	g_static_mutex_lock (&h->lock);
+	s->delay = g_atomic_int_get (&h->delay);
+	s->percentile = g_atomic_int_get (&h->percentile);
+	s->current = _hedger_delay (h);
+	s->calls = h->calls;
+	s->hedges = h->hedges;
+	s->hedge_wins = h->hedge_wins;
+	s->discarded = h->discarded;
+	s->expired = h->expired;
+	s->inlined = h->inlined;
+	s->skipped = h->skipped;
+	g_static_mutex_unlock (&h->lock);
+}
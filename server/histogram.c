@@ -0,0 +1,137 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Latency histograms with fixed buckets, in microseconds. They are updated
+// by all the workers without any lock, with atomic additions, so that
+// measuring the cache hits does not bring back the contention the shards
+// of the front cache removed. A reader may see a sample in a bucket before
+// it is in the count, the figures are only exact at rest.
+
+#define HISTOGRAM_BUCKETS 14
+
+static const gint64 histogram_bounds[HISTOGRAM_BUCKETS - 1] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 1000000
+};
+
+struct histogram_s {
+	guint64 count;
+	guint64 sum; // microseconds
+	guint64 buckets[HISTOGRAM_BUCKETS]; // the last one has no upper bound
+};
+
+static void
+histogram_add (struct histogram_s *h, gint64 us)
+{
+	guint i = 0;
+	us = MAX (us, 0);
+	while (i < HISTOGRAM_BUCKETS - 1 && us > histogram_bounds[i])
+		++ i;
+	__sync_fetch_and_add (&h->buckets[i], 1);
+	__sync_fetch_and_add (&h->sum, (guint64) us);
+	__sync_fetch_and_add (&h->count, 1);
+}
+
+static void
+histogram_read (struct histogram_s *h, struct histogram_s *out)
+{
+	out->count = __sync_fetch_and_add (&h->count, 0);
+	out->sum = __sync_fetch_and_add (&h->sum, 0);
+	for (guint i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		out->buckets[i] = __sync_fetch_and_add (&h->buckets[i], 0);
+}
+
+/* Returns the upper bound of the bucket holding the 'pct' percentile of the
+ * samples, or the last bound if it is in the unbounded bucket. 0 without
+ * any sample. */
+static gint64
+histogram_percentile (struct histogram_s *h, guint pct)
+{
+	struct histogram_s s;
+	histogram_read (h, &s);
+	if (!s.count)
+		return 0;
+
+	guint64 rank = (s.count * MIN (pct, 100) + 99) / 100, total = 0;
+	for (guint i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+		if ((total += s.buckets[i]) >= rank)
+			return histogram_bounds[i];
+	}
+	return histogram_bounds[HISTOGRAM_BUCKETS - 2];
+}
+
+/* Halves all the figures, so that the old samples weigh less than the
+ * recent ones. Not atomic, the caller serializes it with the additions. */
+static void
+histogram_halve (struct histogram_s *h)
+{
+	h->count = 0;
+	h->sum /= 2;
+	for (guint i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		h->count += (h->buckets[i] /= 2);
+}
+
+/* {"count":N,"sum":US,"le":{"50":N,...,"inf":N}}, the buckets are
+ * cumulative */
+static void
+histogram_json (GString *gstr, struct histogram_s *h)
+{
+	struct histogram_s s;
+	histogram_read (h, &s);
+
+	guint64 total = 0;
+	g_string_append_c (gstr, '{');
+	_json_append_pair_int (gstr, "count", s.count, TRUE);
+	_json_append_pair_int (gstr, "sum", s.sum, FALSE);
+	_json_append_key (gstr, "le", FALSE);
+	g_string_append_c (gstr, '{');
+	for (guint i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		gchar k[32];
+		if (i < HISTOGRAM_BUCKETS - 1)
+			g_snprintf (k, sizeof (k), "%"G_GINT64_FORMAT, histogram_bounds[i]);
+		else
+			g_strlcpy (k, "inf", sizeof (k));
+		total += s.buckets[i];
+		_json_append_pair_int (gstr, k, total, !i);
+	}
+	g_string_append_c (gstr, '}');
+	g_string_append_c (gstr, '}');
+}
+
+/* The same figures as histogram_json(), one property per line */
+static void
+histogram_props (GString *gstr, const gchar *prefix, struct histogram_s *h)
+{
+	struct histogram_s s;
+	histogram_read (h, &s);
+
+	guint64 total = 0;
+	g_string_append_printf (gstr, "%s.count = %"G_GUINT64_FORMAT"\n",
+			prefix, s.count);
+	g_string_append_printf (gstr, "%s.sum = %"G_GUINT64_FORMAT"\n",
+			prefix, s.sum);
+	for (guint i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		total += s.buckets[i];
+		if (i < HISTOGRAM_BUCKETS - 1)
+			g_string_append_printf (gstr, "%s.le_%"G_GINT64_FORMAT" = %"
+					G_GUINT64_FORMAT"\n", prefix, histogram_bounds[i], total);
+		else
+			g_string_append_printf (gstr, "%s.le_inf = %"G_GUINT64_FORMAT"\n",
+					prefix, total);
+	}
+}
@@ -0,0 +1,183 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Typed appenders for the JSON replies. No format string is parsed, and
+// the strings are copied in bulk as long as no character needs escaping.
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+static const gchar json_hex[] = "0123456789abcdef";
+
+static inline gboolean
+_json_needs_escape (guint8 c)
+{
+	return c < 0x20 || c == '"' || c == '\\';
+}
+
+/* Returns the length of the longest prefix of 's' that needs no escaping */
+static gsize
+_json_plain_prefix (const guint8 *s, gsize len)
+{
+	gsize i = 0;
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8 ('"');
+	const __m128i bslash = _mm_set1_epi8 ('\\');
+	const __m128i high = _mm_set1_epi8 ((char) 0xE0);
+	const __m128i zero = _mm_setzero_si128 ();
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+		// (c & 0xE0) == 0 spots the control characters below 0x20
+		__m128i m = _mm_or_si128 (
+				_mm_or_si128 (_mm_cmpeq_epi8 (v, quote),
+					_mm_cmpeq_epi8 (v, bslash)),
+				_mm_cmpeq_epi8 (_mm_and_si128 (v, high), zero));
+		int bits = _mm_movemask_epi8 (m);
+		if (bits)
+			return i + __builtin_ctz (bits);
+	}
+#endif
+	for (; i < len; ++i) {
+		if (_json_needs_escape (s[i]))
+			break;
+	}
+	return i;
+}
+
+/* Ensures 'more' bytes can be appended without reallocation */
+static void
+_json_reserve (GString *gstr, gsize more)
+{
+	gsize len = gstr->len;
+	if (len + more >= gstr->allocated_len) {
+		g_string_set_size (gstr, len + more);
+		g_string_truncate (gstr, len);
+	}
+}
+
+static void
+_json_append_string_len (GString *gstr, const gchar *str, gsize len)
+{
+	const guint8 *s = (const guint8 *) str;
+
+	_json_reserve (gstr, len + 2);
+	g_string_append_c (gstr, '"');
+	while (len > 0) {
+		gsize n = _json_plain_prefix (s, len);
+		if (n)
+			g_string_append_len (gstr, (const gchar *) s, n);
+		if (n == len)
+			break;
+
+		guint8 c = s[n];
+		switch (c) {
+			case '"':
+				g_string_append_len (gstr, "\\\"", 2);
+				break;
+			case '\\':
+				g_string_append_len (gstr, "\\\\", 2);
+				break;
+			case '\n':
+				g_string_append_len (gstr, "\\n", 2);
+				break;
+			case '\r':
+				g_string_append_len (gstr, "\\r", 2);
+				break;
+			case '\t':
+				g_string_append_len (gstr, "\\t", 2);
+				break;
+			default: {
+				gchar u[6] = {'\\', 'u', '0', '0', json_hex[c >> 4], json_hex[c & 0x0F]};
+				g_string_append_len (gstr, u, sizeof (u));
+			}
+		}
+		s += n + 1;
+		len -= n + 1;
+	}
+	g_string_append_c (gstr, '"');
+}
+
+/* A NULL string is encoded as null */
+static void
+_json_append_string (GString *gstr, const gchar *s)
+{
+	if (!s)
+		g_string_append_len (gstr, "null", 4);
+	else
+		_json_append_string_len (gstr, s, strlen (s));
+}
+
+static void
+_json_append_uint (GString *gstr, guint64 u)
+{
+	gchar buf[24], *p = buf + sizeof (buf);
+	do {
+		*(--p) = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	g_string_append_len (gstr, p, buf + sizeof (buf) - p);
+}
+
+static void
+_json_append_int (GString *gstr, gint64 i)
+{
+	if (i < 0) {
+		g_string_append_c (gstr, '-');
+		_json_append_uint (gstr, - (guint64) i);
+	} else {
+		_json_append_uint (gstr, i);
+	}
+}
+
+static void
+_json_append_bool (GString *gstr, gboolean b)
+{
+	if (b)
+		g_string_append_len (gstr, "true", 4);
+	else
+		g_string_append_len (gstr, "false", 5);
+}
+
+/* Appends "key": with a separating comma unless 'first'. The keys are
+ * literals of the proxy, they are not escaped. */
+static void
+_json_append_key (GString *gstr, const gchar *k, gboolean first)
+{
+	if (!first)
+		g_string_append_c (gstr, ',');
+	g_string_append_c (gstr, '"');
+	g_string_append (gstr, k);
+	g_string_append_len (gstr, "\":", 2);
+}
+
+static void
+_json_append_pair_string (GString *gstr, const gchar *k, const gchar *v,
+		gboolean first)
+{
+	_json_append_key (gstr, k, first);
+	_json_append_string (gstr, v);
+}
+
+static void
+_json_append_pair_int (GString *gstr, const gchar *k, gint64 v,
+		gboolean first)
+{
+	_json_append_key (gstr, k, first);
+	_json_append_int (gstr, v);
+}
@@ -22,20 +22,25 @@ static GString *
 _lb_pack_and_free_srvinfo_list (const gchar * ns, const gchar * type,
 	GSList * svc)
 {
-	GString *gstr = g_string_sized_new (512);
+	GString *gstr = g_string_sized_new (128 + 64 * g_slist_length (svc));
 	gchar straddr[128];
 
 	g_string_append_c (gstr, '{');
 	_append_status (gstr, 200, "OK");
-	g_string_append_printf (gstr, ",\"ns\":\"%s\",\"type\":\"%s\","
-		"\"srv\":[", ns, type);
+	_json_append_pair_string (gstr, "ns", ns, FALSE);
+	_json_append_pair_string (gstr, "type", type, FALSE);
+	_json_append_key (gstr, "srv", FALSE);
+	g_string_append_c (gstr, '[');
 
 	for (GSList * l = svc; l; l = l->next) {
 		if (l != svc)
 			g_string_append_c (gstr, ',');
 		struct service_info_s *si = l->data;
-		grid_addrinfo_to_string (&(si->addr), straddr, sizeof (straddr));
-		g_string_append_printf (gstr, "{\"addr\":\"%s\"}", straddr);
+		gsize len = grid_addrinfo_to_string (&(si->addr), straddr, sizeof (straddr));
+		g_string_append_c (gstr, '{');
+		_json_append_key (gstr, "addr", TRUE);
+		_json_append_string_len (gstr, straddr, MIN (len, sizeof (straddr) - 1));
+		g_string_append_c (gstr, '}');
 	}
 
 	g_string_append (gstr, "]}");
@@ -82,6 +87,16 @@ _lb_pack_and_free_srvinfo_tab (struct service_info_s **siv)
 	return gstr;
 }
 
+static GString *
+_lb_mp_pack_srvinfo_tab (struct service_info_s **siv)
+{
+	GString *gstr = g_string_sized_new (512);
+	_mp_append_array (gstr, g_strv_length ((gchar **) siv));
+	for (struct service_info_s **pp = siv; *pp ;pp++)
+		_mp_append_service_info (gstr, *pp);
+	return gstr;
+}
+
 static enum http_rc_e
 _lb (const struct req_args_s *args, struct grid_lb_iterator_s *iter)
 {
@@ -108,7 +123,8 @@ _lb (const struct req_args_s *args, struct grid_lb_iterator_s *iter)
 
 	// Terribly configurable and poorly implemented LB
 	struct storage_class_s *stgcls;
-	NSINFO_DO(stgcls = storage_class_init(&nsinfo, args->stgcls));
+	stgcls = storage_class_init(
+			(struct namespace_info_s *) &_nsinfo_get ()->ni, args->stgcls);
 	struct lb_next_opt_ext_s opt;
 	opt.req.distance = 1;
 	opt.req.max = args->size ? atoi(args->size) : 1;
@@ -131,9 +147,15 @@ _lb (const struct req_args_s *args, struct grid_lb_iterator_s *iter)
 		return _reply_soft_error (args->rp, NEWERROR(
 					CODE_POLICY_NOT_SATISFIABLE, "Too constrained"));
 	} else {
-		GString *gstr = _lb_pack_and_free_srvinfo_tab (siv);
+		enum http_rc_e code;
+		if (args->flags & FLAG_MSGPACK)
+			code = _reply_success_msgpack (args->rp,
+					_lb_mp_pack_srvinfo_tab (siv));
+		else
+			code = _reply_success_json (args->rp,
+					_lb_pack_and_free_srvinfo_tab (siv));
 		service_info_cleanv (siv, FALSE);
-		return _reply_success_json (args->rp, gstr);
+		return code;
 	}
 }
 
@@ -195,29 +217,27 @@ action_lb_hash (const struct req_args_s *args)
 //------------------------------------------------------------------------------
 
 static enum http_rc_e
-action_loadbalancing (struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar *path)
+action_lb_disabled (struct http_request_s *rq, struct http_reply_ctx_s *rp,
+	struct req_uri_s *uri, const gchar *path, gconstpointer action)
 {
-	if (!METACD_LB_ENABLED) {
-		GError *err = NEWERROR (CODE_UNAVAILABLE,
-			"Load-balancer disabled by configuration");
-		return _reply_json (rp, CODE_UNAVAILABLE,
-			"Service unavailable", _create_status_error (err));
-	}
-	static struct req_action_s lb_actions[] = {
-		// Legacy handler
-		{"GET", "sl/", action_lb_sl, TOK_NS | TOK_TYPE, 0, 0},
-
-		// New handlers
-		{"GET", "h/",     action_lb_hash,  TOK_NS|TOK_TYPE, TOK_KEY, TOK_TAGK|TOK_TAGV|TOK_SIZE},
-		{"GET", "def/",   action_lb_def,   TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE},
-		{"GET", "rr/",    action_lb_rr,    TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE},
-		{"GET", "wrr/",   action_lb_wrr,   TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE},
-		{"GET", "rand/",  action_lb_rand,  TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE},
-		{"GET", "wrand/", action_lb_wrand, TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE},
-
-		{NULL, NULL, NULL, 0, 0, 0},
-	};
-	GRID_TRACE2("%s", __FUNCTION__);
-	return req_args_call (rq, rp, uri, path, lb_actions);
+	(void) rq, (void) uri, (void) path, (void) action;
+	GError *err = NEWERROR (CODE_UNAVAILABLE,
+		"Load-balancer disabled by configuration");
+	return _reply_json (rp, CODE_UNAVAILABLE,
+		"Service unavailable", _create_status_error (err));
 }
+
+static struct req_action_s lb_actions[] = {
+	// Legacy handler
+	{"GET", "sl/", action_lb_sl, TOK_NS | TOK_TYPE, 0, 0, 0},
+
+	// New handlers
+	{"GET", "h/",     action_lb_hash,  TOK_NS|TOK_TYPE, TOK_KEY, TOK_TAGK|TOK_TAGV|TOK_SIZE, 0},
+	{"GET", "def/",   action_lb_def,   TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE, 0},
+	{"GET", "rr/",    action_lb_rr,    TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE, 0},
+	{"GET", "wrr/",   action_lb_wrr,   TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE, 0},
+	{"GET", "rand/",  action_lb_rand,  TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE, 0},
+	{"GET", "wrand/", action_lb_wrand, TOK_NS|TOK_TYPE, 0, TOK_TAGK|TOK_TAGV|TOK_SIZE, 0},
+
+	{NULL, NULL, NULL, 0, 0, 0, 0},
+};
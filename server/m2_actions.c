@@ -20,8 +20,25 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <meta2v2/autogen.h>
 #include <meta2v2/generic.h>
 
+/* The meta2 has no paging, the slice of a container listing is computed
+ * by the proxy on the whole listing. Only the slice is encoded. */
+struct list_params_s {
+	const gchar *marker;
+	const gchar *prefix;
+	const gchar *delimiter;
+	gint64 max; // 0 means no limit
+};
+
+struct list_result_s {
+	GSList *beans;
+	GPtrArray *prefixes;
+	gchar *next_marker;
+	gboolean truncated;
+};
+
 static void
-_json_dump_all_beans (GString * gstr, struct hc_url_s *url, GSList * beans)
+_json_dump_all_beans (GString * gstr, struct hc_url_s *url, GSList * beans,
+		const struct list_result_s *lr)
 {
 	g_string_append_c (gstr, '{');
 	_append_status (gstr, 200, "OK");
@@ -29,9 +46,183 @@ _json_dump_all_beans (GString * gstr, struct hc_url_s *url, GSList * beans)
 	_append_url (gstr, url);
 	g_string_append (gstr, ",");
 	meta2_json_dump_all_beans (gstr, beans);
+	if (lr) {
+		_json_append_key (gstr, "prefixes", FALSE);
+		g_string_append_c (gstr, '[');
+		for (guint i = 0; i < lr->prefixes->len; ++i) {
+			if (i)
+				g_string_append_c (gstr, ',');
+			_json_append_string (gstr, lr->prefixes->pdata[i]);
+		}
+		g_string_append_c (gstr, ']');
+		_json_append_key (gstr, "truncated", FALSE);
+		_json_append_bool (gstr, lr->truncated);
+		_json_append_pair_string (gstr, "next_marker", lr->next_marker, FALSE);
+	}
 	g_string_append (gstr, "}");
 }
 
+/* Average size of the JSON encoding of a bean, learned from the previous
+ * replies. The reply buffer is allocated once at the expected size, so that
+ * large listings are not copied by the successive reallocations of the
+ * GString (that transiently hold the old and the new buffer). */
+static volatile gint bean_json_avg = 256;
+
+static GString *
+_json_dump_beans_sized (struct hc_url_s *url, GSList * beans,
+		const struct list_result_s *lr)
+{
+	guint count = g_slist_length (beans);
+	gsize hint = 256 + (gsize) count * (gsize) g_atomic_int_get (&bean_json_avg);
+
+	GString *gstr = g_string_sized_new (hint + hint / 8);
+	_json_dump_all_beans (gstr, url, beans, lr);
+
+	if (count > 16) {
+		gint avg = g_atomic_int_get (&bean_json_avg);
+		gint last = gstr->len / count;
+		g_atomic_int_set (&bean_json_avg, MAX (16, (7 * avg + last) / 8));
+	}
+	return gstr;
+}
+
+/* MessagePack form of the bean sets. Same sections as the JSON form, but the
+ * hexadecimal fields are sent as raw binaries. */
+static void
+_mp_append_bean (GString * gstr, gpointer bean)
+{
+	if (DESCR (bean) == &descr_struct_ALIASES) {
+		_mp_append_map (gstr, 6);
+		_mp_append_key (gstr, "name");
+		_mp_append_gstr (gstr, ALIASES_get_alias (bean));
+		_mp_append_key (gstr, "ver");
+		_mp_append_int (gstr, ALIASES_get_version (bean));
+		_mp_append_key (gstr, "ctime");
+		_mp_append_int (gstr, ALIASES_get_ctime (bean));
+		_mp_append_key (gstr, "header");
+		_mp_append_bin (gstr, ALIASES_get_content_id (bean));
+		_mp_append_key (gstr, "system_metadata");
+		_mp_append_gstr (gstr, ALIASES_get_mdsys (bean));
+		_mp_append_key (gstr, "deleted");
+		_mp_append_bool (gstr, ALIASES_get_deleted (bean));
+	} else if (DESCR (bean) == &descr_struct_CONTENTS_HEADERS) {
+		_mp_append_map (gstr, 4);
+		_mp_append_key (gstr, "id");
+		_mp_append_bin (gstr, CONTENTS_HEADERS_get_id (bean));
+		_mp_append_key (gstr, "hash");
+		_mp_append_bin (gstr, CONTENTS_HEADERS_get_hash (bean));
+		_mp_append_key (gstr, "size");
+		_mp_append_int (gstr, CONTENTS_HEADERS_get_size (bean));
+		_mp_append_key (gstr, "policy");
+		_mp_append_gstr (gstr, CONTENTS_HEADERS_get_policy (bean));
+	} else if (DESCR (bean) == &descr_struct_CONTENTS) {
+		_mp_append_map (gstr, 3);
+		_mp_append_key (gstr, "hdr");
+		_mp_append_bin (gstr, CONTENTS_get_content_id (bean));
+		_mp_append_key (gstr, "pos");
+		_mp_append_gstr (gstr, CONTENTS_get_position (bean));
+		_mp_append_key (gstr, "chunk");
+		_mp_append_gstr (gstr, CONTENTS_get_chunk_id (bean));
+	} else if (DESCR (bean) == &descr_struct_CHUNKS) {
+		_mp_append_map (gstr, 4);
+		_mp_append_key (gstr, "id");
+		_mp_append_gstr (gstr, CHUNKS_get_id (bean));
+		_mp_append_key (gstr, "hash");
+		_mp_append_bin (gstr, CHUNKS_get_hash (bean));
+		_mp_append_key (gstr, "size");
+		_mp_append_int (gstr, CHUNKS_get_size (bean));
+		_mp_append_key (gstr, "ctime");
+		_mp_append_int (gstr, CHUNKS_get_ctime (bean));
+	} else {
+		_mp_append_map (gstr, 5);
+		_mp_append_key (gstr, "alias");
+		_mp_append_gstr (gstr, PROPERTIES_get_alias (bean));
+		_mp_append_key (gstr, "version");
+		_mp_append_int (gstr, PROPERTIES_get_alias_version (bean));
+		_mp_append_key (gstr, "key");
+		_mp_append_gstr (gstr, PROPERTIES_get_key (bean));
+		_mp_append_key (gstr, "value");
+		_mp_append_bin (gstr, PROPERTIES_get_value (bean));
+		_mp_append_key (gstr, "deleted");
+		_mp_append_bool (gstr, PROPERTIES_get_deleted (bean));
+	}
+}
+
+static GString *
+_mp_dump_beans (struct hc_url_s *url, GSList * beans,
+		const struct list_result_s *lr)
+{
+	static const struct {
+		const gchar *section;
+		const struct bean_descriptor_s *descr;
+	} sections[] = {
+		{"aliases", &descr_struct_ALIASES},
+		{"headers", &descr_struct_CONTENTS_HEADERS},
+		{"contents", &descr_struct_CONTENTS},
+		{"chunks", &descr_struct_CHUNKS},
+		{"properties", &descr_struct_PROPERTIES},
+		{NULL, NULL}
+	};
+
+	// The MessagePack containers are prefixed with their size
+	guint counts[5] = {0, 0, 0, 0, 0}, total = 0;
+	for (GSList *l = beans; l; l = l->next) {
+		for (guint i = 0; sections[i].section; ++i) {
+			if (DESCR (l->data) == sections[i].descr) {
+				++ counts[i];
+				++ total;
+				break;
+			}
+		}
+	}
+
+	GString *gstr = g_string_sized_new (256 + (gsize) total *
+			(gsize) g_atomic_int_get (&bean_json_avg));
+	_mp_append_map (gstr, lr ? 11 : 8);
+	_mp_append_status (gstr, 200, "OK");
+	_mp_append_url (gstr, url);
+	for (guint i = 0; sections[i].section; ++i) {
+		_mp_append_str (gstr, sections[i].section);
+		_mp_append_array (gstr, counts[i]);
+		for (GSList *l = beans; l; l = l->next) {
+			if (DESCR (l->data) == sections[i].descr)
+				_mp_append_bean (gstr, l->data);
+		}
+	}
+	if (lr) {
+		_mp_append_key (gstr, "prefixes");
+		_mp_append_array (gstr, lr->prefixes->len);
+		for (guint i = 0; i < lr->prefixes->len; ++i)
+			_mp_append_str (gstr, lr->prefixes->pdata[i]);
+		_mp_append_key (gstr, "truncated");
+		_mp_append_bool (gstr, lr->truncated);
+		_mp_append_key (gstr, "next_marker");
+		_mp_append_str (gstr, lr->next_marker);
+	}
+	return gstr;
+}
+
+/* Replies the bean set in the encoding negotiated with the client */
+static enum http_rc_e
+_reply_bean_set (const struct req_args_s *args, GSList * beans,
+		const struct list_result_s *lr)
+{
+	if (args->flags & FLAG_MSGPACK)
+		return _reply_success_msgpack (args->rp,
+				_mp_dump_beans (args->url, beans, lr));
+	return _reply_success_json (args->rp,
+			_json_dump_beans_sized (args->url, beans, lr));
+}
+
+/* Drops the cached bean sets the request may have altered: those of its
+ * content, or of the whole container for the container operations. */
+static void
+_m2_cache_invalidate (const struct req_args_s *args)
+{
+	contentcache_drop (m2_cache, hc_url_get (args->url, HCURL_HEXID),
+			hc_url_get (args->url, HCURL_PATH));
+}
+
 static enum http_rc_e
 _reply_m2_error (const struct req_args_s *args, GError * err)
 {
@@ -57,10 +248,9 @@ _reply_beans (const struct req_args_s *args, GError * err, GSList * beans)
 		return _reply_notfound_error (args->rp, NEWERROR (404,
 				"No bean found"));
 
-	GString *gstr = g_string_sized_new (512);
-	_json_dump_all_beans (gstr, args->url, beans);
+	enum http_rc_e rc = _reply_bean_set (args, beans, NULL);
 	_bean_cleanl2 (beans);
-	return _reply_success_json (args->rp, gstr);
+	return rc;
 }
 
 static GError *
@@ -77,68 +267,360 @@ _jbody_to_beans (GSList ** beans, struct json_object *jbody, const gchar * k)
 }
 
 static GError *
-_resolve_m2_and_do (struct hc_resolver_s *r, struct hc_url_s *u,
-	GError * (*hook) (struct meta1_service_url_s * m2))
+_resolve_m2 (const struct req_args_s *args, gchar ***m2v)
 {
-	gchar **m2v = NULL;
-	GError *err;
-
-	err = hc_resolve_reference_service (r, u, "meta2", &m2v);
-	g_assert(BOOL(m2v!=NULL) ^ BOOL(err!=NULL));
+	GError *err = _resolve_reference_service (args, "meta2", m2v);
+	g_assert(BOOL(*m2v!=NULL) ^ BOOL(err!=NULL));
 
 	if (NULL != err) {
 		g_prefix_error (&err, "Resolution error: ");
 		return err;
 	}
+	if (!**m2v) {
+		g_strfreev (*m2v);
+		*m2v = NULL;
+		return NEWERROR (CODE_CONTAINER_NOTFOUND, "No meta2 located");
+	}
+	return NULL;
+}
 
-	if (!*m2v)
-		err = NEWERROR (CODE_CONTAINER_NOTFOUND, "No meta2 located");
-	else {
-		for (gchar **pm2 = m2v; *pm2; ++pm2) {
-			struct meta1_service_url_s *m2 = meta1_unpack_url (*pm2);
-			err = hook (m2);
-			meta1_service_url_clean (m2);
+static GError *
+_m2_do (const struct req_args_s *args, gchar **m2v,
+	GError * (*hook) (struct meta1_service_url_s * m2))
+{
+	GError *err = NULL;
+	for (gchar **pm2 = m2v; *pm2; ++pm2) {
+		struct meta1_service_url_s *m2 =
+			req_arena_unpack_m1url (args->arena, *pm2);
+		if (!m2)
+			continue;
+		if ((err = _req_check_deadline (args)) != NULL)
+			return err;
+		GError *call (const gchar *addr) {
+			(void) addr;
+			return hook (m2);
+		}
+		err = upstream_call (upstreams, m2->host, args->deadline, call);
 
-			if (!err)
-				goto exit;
+		if (!err)
+			return NULL;
 
-			GRID_DEBUG ("M2V2 error : (%d) %s", err->code, err->message);
-			g_prefix_error (&err, "M2V2 error: ");
+		GRID_DEBUG ("M2V2 error : (%d) %s", err->code, err->message);
+		g_prefix_error (&err, "M2V2 error: ");
 
-			if (err->code >= 400)
-				goto exit;
-			g_clear_error (&err);
+		if (err->code >= 400)
+			return err;
+		g_clear_error (&err);
+	}
+	return NEWERROR (500, "No META2 replied");
+}
+
+static GError *
+_resolve_m2_and_do (const struct req_args_s *args,
+	GError * (*hook) (struct meta1_service_url_s * m2))
+{
+	gchar **m2v = NULL;
+	GError *err = _resolve_m2 (args, &m2v);
+	if (!err) {
+		err = _m2_do (args, m2v, hook);
+		g_strfreev (m2v);
+	}
+	return err;
+}
+
+/* The idempotent reads, that may be hedged */
+enum m2_read_e { M2_READ_LIST, M2_READ_GET, M2_READ_HAS, M2_READ_PROP_GET };
+
+struct m2_read_s {
+	enum m2_read_e op;
+	struct hc_url_s *url;
+	gint64 deadline; // of the request
+};
+
+static GError *
+_m2_read_exec (struct m2_read_s *r, const gchar *target, GSList **beans)
+{
+	switch (r->op) {
+		case M2_READ_LIST:
+			return m2v2_remote_execute_LIST (target, NULL, r->url, 0, beans);
+		case M2_READ_GET:
+			return m2v2_remote_execute_GET (target, NULL, r->url, 0, beans);
+		case M2_READ_HAS:
+			return m2v2_remote_execute_HAS (target, NULL, r->url);
+		case M2_READ_PROP_GET:
+			return m2v2_remote_execute_PROP_GET (target, NULL, r->url, 0, beans);
+	}
+	g_assert_not_reached ();
+	return NULL;
+}
+
+/* Runs in the hedging pool */
+static GError *
+_m2_read_run (gpointer ctx, const gchar *target, gpointer *out)
+{
+	struct m2_read_s *r = ctx;
+	GError *call (const gchar *addr) {
+		return _m2_read_exec (r, addr, (GSList **) out);
+	}
+	return upstream_call (upstreams, target, r->deadline, call);
+}
+
+static void
+_m2_read_free (struct m2_read_s *r)
+{
+	hc_url_clean (r->url);
+	g_free (r);
+}
+
+/* Like _resolve_m2_and_do(), but the meta2 are tried fastest first, and the
+ * read is hedged among them when the hedging is enabled and the container
+ * has several of them. */
+static GError *
+_resolve_m2_and_read (const struct req_args_s *args, enum m2_read_e op,
+		GSList **beans)
+{
+	gchar **m2v = NULL;
+	GError *err = _resolve_m2 (args, &m2v);
+	if (err)
+		return err;
+	_sort_by_latency (args, m2v);
+
+	if (!hedger_enabled (m2_hedger) || g_strv_length (m2v) < 2) {
+		struct m2_read_s r = {op, args->url, args->deadline};
+		GError *hook (struct meta1_service_url_s *m2) {
+			return _m2_read_exec (&r, m2->host, beans);
 		}
-		if (!err)
-			err = NEWERROR (500, "No META2 replied");
+		err = _m2_do (args, m2v, hook);
+		g_strfreev (m2v);
+		return err;
 	}
-exit:
+
+	GPtrArray *hosts = g_ptr_array_new ();
+	for (gchar **pm2 = m2v; *pm2; ++pm2) {
+		struct meta1_service_url_s *m2 =
+			req_arena_unpack_m1url (args->arena, *pm2);
+		if (m2)
+			g_ptr_array_add (hosts, m2->host);
+	}
+	g_ptr_array_add (hosts, NULL);
 	g_strfreev (m2v);
+	if (hosts->len < 2) {
+		g_ptr_array_free (hosts, TRUE);
+		return NEWERROR (500, "No META2 replied");
+	}
+
+	// The attempts may outlive the request, they own their URL
+	struct m2_read_s *r = g_malloc0 (sizeof (*r));
+	r->op = op;
+	r->url = hc_url_dup (args->url);
+	r->deadline = args->deadline;
+	err = hedger_run (m2_hedger, (gchar **) hosts->pdata, _m2_read_run, r,
+			(GDestroyNotify) _m2_read_free, (GDestroyNotify) _bean_cleanl2,
+			(gpointer *) beans, args->deadline);
+	g_ptr_array_free (hosts, TRUE);
+
+	if (err) {
+		GRID_DEBUG ("M2V2 error : (%d) %s", err->code, err->message);
+		if (err->code < 400) {
+			g_clear_error (&err);
+			return NEWERROR (500, "No META2 replied");
+		}
+		g_prefix_error (&err, "M2V2 error: ");
+	}
 	return err;
 }
 
 //------------------------------------------------------------------------------
 
+static guint
+_gba_hash (gconstpointer p)
+{
+	const GByteArray *gba = p;
+	guint h = 5381;
+	for (guint i = 0; i < gba->len; ++i)
+		h = (h << 5) + h + gba->data[i];
+	return h;
+}
+
+static gboolean
+_gba_equal (gconstpointer p0, gconstpointer p1)
+{
+	const GByteArray *g0 = p0, *g1 = p1;
+	return g0->len == g1->len && !memcmp (g0->data, g1->data, g0->len);
+}
+
+static gint
+_alias_cmp (gconstpointer p0, gconstpointer p1)
+{
+	gpointer a0 = *(gpointer *) p0, a1 = *(gpointer *) p1;
+	int rc = strcmp (ALIASES_get_alias (a0)->str, ALIASES_get_alias (a1)->str);
+	if (rc)
+		return rc;
+	// Latest version first
+	gint64 v0 = ALIASES_get_version (a0), v1 = ALIASES_get_version (a1);
+	return v0 < v1 ? 1 : (v0 > v1 ? -1 : 0);
+}
+
+static void
+_list_result_clean (struct list_result_s *lr)
+{
+	_bean_cleanl2 (lr->beans);
+	if (lr->prefixes)
+		g_ptr_array_free (lr->prefixes, TRUE);
+	g_free (lr->next_marker);
+	memset (lr, 0, sizeof (struct list_result_s));
+}
+
+/* Consumes 'beans': the selected beans are moved into 'out', the others are
+ * freed. 'max' counts the distinct names and the common prefixes, all the
+ * versions of a name are returned in the same slice. */
+static void
+_list_filter (const struct list_params_s *lp, GSList * beans,
+		struct list_result_s *out)
+{
+	GPtrArray *aliases = g_ptr_array_new ();
+	GSList *others = NULL;
+	for (GSList * l = beans; l; l = l->next) {
+		if (DESCR (l->data) == &descr_struct_ALIASES)
+			g_ptr_array_add (aliases, l->data);
+		else
+			others = g_slist_prepend (others, l->data);
+	}
+	g_slist_free (beans);
+	g_ptr_array_sort (aliases, _alias_cmp);
+
+	GHashTable *names = g_hash_table_new (g_str_hash, g_str_equal);
+	GHashTable *contents = g_hash_table_new (_gba_hash, _gba_equal);
+	GHashTable *chunks = g_hash_table_new (g_str_hash, g_str_equal);
+	gsize plen = lp->prefix ? strlen (lp->prefix) : 0;
+	const gchar *last = NULL; // last key accounted in 'max'
+	gsize last_len = 0;
+	gint64 count = 0;
+	guint i;
+
+	out->prefixes = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; i < aliases->len; ++i) {
+		gpointer alias = aliases->pdata[i];
+		const gchar *name = ALIASES_get_alias (alias)->str;
+		if (plen && 0 != strncmp (name, lp->prefix, plen)) {
+			_bean_clean (alias);
+			continue;
+		}
+
+		// The names sharing a prefix up to the delimiter are collapsed in
+		// a single key. The keys follow the order of the names.
+		const gchar *d = lp->delimiter ? strstr (name + plen, lp->delimiter) : NULL;
+		gsize klen = d ? (gsize) (d - name) + strlen (lp->delimiter) : strlen (name);
+		gchar *key = g_strndup (name, klen);
+		gboolean skip = lp->marker && strcmp (key, lp->marker) <= 0;
+		gboolean same = last && last_len == klen && !memcmp (last, key, klen);
+
+		if (!skip && !same) {
+			if (lp->max > 0 && count >= lp->max) {
+				out->truncated = TRUE;
+				g_free (key);
+				break;
+			}
+			++count;
+			last_len = klen;
+			if (d) {
+				g_ptr_array_add (out->prefixes, key);
+				last = key;
+				key = NULL;
+			} else {
+				last = name;
+			}
+		}
+		g_free (key);
+
+		if (skip || d) {
+			_bean_clean (alias);
+		} else {
+			out->beans = g_slist_prepend (out->beans, alias);
+			g_hash_table_insert (names, (gpointer) name, alias);
+			g_hash_table_insert (contents, ALIASES_get_content_id (alias), alias);
+		}
+	}
+	if (out->truncated)
+		out->next_marker = g_strndup (last, last_len);
+	for (; i < aliases->len; ++i)
+		_bean_clean (aliases->pdata[i]);
+	g_ptr_array_free (aliases, TRUE);
+
+	// Keep the beans related to the selected aliases, the chunks are
+	// known once all the contents have been seen.
+	GSList *pending = NULL;
+	for (GSList * l = others; l; l = l->next) {
+		gpointer bean = l->data;
+		gboolean keep = FALSE;
+		if (DESCR (bean) == &descr_struct_CONTENTS_HEADERS)
+			keep = NULL != g_hash_table_lookup (contents, CONTENTS_HEADERS_get_id (bean));
+		else if (DESCR (bean) == &descr_struct_PROPERTIES)
+			keep = NULL != g_hash_table_lookup (names, PROPERTIES_get_alias (bean)->str);
+		else if (DESCR (bean) == &descr_struct_CONTENTS) {
+			keep = NULL != g_hash_table_lookup (contents, CONTENTS_get_content_id (bean));
+			if (keep)
+				g_hash_table_insert (chunks, CONTENTS_get_chunk_id (bean)->str, bean);
+		} else if (DESCR (bean) == &descr_struct_CHUNKS) {
+			pending = g_slist_prepend (pending, bean);
+			continue;
+		}
+		if (keep)
+			out->beans = g_slist_prepend (out->beans, bean);
+		else
+			_bean_clean (bean);
+	}
+	for (GSList * l = pending; l; l = l->next) {
+		if (g_hash_table_lookup (chunks, CHUNKS_get_id (l->data)->str))
+			out->beans = g_slist_prepend (out->beans, l->data);
+		else
+			_bean_clean (l->data);
+	}
+	g_slist_free (pending);
+	g_slist_free (others);
+	g_hash_table_destroy (chunks);
+	g_hash_table_destroy (contents);
+	g_hash_table_destroy (names);
+	out->beans = g_slist_reverse (out->beans);
+}
+
 static enum http_rc_e
 action_m2_container_list (const struct req_args_s *args)
 {
 	// TODO manage snapshot ?
 	GSList *beans = NULL;
-	GError *hook (struct meta1_service_url_s *m2) {
-		return m2v2_remote_execute_LIST (m2->host, NULL, args->url, 0, &beans);
+	gboolean paged = args->marker || args->prefix || args->delimiter || args->max;
+	struct list_params_s lp = {args->marker, args->prefix, args->delimiter, 0};
+	if (args->max) {
+		gchar *end = NULL;
+		lp.max = g_ascii_strtoll (args->max, &end, 10);
+		if ((end && *end) || lp.max <= 0)
+			return _reply_format_error (args->rp, BADREQ ("Invalid max"));
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
-	return _reply_beans (args, err, beans);
+
+	GError *err = _resolve_m2_and_read (args, M2_READ_LIST, &beans);
+	if (err || !paged)
+		return _reply_beans (args, err, beans);
+
+	struct list_result_s lr;
+	memset (&lr, 0, sizeof (lr));
+	_list_filter (&lp, beans, &lr);
+	if (!lr.beans && !lr.prefixes->len && (args->flags & FLAG_NOEMPTY)) {
+		_list_result_clean (&lr);
+		return _reply_notfound_error (args->rp, NEWERROR (404,
+				"No bean found"));
+	}
+
+	enum http_rc_e rc = _reply_bean_set (args, lr.beans, &lr);
+	_list_result_clean (&lr);
+	return rc;
 }
 
 static enum http_rc_e
 action_m2_container_check (const struct req_args_s *args)
 {
 	GError *err;
-	GError *hook (struct meta1_service_url_s *m2) {
-		return m2v2_remote_execute_HAS (m2->host, NULL, args->url);
-	}
-	if (NULL != (err = _resolve_m2_and_do (resolver, args->url, hook))) {
+	if (NULL != (err = _resolve_m2_and_read (args, M2_READ_HAS, NULL))) {
 		if (CODE_CONTAINER_NOTFOUND == err->code)
 			return _reply_notfound_error (args->rp, err);
 		g_prefix_error (&err, "M2 error: ");
@@ -158,7 +640,7 @@ action_m2_container_create (const struct req_args_s *args)
 		};
 		return m2v2_remote_execute_CREATE (m2->host, NULL, args->url, &param);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
 	if (err && err->code == CODE_CONTAINER_NOTFOUND)	// The reference doesn't exist
 		return _reply_forbidden_error (args->rp, err);
 	return _reply_m2_error (args, err);
@@ -170,7 +652,8 @@ action_m2_container_destroy (const struct req_args_s *args)
 	GError *hook (struct meta1_service_url_s *m2) {
 		return m2v2_remote_execute_DESTROY (m2->host, NULL, args->url, 0);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	return _reply_m2_error (args, err);
 }
 
@@ -180,9 +663,11 @@ action_m2_container_purge (const struct req_args_s *args)
 	GSList *beans = NULL;
 	GError *hook (struct meta1_service_url_s *m2) {
 		return m2v2_remote_execute_PURGE (m2->host, NULL,
-			args->url, FALSE, 30.0, 60.0, &beans);
+			args->url, FALSE, _req_timeout (args, 30.0),
+			_req_timeout (args, 60.0), &beans);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	return _reply_beans (args, err, beans);
 }
 
@@ -200,14 +685,13 @@ action_m2_container_dedup (const struct req_args_s *args)
 			if (!first)
 				g_string_append_c (gstr, ',');
 			first = FALSE;
-			g_string_append_c (gstr, '"');
-			g_string_append (gstr, msg);	// TODO escape this!
-			g_string_append_c (gstr, '"');
+			_json_append_string (gstr, msg);
 			g_free (msg);
 		}
 		return e;
 	}
-	err = _resolve_m2_and_do (resolver, args->url, hook);
+	err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	if (NULL != err) {
 		g_string_free (gstr, TRUE);
 		g_prefix_error (&err, "M2 error: ");
@@ -231,17 +715,17 @@ action_m2_container_stgpol (const struct req_args_s *args)
 		return m2v2_remote_execute_STGPOL (m2->host, NULL, args->url,
 			args->stgpol, &beans);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	if (NULL != err) {
 		if (err->code == CODE_CONTAINER_NOTFOUND)
 			return _reply_notfound_error (args->rp, err);
 		return _reply_system_error (args->rp, err);
 	}
 
-	GString *gstr = g_string_sized_new (512);
-	_json_dump_all_beans (gstr, args->url, beans);
+	enum http_rc_e rc = _reply_bean_set (args, beans, NULL);
 	_bean_cleanl2 (beans);
-	return _reply_success_json (args->rp, gstr);
+	return rc;
 }
 
 static enum http_rc_e
@@ -250,7 +734,7 @@ action_m2_container_touch (const struct req_args_s *args)
 	GError *hook (struct meta1_service_url_s *m2) {
 		return m2v2_remote_touch_container_ex (m2->host, NULL, args->url, 0);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
 	if (NULL != err) {
 		if (err->code == CODE_CONTAINER_NOTFOUND)
 			return _reply_notfound_error (args->rp, err);
@@ -283,16 +767,12 @@ action_m2_container_list_prop (const struct req_args_s *args)
 {
 	// TODO manage snapshot ?
 	GSList *beans = NULL;
-	GError *hook (struct meta1_service_url_s *m2) {
-		return m2v2_remote_execute_PROP_GET (m2->host, NULL, args->url, 0,
-				&beans);
-	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_read (args, M2_READ_PROP_GET, &beans);
 	return _reply_beans (args, err, beans);
 }
 
 static GError *
-_m2_json_prop_set (struct hc_url_s *url, struct json_object *jbody,
+_m2_json_prop_set (const struct req_args_s *args, struct json_object *jbody,
 		gboolean delete)
 {
 	GSList *beans = NULL;
@@ -313,9 +793,11 @@ _m2_json_prop_set (struct hc_url_s *url, struct json_object *jbody,
 	}
 
 	GError *hook (struct meta1_service_url_s * m2) {
-		return m2v2_remote_execute_PROP_SET (m2->host, NULL, url, 0, beans);
+		return m2v2_remote_execute_PROP_SET (m2->host, NULL, args->url, 0, beans);
 	}
-	err = _resolve_m2_and_do (resolver, url, hook);
+	err = _resolve_m2_and_do (args, hook);
+	if (hc_url_get (args->url, HCURL_PATH))
+		_m2_cache_invalidate (args);
 	_bean_cleanl2 (beans);
 	return err;
 }
@@ -337,7 +819,7 @@ _m2_container_prop_set (const struct req_args_s *args, gboolean delete)
 		 goto exit;
 	}
 
-	parser = json_tokener_new ();
+	parser = _req_json_tokener ();
 	do {
 		jbody = json_tokener_parse_ex(parser, json_string, json_string_len);
 	}
@@ -347,10 +829,9 @@ _m2_container_prop_set (const struct req_args_s *args, gboolean delete)
 		GSETERROR(&err, "Failed to parse json body: %s",
 				json_tokener_error_desc(jerr));
 	} else
-		err = _m2_json_prop_set (args->url, jbody, delete);
+		err = _m2_json_prop_set (args, jbody, delete);
 
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 exit:
 	if (err != NULL)
@@ -390,7 +871,7 @@ action_m2_content_beans (const struct req_args_s *args)
 		return m2v2_remote_execute_BEANS (m2->host, NULL, args->url,
 			args->stgpol, size, 0, &beans);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
 	return _reply_beans (args, err, beans);
 }
 
@@ -401,7 +882,7 @@ action_m2_content_copy (const struct req_args_s *args)
 		return m2v2_remote_execute_COPY (m2->host, NULL, args->url, "NYI");
 	}
 	GError *err;
-	if (NULL != (err = _resolve_m2_and_do (resolver, args->url, hook))) {
+	if (NULL != (err = _resolve_m2_and_do (args, hook))) {
 		g_prefix_error (&err, "M2 error: ");
 		return _reply_soft_error (args->rp, err);
 	}
@@ -410,7 +891,7 @@ action_m2_content_copy (const struct req_args_s *args)
 }
 
 static GError *
-_m2_json_spare (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
+_m2_json_spare (const struct req_args_s *args, struct json_object *jbody, GSList ** out)
 {
 	GSList *notin = NULL, *broken = NULL;
 	GError *err;
@@ -424,10 +905,11 @@ _m2_json_spare (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 
 	GSList *obeans = NULL;
 	GError *hook (struct meta1_service_url_s * m2) {
-		return m2v2_remote_execute_SPARE (m2->host, NULL, url,
-			hc_url_get_option_value (url, "stgpol"), notin, broken, &obeans);
+		return m2v2_remote_execute_SPARE (m2->host, NULL, args->url,
+			hc_url_get_option_value (args->url, "stgpol"), notin, broken, &obeans);
 	}
-	err = _resolve_m2_and_do (resolver, url, hook);
+	err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	_bean_cleanl2 (broken);
 	_bean_cleanl2 (notin);
 	g_assert ((err != NULL) ^ (obeans != NULL));
@@ -441,23 +923,19 @@ _m2_json_spare (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 static enum http_rc_e
 action_m2_content_spare (const struct req_args_s *args)
 {
-	struct json_tokener *parser;
 	struct json_object *jbody;
 	GSList *beans = NULL;
 	GError *err;
 
-	parser = json_tokener_new ();
-	g_byte_array_append (args->rq->body, (guint8 *) "", 1);
-	jbody = json_tokener_parse ((gchar *) args->rq->body->data);
-	err = _m2_json_spare (args->url, jbody, &beans);
+	jbody = _req_json_parse (args);
+	err = _m2_json_spare (args, jbody, &beans);
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 	return _reply_beans (args, err, beans);
 }
 
 static GError *
-_m2_json_append (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
+_m2_json_append (const struct req_args_s *args, struct json_object *jbody, GSList ** out)
 {
 	GSList *ibeans = NULL, *obeans = NULL;
 	GError *err;
@@ -469,10 +947,11 @@ _m2_json_append (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 	}
 
 	GError *hook (struct meta1_service_url_s * m2) {
-		return m2v2_remote_execute_APPEND (m2->host, NULL, url, ibeans,
+		return m2v2_remote_execute_APPEND (m2->host, NULL, args->url, ibeans,
 			&obeans);
 	}
-	err = _resolve_m2_and_do (resolver, url, hook);
+	err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	_bean_cleanl2 (ibeans);
 	g_assert ((err != NULL) ^ (obeans != NULL));
 	if (!err)
@@ -485,41 +964,33 @@ _m2_json_append (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 static enum http_rc_e
 action_m2_content_append (const struct req_args_s *args)
 {
-	struct json_tokener *parser;
 	struct json_object *jbody;
 	GSList *beans = NULL;
 	GError *err;
 
-	parser = json_tokener_new ();
-	g_byte_array_append (args->rq->body, (guint8 *) "", 1);
-	jbody = json_tokener_parse ((gchar *) args->rq->body->data);
-	err = _m2_json_append (args->url, jbody, &beans);
+	jbody = _req_json_parse (args);
+	err = _m2_json_append (args, jbody, &beans);
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 	return _reply_beans (args, err, beans);
 }
 
 static GError *
-_m2_json_overwrite (struct hc_url_s *url, struct json_object *jbody)
+_m2_json_overwrite (const struct req_args_s *args, struct json_object *jbody)
 {
-	(void) url, (void) jbody;
+	(void) args, (void) jbody;
 	return NEWERROR (500, "Not implemented");
 }
 
 static enum http_rc_e
 action_m2_content_overwrite (const struct req_args_s *args)
 {
-	struct json_tokener *parser;
 	struct json_object *jbody;
 	GError *err;
 
-	parser = json_tokener_new ();
-	g_byte_array_append (args->rq->body, (guint8 *) "", 1);
-	jbody = json_tokener_parse ((gchar *) args->rq->body->data);
-	err = _m2_json_overwrite (args->url, jbody);
+	jbody = _req_json_parse (args);
+	err = _m2_json_overwrite (args, jbody);
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 	if (!err)
 		return _reply_success_json (args->rp, NULL);
@@ -533,7 +1004,7 @@ action_m2_content_touch (const struct req_args_s *args)
 	GError *hook (struct meta1_service_url_s *m2) {
 		return m2v2_remote_touch_content (m2->host, NULL, args->url);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
 	if (NULL != err) {
 		if (err->code == CODE_CONTAINER_NOTFOUND || err->code == CODE_CONTENT_NOTFOUND)
 			return _reply_notfound_error (args->rp, err);
@@ -553,7 +1024,8 @@ action_m2_content_stgpol (const struct req_args_s *args)
 		return m2v2_remote_execute_STGPOL (m2->host, NULL, args->url,
 				args->stgpol, NULL);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	if (NULL != err) {
 		if (err->code == CODE_CONTAINER_NOTFOUND || err->code == CODE_CONTENT_NOTFOUND)
 			return _reply_notfound_error (args->rp, err);
@@ -587,7 +1059,7 @@ action_m2_content_action (const struct req_args_s *args)
 }
 
 static GError *
-_m2_json_put (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
+_m2_json_put (const struct req_args_s *args, struct json_object *jbody, GSList ** out)
 {
 	GSList *ibeans = NULL, *obeans = NULL;
 	GError *err;
@@ -599,11 +1071,11 @@ _m2_json_put (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 	// Check the path in the URL matches the name of each alias
 	for (GSList * l = ibeans; l; l = l->next) {
 		if (DESCR (l->data) == &descr_struct_ALIASES) {
-			if (0 != strcmp (hc_url_get (url, HCURL_PATH),
+			if (0 != strcmp (hc_url_get (args->url, HCURL_PATH),
 					ALIASES_get_alias (l->data)->str)) {
 				err =
 					NEWERROR (400, "Path mismatch, (%s) vs (%s)",
-					hc_url_get (url, HCURL_PATH),
+					hc_url_get (args->url, HCURL_PATH),
 					ALIASES_get_alias (l->data)->str);
 				_bean_cleanl2 (ibeans);
 				return err;
@@ -612,9 +1084,10 @@ _m2_json_put (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 	}
 
 	GError *hook (struct meta1_service_url_s * m2) {
-		return m2v2_remote_execute_PUT (m2->host, NULL, url, ibeans, &obeans);
+		return m2v2_remote_execute_PUT (m2->host, NULL, args->url, ibeans, &obeans);
 	}
-	err = _resolve_m2_and_do (resolver, url, hook);
+	err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	_bean_cleanl2 (ibeans);
 	g_assert ((err != NULL) ^ (obeans != NULL));
 	if (!err)
@@ -627,17 +1100,13 @@ _m2_json_put (struct hc_url_s *url, struct json_object *jbody, GSList ** out)
 static enum http_rc_e
 action_m2_content_put (const struct req_args_s *args)
 {
-	struct json_tokener *parser;
 	struct json_object *jbody;
 	GSList *beans = NULL;
 	GError *err;
 
-	parser = json_tokener_new ();
-	jbody = json_tokener_parse_ex (parser, (char *) args->rq->body->data,
-		args->rq->body->len);
-	err = _m2_json_put (args->url, jbody, &beans);
+	jbody = _req_json_parse (args);
+	err = _m2_json_put (args, jbody, &beans);
 	json_object_put (jbody);
-	json_tokener_free (parser);
 
 	return _reply_beans (args, err, beans);
 }
@@ -650,7 +1119,8 @@ action_m2_content_delete (const struct req_args_s *args)
 		return m2v2_remote_execute_DEL (m2->host, NULL, args->url,
 			TRUE /*sync_del?! */ , &beans);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_do (args, hook);
+	_m2_cache_invalidate (args);
 	return _reply_beans (args, err, beans);
 }
 
@@ -658,23 +1128,42 @@ static enum http_rc_e
 action_m2_content_check (const struct req_args_s *args)
 {
 	GSList *beans = NULL;
-	GError *hook (struct meta1_service_url_s *m2) {
-		return m2v2_remote_execute_GET (m2->host, NULL, args->url, 0, &beans);
-	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
+	GError *err = _resolve_m2_and_read (args, M2_READ_GET, &beans);
 	_bean_cleanl2 (beans);
 	return _reply_beans (args, err, NULL);
 }
 
+/* The bean sets are served from the content cache, unless the client
+ * refuses it. Only the successful and non-empty replies are cached. */
 static enum http_rc_e
 action_m2_content_get (const struct req_args_s *args)
 {
-	GSList *beans = NULL;
-	GError *hook (struct meta1_service_url_s *m2) {
-		return m2v2_remote_execute_GET (m2->host, NULL, args->url, 0, &beans);
+	const gchar *hexid = hc_url_get (args->url, HCURL_HEXID);
+	const gchar *path = hc_url_get (args->url, HCURL_PATH);
+	gboolean msgpack = BOOL (args->flags & FLAG_MSGPACK);
+	GString *body = NULL;
+
+	if (!(args->flags & FLAG_NOCACHE))
+		body = contentcache_get (m2_cache, hexid, path, args->version, msgpack);
+	if (body) {
+		args->rp->add_header ("X-Cache", g_strdup ("HIT"));
+		return msgpack ? _reply_success_msgpack (args->rp, body)
+			: _reply_success_json (args->rp, body);
 	}
-	GError *err = _resolve_m2_and_do (resolver, args->url, hook);
-	return _reply_beans (args, err, beans);
+
+	guint64 gen = contentcache_generation (m2_cache);
+	GSList *beans = NULL;
+	GError *err = _resolve_m2_and_read (args, M2_READ_GET, &beans);
+	if (err || !beans)
+		return _reply_beans (args, err, beans);
+
+	body = msgpack ? _mp_dump_beans (args->url, beans, NULL)
+		: _json_dump_beans_sized (args->url, beans, NULL);
+	_bean_cleanl2 (beans);
+	contentcache_put (m2_cache, hexid, path, args->version, msgpack, body, gen);
+	args->rp->add_header ("X-Cache", g_strdup ("MISS"));
+	return msgpack ? _reply_success_msgpack (args->rp, body)
+		: _reply_success_json (args->rp, body);
 }
 
 static enum http_rc_e
@@ -683,54 +1172,48 @@ action_m2_get (const struct req_args_s *args)
 	return action_m2_content_get (args);
 }
 
-static enum http_rc_e
-action_meta2 (struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar *path)
-{
-	static struct req_action_s m2_actions[] = {
-		// Legacy
-		{"GET", "get/", action_m2_get,
-			TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION},
-
-		{"PUT", "container/prop/", action_m2_container_prop_put,
-			TOK_NS | TOK_REF, 0, 0},
-		{"GET", "container/prop/", action_m2_container_list_prop,
-			TOK_NS | TOK_REF, 0, 0},
-		{"DELETE", "container/prop/", action_m2_container_prop_del,
-			TOK_NS | TOK_REF, 0, 0},
-
-		{"PUT", "container/", action_m2_container_create,
-			TOK_NS | TOK_REF, 0, 0},
-		{"GET", "container/", action_m2_container_list,
-			TOK_NS | TOK_REF, 0, 0},
-		{"HEAD", "container/", action_m2_container_check,
-			TOK_NS | TOK_REF, 0, 0},
-		{"DELETE", "container/", action_m2_container_destroy,
-			TOK_NS | TOK_REF, 0, 0},
-		{"POST", "container/", action_m2_container_action,
-			TOK_NS | TOK_REF, TOK_ACTION, TOK_STGPOL},
-		// purge, dedup, touch, stgpol
-
-		{"PUT", "content/prop/", action_m2_container_prop_put,
-			TOK_NS | TOK_REF | TOK_PATH, 0, 0},
-		{"GET", "content/prop/", action_m2_container_list_prop,
-			TOK_NS | TOK_REF | TOK_PATH, 0, 0},
-		{"DELETE", "content/prop/", action_m2_container_prop_del,
-			TOK_NS | TOK_REF | TOK_PATH, 0, 0},
-
-		{"PUT", "content/", action_m2_content_put,
-			TOK_NS | TOK_REF | TOK_PATH, 0, 0},
-		{"GET", "content/", action_m2_content_get,
-			TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION},
-		{"HEAD", "content/", action_m2_content_check,
-			TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION},
-		{"DELETE", "content/", action_m2_content_delete,
-			TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION},
-		{"POST", "content/", action_m2_content_action,
-			TOK_NS | TOK_REF | TOK_PATH, TOK_ACTION, TOK_STGPOL | TOK_SIZE},
-		// beans, copy, touch, stgpol, append, spare, overwrite
-
-		{NULL, NULL, NULL, 0, 0, 0}
-	};
-	return req_args_call (rq, rp, uri, path, m2_actions);
-}
+static struct req_action_s m2_actions[] = {
+	// Legacy
+	{"GET", "get/", action_m2_get,
+		TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION, 0},
+
+	{"PUT", "container/prop/", action_m2_container_prop_put,
+		TOK_NS | TOK_REF, 0, 0, 0},
+	{"GET", "container/prop/", action_m2_container_list_prop,
+		TOK_NS | TOK_REF, 0, 0, 0},
+	{"DELETE", "container/prop/", action_m2_container_prop_del,
+		TOK_NS | TOK_REF, 0, 0, 0},
+
+	{"PUT", "container/", action_m2_container_create,
+		TOK_NS | TOK_REF, 0, 0, 0},
+	{"GET", "container/", action_m2_container_list,
+		TOK_NS | TOK_REF, 0, TOK_MARKER | TOK_PREFIX | TOK_DELIMITER | TOK_MAX, 0},
+	{"HEAD", "container/", action_m2_container_check,
+		TOK_NS | TOK_REF, 0, 0, 0},
+	{"DELETE", "container/", action_m2_container_destroy,
+		TOK_NS | TOK_REF, 0, 0, 0},
+	{"POST", "container/", action_m2_container_action,
+		TOK_NS | TOK_REF, TOK_ACTION, TOK_STGPOL, 0},
+	// purge, dedup, touch, stgpol
+
+	{"PUT", "content/prop/", action_m2_container_prop_put,
+		TOK_NS | TOK_REF | TOK_PATH, 0, 0, 0},
+	{"GET", "content/prop/", action_m2_container_list_prop,
+		TOK_NS | TOK_REF | TOK_PATH, 0, 0, 0},
+	{"DELETE", "content/prop/", action_m2_container_prop_del,
+		TOK_NS | TOK_REF | TOK_PATH, 0, 0, 0},
+
+	{"PUT", "content/", action_m2_content_put,
+		TOK_NS | TOK_REF | TOK_PATH, 0, 0, 0},
+	{"GET", "content/", action_m2_content_get,
+		TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION, 0},
+	{"HEAD", "content/", action_m2_content_check,
+		TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION, 0},
+	{"DELETE", "content/", action_m2_content_delete,
+		TOK_NS | TOK_REF | TOK_PATH, 0, TOK_VERSION, 0},
+	{"POST", "content/", action_m2_content_action,
+		TOK_NS | TOK_REF | TOK_PATH, TOK_ACTION, TOK_STGPOL | TOK_SIZE, 0},
+	// beans, copy, touch, stgpol, append, spare, overwrite
+
+	{NULL, NULL, NULL, 0, 0, 0, 0}
+};
@@ -63,13 +63,112 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define RESOLVD_DEFAULT_MAX_CSM0 0
 #endif
 
+#ifndef RESOLVD_DEFAULT_SHARDS_FRONT
+#define RESOLVD_DEFAULT_SHARDS_FRONT 64
+#endif
+
+#ifndef RESOLVD_DEFAULT_TTL_FRONT
+#define RESOLVD_DEFAULT_TTL_FRONT 30
+#endif
+
+#ifndef RESOLVD_DEFAULT_HARD_TTL_FRONT
+#define RESOLVD_DEFAULT_HARD_TTL_FRONT 300
+#endif
+
+#ifndef RESOLVD_DEFAULT_REFRESH_THREADS
+#define RESOLVD_DEFAULT_REFRESH_THREADS 4
+#endif
+
+#ifndef RESOLVD_DEFAULT_REFRESH_FAILURES
+#define RESOLVD_DEFAULT_REFRESH_FAILURES 3
+#endif
+
+#ifndef RESOLVD_DEFAULT_MAX_FRONT
+#define RESOLVD_DEFAULT_MAX_FRONT 100000
+#endif
+
+#ifndef RESOLVD_DEFAULT_BYTES_FRONT_HIGH
+#define RESOLVD_DEFAULT_BYTES_FRONT_HIGH 0
+#endif
+
+#ifndef RESOLVD_DEFAULT_BYTES_FRONT_LOW
+#define RESOLVD_DEFAULT_BYTES_FRONT_LOW 0
+#endif
+
+#ifndef RESOLVD_DEFAULT_COALESCE_WAIT
+#define RESOLVD_DEFAULT_COALESCE_WAIT 2000
+#endif
+
+#ifndef RESOLVD_DEFAULT_TTL_NEGATIVE
+#define RESOLVD_DEFAULT_TTL_NEGATIVE 5
+#endif
+
+#ifndef RESOLVD_DEFAULT_MAX_NEGATIVE
+#define RESOLVD_DEFAULT_MAX_NEGATIVE 50000
+#endif
+
+#ifndef M2_DEFAULT_TTL_CONTENT
+#define M2_DEFAULT_TTL_CONTENT 5
+#endif
+
+#ifndef M2_DEFAULT_MAX_CONTENT
+#define M2_DEFAULT_MAX_CONTENT 0
+#endif
+
+#ifndef UPSTREAM_DEFAULT_MAX
+#define UPSTREAM_DEFAULT_MAX 64
+#endif
+
+#ifndef UPSTREAM_DEFAULT_WAIT
+#define UPSTREAM_DEFAULT_WAIT 1000
+#endif
+
+#ifndef UPSTREAM_DEFAULT_IDLE
+#define UPSTREAM_DEFAULT_IDLE 300
+#endif
+
+#ifndef UPSTREAM_DEFAULT_FAILURES
+#define UPSTREAM_DEFAULT_FAILURES 5
+#endif
+
+#ifndef UPSTREAM_DEFAULT_BACKOFF
+#define UPSTREAM_DEFAULT_BACKOFF 1000
+#endif
+
+#ifndef UPSTREAM_DEFAULT_WEIGHT
+#define UPSTREAM_DEFAULT_WEIGHT 20
+#endif
+
+#ifndef M2_DEFAULT_HEDGE_DELAY
+#define M2_DEFAULT_HEDGE_DELAY 0
+#endif
+
+#ifndef M2_DEFAULT_HEDGE_PERCENTILE
+#define M2_DEFAULT_HEDGE_PERCENTILE 0
+#endif
+
+#ifndef M2_DEFAULT_HEDGE_THREADS
+#define M2_DEFAULT_HEDGE_THREADS 32
+#endif
+
 #define XTRACE() GRID_TRACE2("%s (%s)", __FUNCTION__, hc_url_get(args->url, HCURL_WHOLE))
 
 static struct http_request_dispatcher_s *dispatcher = NULL;
 static struct network_server_s *server = NULL;
 
+static struct route_index_s *routes = NULL;
+
 static gchar *nsname = NULL;
 static struct hc_resolver_s *resolver = NULL;
+static struct negcache_s *dir_negcache = NULL;
+static struct shardcache_s *dir_front = NULL;
+static struct singleflight_s *dir_inflight = NULL;
+static GThreadPool *dir_refresher = NULL;
+static struct contentcache_s *m2_cache = NULL;
+static struct hedger_s *m2_hedger = NULL;
+static struct upstreams_s *upstreams = NULL;
+static struct srvlists_s *cs_srvlists = NULL;
+static volatile gint dir_refresh_stopping = 0;
 static struct grid_lbpool_s *lbpool = NULL;
 
 static struct lru_tree_s *push_queue = NULL;
@@ -88,14 +187,31 @@ static GThread *admin_thread = NULL;
 static GThread *upstream_thread = NULL;
 static GThread *downstream_thread = NULL;
 
-static struct namespace_info_s nsinfo;
-static gchar **srvtypes = NULL;
-static GStaticMutex nsinfo_mutex;
-#define NSINFO_DO(Action) do { \
-	g_static_mutex_lock(&nsinfo_mutex); \
-	Action ; \
-	g_static_mutex_unlock(&nsinfo_mutex); \
-} while (0)
+/* The namespace info and the service types are published by the admin
+ * thread in immutable snapshots. The workers read the current snapshot with
+ * a single atomic load and never lock. A replaced snapshot is kept for a
+ * grace period before being freed, longer than any worker holds it: the
+ * workers must not keep a snapshot beyond the request they are serving, and
+ * must not hold it across a network call. */
+struct nsinfo_snapshot_s {
+	struct namespace_info_s ni;
+	gchar **srvtypes;
+	GHashTable *srvtypes_set; // keys point into srvtypes
+	gint64 retired;
+};
+
+#ifndef NSINFO_GRACE_PERIOD
+#define NSINFO_GRACE_PERIOD (10 * G_TIME_SPAN_SECOND)
+#endif
+
+static struct nsinfo_snapshot_s *nsinfo_current = NULL;
+static GSList *nsinfo_retired = NULL; // only used by the admin thread
+
+static const struct nsinfo_snapshot_s *
+_nsinfo_get (void)
+{
+	return g_atomic_pointer_get (&nsinfo_current);
+}
 
 // Configuration
 static gint timeout_cs_push = 4000;
@@ -108,12 +224,54 @@ static guint dir_low_ttl = RESOLVD_DEFAULT_TTL_SERVICES;
 static guint dir_low_max = RESOLVD_DEFAULT_MAX_SERVICES;
 static guint dir_high_ttl = RESOLVD_DEFAULT_TTL_CSM0;
 static guint dir_high_max = RESOLVD_DEFAULT_MAX_CSM0;
+static guint dir_front_shards = RESOLVD_DEFAULT_SHARDS_FRONT;
+static guint dir_front_ttl = RESOLVD_DEFAULT_TTL_FRONT;
+static guint dir_front_max = RESOLVD_DEFAULT_MAX_FRONT;
+static guint64 dir_front_bytes_high = RESOLVD_DEFAULT_BYTES_FRONT_HIGH;
+static guint64 dir_front_bytes_low = RESOLVD_DEFAULT_BYTES_FRONT_LOW;
+static guint dir_front_hard_ttl = RESOLVD_DEFAULT_HARD_TTL_FRONT;
+static guint dir_refresh_threads = RESOLVD_DEFAULT_REFRESH_THREADS;
+static guint dir_refresh_failures = RESOLVD_DEFAULT_REFRESH_FAILURES;
+static GString *dir_front_snapshot = NULL;
+static guint m2_cache_ttl = M2_DEFAULT_TTL_CONTENT;
+static guint m2_cache_max = M2_DEFAULT_MAX_CONTENT;
+static guint m2_hedge_delay = M2_DEFAULT_HEDGE_DELAY;
+static guint m2_hedge_percentile = M2_DEFAULT_HEDGE_PERCENTILE;
+static guint m2_hedge_threads = M2_DEFAULT_HEDGE_THREADS;
+static guint upstream_max = UPSTREAM_DEFAULT_MAX;
+static guint upstream_wait = UPSTREAM_DEFAULT_WAIT;
+static guint upstream_idle = UPSTREAM_DEFAULT_IDLE;
+static guint upstream_failures = UPSTREAM_DEFAULT_FAILURES;
+static guint upstream_backoff = UPSTREAM_DEFAULT_BACKOFF;
+static guint upstream_weight = UPSTREAM_DEFAULT_WEIGHT;
+static guint dir_coalesce_wait = RESOLVD_DEFAULT_COALESCE_WAIT;
+static guint dir_neg_ttl = RESOLVD_DEFAULT_TTL_NEGATIVE;
+static guint dir_neg_max = RESOLVD_DEFAULT_MAX_NEGATIVE;
+
+static guint compress_min_size = 1024;
+static gint compress_level = 6;
 
 static gboolean validate_namespace (const gchar * ns);
 static gboolean validate_srvtype (const gchar * n);
 
+#include "arena.c"
+#include "json.c"
+#include "msgpack.c"
 #include "reply.c"
+#include "compress.c"
 #include "url.c"
+#include "route.c"
+#include "histogram.c"
+#include "negcache.c"
+#include "twheel.c"
+#include "shardcache.c"
+#include "snapshot.c"
+#include "singleflight.c"
+#include "hedge.c"
+#include "upstream.c"
+#include "resolve.c"
+#include "contentcache.c"
+#include "srvlists.c"
 
 #include "dir_actions.c"
 #include "lb_actions.c"
@@ -125,9 +283,9 @@ static gboolean validate_srvtype (const gchar * n);
 
 static enum http_rc_e
 action_status(struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar *path)
+	struct req_uri_s *uri, const gchar *path, gconstpointer action)
 {
-	(void) uri, (void) path;
+	(void) uri, (void) path, (void) action;
 
 	if (0 == strcasecmp("HEAD", rq->cmd))
 		return _reply_success_json(rp, NULL);
@@ -155,6 +313,69 @@ action_status(struct http_request_s *rq, struct http_reply_ctx_s *rp,
 	g_string_append_printf(gstr, "cache.srv.ttl = %lu\n", s.services.ttl);
 	g_string_append_printf(gstr, "cache.srv.clock = %lu\n", s.clock);
 
+	struct shardcache_stats_s fs;
+	shardcache_info (dir_front, &fs);
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+		const gchar *tier = t == SHARDCACHE_TIER_HIGH ? "dir" : "srv";
+		const struct shardcache_counters_s *c = fs.tiers + t;
+		gchar prefix[64];
+		g_snprintf (prefix, sizeof (prefix), "cache.%s.front", tier);
+		g_string_append_printf(gstr, "%s.count = %u\n", prefix, fs.counts[t]);
+		g_string_append_printf(gstr, "%s.bytes = %"G_GUINT64_FORMAT"\n", prefix, fs.bytes[t]);
+		g_string_append_printf(gstr, "%s.max_bytes = %"G_GUINT64_FORMAT"\n", prefix, fs.max_bytes[t]);
+		g_string_append_printf(gstr, "%s.max = %u\n", prefix, fs.max_counts[t]);
+		g_string_append_printf(gstr, "%s.ttl = %u\n", prefix, fs.ttls[t]);
+		g_string_append_printf(gstr, "%s.hard_ttl = %u\n", prefix, fs.hard_ttls[t]);
+		g_string_append_printf(gstr, "%s.hits = %"G_GUINT64_FORMAT"\n", prefix, c->hits);
+		g_string_append_printf(gstr, "%s.misses = %"G_GUINT64_FORMAT"\n", prefix, c->misses);
+		g_string_append_printf(gstr, "%s.inserts = %"G_GUINT64_FORMAT"\n", prefix, c->inserts);
+		g_string_append_printf(gstr, "%s.evictions = %"G_GUINT64_FORMAT"\n", prefix, c->evictions);
+		g_string_append_printf(gstr, "%s.expiries = %"G_GUINT64_FORMAT"\n", prefix, c->expiries);
+		g_string_append_printf(gstr, "%s.decaches = %"G_GUINT64_FORMAT"\n", prefix, c->decaches);
+		g_string_append_printf(gstr, "%s.stale = %"G_GUINT64_FORMAT"\n", prefix, c->stale);
+		g_snprintf (prefix, sizeof (prefix), "cache.%s.latency.cached", tier);
+		histogram_props (gstr, prefix, &dir_latency[t].cached);
+		g_snprintf (prefix, sizeof (prefix), "cache.%s.latency.upstream", tier);
+		histogram_props (gstr, prefix, &dir_latency[t].upstream);
+	}
+
+	struct upstreams_stats_s us;
+	upstreams_info (upstreams, &us);
+	g_string_append_printf(gstr, "upstream.count = %u\n", us.count);
+	g_string_append_printf(gstr, "upstream.inflight = %u\n", us.inflight);
+	g_string_append_printf(gstr, "upstream.max = %u\n", us.max);
+	g_string_append_printf(gstr, "upstream.dials = %"G_GUINT64_FORMAT"\n", us.dials);
+	g_string_append_printf(gstr, "upstream.waits = %"G_GUINT64_FORMAT"\n", us.waits);
+	g_string_append_printf(gstr, "upstream.timeouts = %"G_GUINT64_FORMAT"\n", us.timeouts);
+	g_string_append_printf(gstr, "upstream.errors = %"G_GUINT64_FORMAT"\n", us.errors);
+	g_string_append_printf(gstr, "upstream.reaped = %"G_GUINT64_FORMAT"\n", us.reaped);
+	g_string_append_printf(gstr, "upstream.circuit.threshold = %u\n", us.threshold);
+	g_string_append_printf(gstr, "upstream.circuit.backoff = %u\n", us.backoff);
+	g_string_append_printf(gstr, "upstream.circuit.count = %u\n", us.open);
+	g_string_append_printf(gstr, "upstream.circuit.opens = %"G_GUINT64_FORMAT"\n", us.opens);
+	g_string_append_printf(gstr, "upstream.circuit.probes = %"G_GUINT64_FORMAT"\n", us.probes);
+	g_string_append_printf(gstr, "upstream.circuit.closes = %"G_GUINT64_FORMAT"\n", us.closes);
+	g_string_append_printf(gstr, "upstream.circuit.rejected = %"G_GUINT64_FORMAT"\n", us.rejected);
+	upstreams_circuits (gstr, "upstream.circuit.addr", upstreams);
+	g_string_append_printf(gstr, "upstream.ewma.weight = %u\n", us.weight);
+	upstreams_ewma (gstr, "upstream.ewma", upstreams);
+
+	if (m2_hedger) {
+		struct hedger_stats_s hs;
+		hedger_info (m2_hedger, &hs);
+		g_string_append_printf(gstr, "m2.hedge.delay = %u\n", hs.delay);
+		g_string_append_printf(gstr, "m2.hedge.percentile = %u\n", hs.percentile);
+		g_string_append_printf(gstr, "m2.hedge.current = %"G_GINT64_FORMAT"\n", hs.current);
+		g_string_append_printf(gstr, "m2.hedge.calls = %"G_GUINT64_FORMAT"\n", hs.calls);
+		g_string_append_printf(gstr, "m2.hedge.hedges = %"G_GUINT64_FORMAT"\n", hs.hedges);
+		g_string_append_printf(gstr, "m2.hedge.wins = %"G_GUINT64_FORMAT"\n", hs.hedge_wins);
+		g_string_append_printf(gstr, "m2.hedge.discarded = %"G_GUINT64_FORMAT"\n", hs.discarded);
+		g_string_append_printf(gstr, "m2.hedge.expired = %"G_GUINT64_FORMAT"\n", hs.expired);
+		g_string_append_printf(gstr, "m2.hedge.inlined = %"G_GUINT64_FORMAT"\n", hs.inlined);
+		g_string_append_printf(gstr, "m2.hedge.skipped = %"G_GUINT64_FORMAT"\n", hs.skipped);
+		histogram_props (gstr, "m2.hedge.latency", &m2_hedger->latency);
+	}
+
 	rp->set_body_gstr(gstr);
 	rp->set_status(200, "OK");
 	rp->set_content_type("text/x-java-properties");
@@ -166,43 +387,60 @@ static enum http_rc_e
 handler_action (gpointer u, struct http_request_s *rq,
 	struct http_reply_ctx_s *rp)
 {
-	static struct action_s {
-		const gchar *prefix;
-		enum http_rc_e (*hook) (
-				struct http_request_s * rq,
-				struct http_reply_ctx_s * rp,
-				struct req_uri_s *uri,
-				const gchar *path);
-	} actions[] = {
-		// Legacy request handlers
-		{"lb/", action_loadbalancing},
-
-		// New request handlers
-		{"m2/", action_meta2},
-		{"cs/", action_conscience},
-		{"dir/", action_directory},
-		{"cache/", action_cache},
-		{"status", action_status},
-		{NULL, NULL}
-	};
-
 	(void) u;
-	struct req_uri_s ruri = {NULL, NULL, NULL, NULL};
-	_req_uri_extract_components (rq->req_uri, &ruri);
+	struct req_arena_s arena;
+	struct req_uri_s ruri;
+
+	req_arena_init (&arena);
+	_req_uri_extract_components (rq->req_uri, &ruri, &arena);
 	GRID_TRACE2("URI path[%s] query[%s] fragment[%s]",
 			ruri.path, ruri.query, ruri.fragment);
 
-	for (struct action_s * pa = actions; pa->prefix; ++pa) {
-		if (g_str_has_prefix (ruri.path + 1, pa->prefix)) {
-			enum http_rc_e rc = pa->hook (rq, rp, &ruri,
-					ruri.path + 1 + strlen (pa->prefix));
-			_req_uri_free_components(&ruri);
-			return rc;
-		}
+	const gchar *path = ruri.path;
+	if (*path == '/')
+		++ path;
+
+	// The bodies are compressed on their way to the original reply context
+	enum http_rc_e _dispatch (struct http_reply_ctx_s *rpz) {
+		gsize len = 0;
+		gboolean matched = FALSE;
+		const struct route_s *route = route_index_lookup (routes, path,
+				_http_method_parse (rq->cmd), &len, &matched);
+		if (route)
+			return route->call (rq, rpz, &ruri, path + len, route->action);
+		if (matched)
+			return _reply_method_error (rpz);
+		return _reply_no_handler (rpz);
 	}
+	enum http_rc_e rc = _reply_compressing (rq, rp, _http_encoding_negotiate (
+				g_tree_lookup (rq->tree_headers, "accept-encoding")), _dispatch);
 
 	_req_uri_free_components(&ruri);
-	return _reply_no_handler (rp);
+	return rc;
+}
+
+static struct route_index_s *
+_build_routes (void)
+{
+	struct route_index_s *ri = route_index_create ();
+
+	// Legacy request handlers
+	if (METACD_LB_ENABLED)
+		route_index_add_actions (ri, "lb/", lb_actions);
+	else
+		route_index_add (ri, "lb/", "", NULL, action_lb_disabled, NULL);
+
+	// New request handlers
+	route_index_add_actions (ri, "m2/", m2_actions);
+	route_index_add_actions (ri, "cs/", cs_actions);
+	route_index_add_actions (ri, "dir/", dir_actions);
+	for (struct cache_action_s *pa = cache_actions; pa->prefix; ++pa)
+		route_index_add (ri, "cache/", pa->prefix, pa->method,
+				cache_args_call, pa);
+	route_index_add (ri, "status", "", NULL, action_status, NULL);
+
+	route_index_compile (ri);
+	return ri;
 }
 
 static gboolean
@@ -214,12 +452,9 @@ validate_namespace (const gchar * ns)
 static gboolean
 validate_srvtype (const gchar * n)
 {
-	gboolean rc = FALSE;
-	NSINFO_DO(if (srvtypes) {
-		for (gchar ** p = srvtypes; !rc && *p; ++p)
-			rc = !strcmp (*p, n);
-	});
-	return rc;
+	const struct nsinfo_snapshot_s *snap = _nsinfo_get ();
+	return snap->srvtypes_set
+		&& NULL != g_hash_table_lookup (snap->srvtypes_set, n);
 }
 
 static struct lru_tree_s *
@@ -229,6 +464,59 @@ _push_queue_create (void)
 			(GDestroyNotify) service_info_clean, LTO_NOATIME);
 }
 
+// Namespace snapshots ---------------------------------------------------------
+
+static void
+_nsinfo_snapshot_free (struct nsinfo_snapshot_s *snap)
+{
+	if (!snap)
+		return;
+	if (snap->srvtypes_set)
+		g_hash_table_destroy (snap->srvtypes_set);
+	if (snap->srvtypes)
+		g_strfreev (snap->srvtypes);
+	namespace_info_clear (&snap->ni);
+	g_free (snap);
+}
+
+/* Takes ownership of 'srvtypes' */
+static struct nsinfo_snapshot_s *
+_nsinfo_snapshot_create (struct namespace_info_s *ni, gchar **srvtypes)
+{
+	struct nsinfo_snapshot_s *snap = g_malloc0 (sizeof (*snap));
+	namespace_info_copy (ni, &snap->ni, NULL);
+	snap->srvtypes = srvtypes;
+	if (srvtypes) {
+		snap->srvtypes_set = g_hash_table_new (g_str_hash, g_str_equal);
+		for (gchar **p = srvtypes; *p; ++p)
+			g_hash_table_insert (snap->srvtypes_set, *p, *p);
+	}
+	return snap;
+}
+
+/* Only called by the admin thread, or before/after the workers run. */
+static void
+_nsinfo_publish (struct nsinfo_snapshot_s *snap)
+{
+	gint64 now = g_get_monotonic_time ();
+	struct nsinfo_snapshot_s *old = nsinfo_current;
+	g_atomic_pointer_set (&nsinfo_current, snap);
+
+	if (old) {
+		old->retired = now;
+		nsinfo_retired = g_slist_append (nsinfo_retired, old);
+	}
+
+	// Oldest first
+	while (nsinfo_retired) {
+		struct nsinfo_snapshot_s *r = nsinfo_retired->data;
+		if (snap && now - r->retired < NSINFO_GRACE_PERIOD)
+			break;
+		nsinfo_retired = g_slist_delete_link (nsinfo_retired, nsinfo_retired);
+		_nsinfo_snapshot_free (r);
+	}
+}
+
 // Administrative tasks --------------------------------------------------------
 
 static void
@@ -243,6 +531,38 @@ _task_expire_resolver (struct hc_resolver_s *r)
 		GRID_DEBUG ("Purged %u resolver ", count);
 }
 
+static void
+_task_expire_negcache (struct negcache_s *nc)
+{
+	guint count = negcache_expire (nc);
+	if (count)
+		GRID_DEBUG ("Expired %u unknown references", count);
+}
+
+static void
+_task_expire_front (struct shardcache_s *sc)
+{
+	guint count = shardcache_expire (sc);
+	if (count)
+		GRID_DEBUG ("Expired %u front resolutions", count);
+}
+
+static void
+_task_expire_content (struct contentcache_s *cc)
+{
+	guint count = contentcache_expire (cc);
+	if (count)
+		GRID_DEBUG ("Expired %u contents", count);
+}
+
+static void
+_task_reap_upstreams (struct upstreams_s *ups)
+{
+	guint count = upstreams_reap (ups, upstream_idle);
+	if (count)
+		GRID_DEBUG ("Reaped %u idle upstream addresses", count);
+}
+
 static void
 _task_reload_lbpool (struct grid_lbpool_s *p)
 {
@@ -261,6 +581,13 @@ _task_reload_lbpool (struct grid_lbpool_s *p)
 	}
 }
 
+static void
+_task_reload_srvlists (gpointer p)
+{
+	(void) p;
+	_cs_reload_srvlists ();
+}
+
 static void
 _task_reload_nsinfo (gpointer p)
 {
@@ -273,7 +600,9 @@ _task_reload_nsinfo (gpointer p)
 			nsname, err->code, err->message);
 		g_clear_error (&err);
 	} else {
-		NSINFO_DO(namespace_info_copy (ni, &nsinfo, NULL));
+		const struct nsinfo_snapshot_s *cur = _nsinfo_get ();
+		_nsinfo_publish (_nsinfo_snapshot_create (ni,
+				cur->srvtypes ? g_strdupv (cur->srvtypes) : NULL));
 		namespace_info_free (ni);
 	}
 }
@@ -295,12 +624,9 @@ _task_reload_srvtypes (gpointer p)
 	g_slist_free (_l);
 	_l = NULL;
 
-	NSINFO_DO(register gchar **tmp = srvtypes;
-	srvtypes = newset;
-	newset = tmp;);
-
-	if (newset)
-		g_strfreev (newset);
+	const struct nsinfo_snapshot_s *cur = _nsinfo_get ();
+	_nsinfo_publish (_nsinfo_snapshot_create (
+			(struct namespace_info_s *) &cur->ni, newset));
 }
 
 // Poll some elements and forward them
@@ -327,8 +653,13 @@ _task_push (gpointer p)
 		if (!grid_string_to_addrinfo (cs, NULL, &csaddr)) {
 			GRID_ERROR("Push error: %s", "Invalid conscience address for NS");
 		} else {
-			GError *err = NULL;
-			gcluster_push_services (&csaddr, timeout_cs_push, tmp, TRUE, &err);
+			GError *push (const gchar *addr) {
+				(void) addr;
+				GError *e = NULL;
+				gcluster_push_services (&csaddr, timeout_cs_push, tmp, TRUE, &e);
+				return e;
+			}
+			GError *err = upstream_call (upstreams, cs, 0, push);
 			if (err != NULL) {
 				GRID_WARN("Push error: (%d) %s", err->code, err->message);
 				g_clear_error(&err);
@@ -411,6 +742,76 @@ grid_main_get_options (void)
 			"Directory 'high' (cs+meta0) TTL for cache elements"},
 		{"DirHighMax", OT_UINT, {.u = &dir_high_max},
 			"Directory 'high' (cs+meta0) MAX cached elements"},
+		{"DirFrontShards", OT_UINT, {.u = &dir_front_shards},
+			"Directory front cache shards, rounded to a power of 2\n"
+			"\t\t0 to disable the front cache"},
+		{"DirFrontTtl", OT_UINT, {.u = &dir_front_ttl},
+			"Directory front cache TTL for cache elements, stale past it"},
+		{"DirFrontHardTtl", OT_UINT, {.u = &dir_front_hard_ttl},
+			"Directory front cache TTL for the stale elements"},
+		{"DirRefreshThreads", OT_UINT, {.u = &dir_refresh_threads},
+			"Threads refreshing the stale elements of the front cache\n"
+			"\t\t0 to never serve stale elements"},
+		{"DirRefreshFailures", OT_UINT, {.u = &dir_refresh_failures},
+			"Failed refreshes in a row before a stale element is evicted"},
+		{"DirFrontSnapshot", OT_STRING, {.str = &dir_front_snapshot},
+			"File the front cache is dumped to at exit, and loaded from at\n"
+			"\t\tstartup. Empty to disable"},
+		{"DirFrontMax", OT_UINT, {.u = &dir_front_max},
+			"Directory front cache MAX cached elements"},
+		{"DirFrontBytesHigh", OT_UINT64, {.u64 = &dir_front_bytes_high},
+			"Directory front cache MAX bytes held by the meta1 locations\n"
+			"\t\t0 for no limit"},
+		{"DirFrontBytesLow", OT_UINT64, {.u64 = &dir_front_bytes_low},
+			"Directory front cache MAX bytes held by the services\n"
+			"\t\t0 for no limit"},
+		{"DirCoalesceWait", OT_UINT, {.u = &dir_coalesce_wait},
+			"Max wait for a concurrent resolution of the same reference (ms)\n"
+			"\t\t0 to disable the coalescing"},
+		{"DirNegTtl", OT_UINT, {.u = &dir_neg_ttl},
+			"Directory TTL for the unknown references"},
+		{"DirNegMax", OT_UINT, {.u = &dir_neg_max},
+			"Directory MAX cached unknown references"},
+
+		{"M2CacheTtl", OT_UINT, {.u = &m2_cache_ttl},
+			"TTL of the contents cached for GET /m2/content"},
+		{"M2CacheMax", OT_UINT, {.u = &m2_cache_max},
+			"MAX size of the contents cached for GET /m2/content (bytes)\n"
+			"\t\t0 to disable the content cache"},
+		{"UpstreamMax", OT_UINT, {.u = &upstream_max},
+			"MAX concurrent calls toward a meta1, meta2 or conscience\n"
+			"\t\t0 for no limit"},
+		{"UpstreamWait", OT_UINT, {.u = &upstream_wait},
+			"MAX wait for a call slot toward an upstream address (ms)"},
+		{"UpstreamIdle", OT_UINT, {.u = &upstream_idle},
+			"Delay before an idle upstream address is forgotten (s)"},
+		{"UpstreamFailures", OT_UINT, {.u = &upstream_failures},
+			"Consecutive network errors opening the circuit of an address\n"
+			"\t\t0 to disable the circuit breakers"},
+		{"UpstreamBackoff", OT_UINT, {.u = &upstream_backoff},
+			"Delay before an open circuit lets a probe through (ms),\n"
+			"\t\tdoubled at each failed probe"},
+		{"UpstreamWeight", OT_UINT, {.u = &upstream_weight},
+			"Weight of a call in the latency averages of its address (%),\n"
+			"\t\t0 to try the replicas of the reads in the resolver order"},
+		{"RequestDeadline", OT_UINT, {.u = &request_deadline},
+			"Default time budget of a request (ms), X-Deadline-Ms shortens it\n"
+			"\t\t0 for no deadline"},
+
+		{"M2HedgeDelay", OT_UINT, {.u = &m2_hedge_delay},
+			"Delay before a read is also sent to the next meta2 (ms)\n"
+			"\t\t0 to disable the hedged reads"},
+		{"M2HedgePercentile", OT_UINT, {.u = &m2_hedge_percentile},
+			"Percentile of the meta2 read latency used as hedging delay,\n"
+			"\t\tM2HedgeDelay being its floor. 0 for the fixed delay"},
+		{"M2HedgeThreads", OT_UINT, {.u = &m2_hedge_threads},
+			"Threads running the hedged meta2 reads"},
+
+		{"CompressMin", OT_UINT, {.u = &compress_min_size},
+			"Minimal size of a reply body to be compressed (bytes)"},
+		{"CompressLevel", OT_INT, {.i = &compress_level},
+			"zlib compression level of the reply bodies (1-9)\n"
+			"\t\t0 to disable the compression"},
 		{NULL, 0, {.i = 0}, NULL}
 	};
 
@@ -443,6 +844,14 @@ grid_main_specific_fini (void)
 	_stop_queue (&upstream_gtq, &upstream_thread);
 	_stop_queue (&downstream_gtq, &downstream_thread);
 
+	// The refreshes still queued are skipped, the running ones use the
+	// resolver and the caches destroyed below.
+	if (dir_refresher) {
+		g_atomic_int_set (&dir_refresh_stopping, 1);
+		g_thread_pool_free (dir_refresher, FALSE, TRUE);
+		dir_refresher = NULL;
+	}
+
 	if (server) {
 		network_server_close_servers (server);
 		network_server_stop (server);
@@ -453,6 +862,10 @@ grid_main_specific_fini (void)
 		http_request_dispatcher_clean (dispatcher);
 		dispatcher = NULL;
 	}
+	if (routes) {
+		route_index_destroy (routes);
+		routes = NULL;
+	}
 	if (lbpool) {
 		grid_lbpool_destroy (lbpool);
 		lbpool = NULL;
@@ -461,9 +874,52 @@ grid_main_specific_fini (void)
 		hc_resolver_destroy (resolver);
 		resolver = NULL;
 	}
-	namespace_info_clear (&nsinfo);
+	if (dir_negcache) {
+		negcache_destroy (dir_negcache);
+		dir_negcache = NULL;
+	}
+	if (dir_front && dir_front_snapshot && dir_front_snapshot->len) {
+		guint count = 0;
+		GError *err = snapshot_dump (dir_front, dir_front_snapshot->str, &count);
+		if (err) {
+			GRID_WARN ("RESOLVER front dump failed : (%d) %s",
+					err->code, err->message);
+			g_clear_error (&err);
+		} else {
+			GRID_INFO ("RESOLVER front dumped %u elements to [%s]",
+					count, dir_front_snapshot->str);
+		}
+	}
+	if (dir_front_snapshot) {
+		g_string_free (dir_front_snapshot, TRUE);
+		dir_front_snapshot = NULL;
+	}
+	if (dir_front) {
+		shardcache_destroy (dir_front);
+		dir_front = NULL;
+	}
+	if (dir_inflight) {
+		singleflight_destroy (dir_inflight);
+		dir_inflight = NULL;
+	}
+	if (m2_cache) {
+		contentcache_destroy (m2_cache);
+		m2_cache = NULL;
+	}
+	if (m2_hedger) {
+		hedger_destroy (m2_hedger);
+		m2_hedger = NULL;
+	}
+	if (upstreams) {
+		upstreams_destroy (upstreams);
+		upstreams = NULL;
+	}
+	if (cs_srvlists) {
+		srvlists_destroy (cs_srvlists);
+		cs_srvlists = NULL;
+	}
+	_nsinfo_publish (NULL);
 	metautils_str_clean (&nsname);
-	g_static_mutex_free(&nsinfo_mutex);
 	g_static_mutex_free(&push_mutex);
 }
 
@@ -481,15 +937,18 @@ grid_main_configure (int argc, char **argv)
 	}
 
 	g_static_mutex_init (&push_mutex);
-	g_static_mutex_init (&nsinfo_mutex);
 
 	nsname = g_strdup (argv[1]);
 	metautils_strlcpy_physical_ns (nsname, argv[1], strlen (nsname) + 1);
 
-	memset (&nsinfo, 0, sizeof (nsinfo));
-	metautils_strlcpy_physical_ns (nsinfo.name, argv[1], sizeof (nsinfo.name));
-	nsinfo.chunk_size = 1;
+	struct namespace_info_s ni;
+	memset (&ni, 0, sizeof (ni));
+	metautils_strlcpy_physical_ns (ni.name, argv[1], sizeof (ni.name));
+	ni.chunk_size = 1;
+	_nsinfo_publish (_nsinfo_snapshot_create (&ni, NULL));
+	namespace_info_clear (&ni);
 
+	routes = _build_routes ();
 	dispatcher = transport_http_build_dispatcher (NULL, all_requests);
 	server = network_server_init ();
 	resolver = hc_resolver_create ();
@@ -504,6 +963,80 @@ grid_main_configure (int argc, char **argv)
 			dir_high_max, dir_high_ttl, dir_low_max, dir_low_ttl);
 	}
 
+	if (dir_front_shards > 0) {
+		guint hard_ttl = dir_refresh_threads > 0 ? dir_front_hard_ttl : 0;
+		dir_front = shardcache_create (dir_front_shards, dir_front_max,
+				dir_front_ttl, hard_ttl);
+		shardcache_set_bytes (dir_front, SHARDCACHE_TIER_HIGH,
+				dir_front_bytes_high);
+		shardcache_set_bytes (dir_front, SHARDCACHE_TIER_LOW,
+				dir_front_bytes_low);
+		GRID_INFO ("RESOLVER front limits [%u/%u/%u] in %u shards",
+			dir_front_max, dir_front_ttl, MAX (dir_front_ttl, hard_ttl),
+			dir_front->mask + 1);
+		GRID_INFO ("RESOLVER front bytes HIGH[%"G_GUINT64_FORMAT"]"
+			" LOW[%"G_GUINT64_FORMAT"]", dir_front_bytes_high,
+			dir_front_bytes_low);
+		if (dir_front_snapshot && dir_front_snapshot->len) {
+			guint count = 0;
+			GError *err = snapshot_load (dir_front, dir_front_snapshot->str,
+					&count);
+			if (err) {
+				GRID_WARN ("RESOLVER front snapshot ignored : (%d) %s",
+						err->code, err->message);
+				g_clear_error (&err);
+			} else {
+				GRID_INFO ("RESOLVER front loaded %u elements from [%s]",
+						count, dir_front_snapshot->str);
+			}
+		}
+		if (dir_refresh_threads > 0) {
+			GError *err = NULL;
+			dir_refresher = g_thread_pool_new (_refresh_worker, NULL,
+					dir_refresh_threads, FALSE, &err);
+			if (!dir_refresher) {
+				GRID_ERROR ("Refresher pool error : (%d) %s",
+						err ? err->code : 0, err ? err->message : "?");
+				g_clear_error (&err);
+				return FALSE;
+			}
+		}
+	}
+
+	dir_inflight = singleflight_create (dir_coalesce_wait);
+
+	dir_negcache = negcache_create ();
+	negcache_set_ttl (dir_negcache, dir_neg_ttl);
+	negcache_set_max (dir_negcache, dir_neg_max);
+	GRID_INFO ("RESOLVER negative limits [%u/%u]", dir_neg_max, dir_neg_ttl);
+
+	m2_cache = contentcache_create (m2_cache_max, m2_cache_ttl);
+	GRID_INFO ("M2 content cache limits [%u bytes/%u]", m2_cache_max,
+		m2_cache_ttl);
+
+	upstreams = upstreams_create (upstream_max, upstream_wait,
+			upstream_failures, upstream_backoff, upstream_weight);
+	GRID_INFO ("UPSTREAM limits [%u calls/%u ms]", upstream_max,
+		upstream_wait);
+	GRID_INFO ("UPSTREAM circuits after [%u failures] for [%u ms]",
+		upstream_failures, upstream_backoff);
+	GRID_INFO ("UPSTREAM latency averages weight [%u%%]", upstream_weight);
+	GRID_INFO ("REQUEST deadline [%u ms]", request_deadline);
+
+	if (m2_hedge_delay > 0) {
+		GError *err = NULL;
+		m2_hedger = hedger_create (m2_hedge_threads, m2_hedge_delay,
+				m2_hedge_percentile, &err);
+		if (!m2_hedger) {
+			GRID_ERROR ("Hedging pool error : (%d) %s",
+					err ? err->code : 0, err ? err->message : "?");
+			g_clear_error (&err);
+			return FALSE;
+		}
+		GRID_INFO ("M2 hedged reads after [%u ms/p%u] with %u threads",
+			m2_hedge_delay, m2_hedge_percentile, m2_hedge_threads);
+	}
+
 	// Prepare a queue responsible for upstream to the conscience
 	push_queue = _push_queue_create();
 
@@ -515,9 +1048,14 @@ grid_main_configure (int argc, char **argv)
 	// Prepare a queue responsible for the downstream from the conscience
 	downstream_gtq = grid_task_queue_create ("downstream");
 
-	if (METACD_LB_ENABLED)
+	if (METACD_LB_ENABLED) {
 		grid_task_queue_register (downstream_gtq, (guint) lb_downstream_delay,
 			(GDestroyNotify) _task_reload_lbpool, NULL, lbpool);
+		// Without the refresh, /cs/srv always asks the conscience
+		cs_srvlists = srvlists_create ();
+		grid_task_queue_register (downstream_gtq, (guint) lb_downstream_delay,
+			(GDestroyNotify) _task_reload_srvlists, NULL, NULL);
+	}
 
 	// Now prepare a queue for administrative tasks, such as cache expiration,
 	// configuration reloadings, etc.
@@ -526,6 +1064,19 @@ grid_main_configure (int argc, char **argv)
 	grid_task_queue_register (admin_gtq, 1,
 		(GDestroyNotify) _task_expire_resolver, NULL, resolver);
 
+	grid_task_queue_register (admin_gtq, 1,
+		(GDestroyNotify) _task_expire_negcache, NULL, dir_negcache);
+
+	if (dir_front)
+		grid_task_queue_register (admin_gtq, 1,
+			(GDestroyNotify) _task_expire_front, NULL, dir_front);
+
+	grid_task_queue_register (admin_gtq, 1,
+		(GDestroyNotify) _task_expire_content, NULL, m2_cache);
+
+	grid_task_queue_register (admin_gtq, 1,
+		(GDestroyNotify) _task_reap_upstreams, NULL, upstreams);
+
 	grid_task_queue_register (admin_gtq, nsinfo_refresh_delay,
 		(GDestroyNotify) _task_reload_nsinfo, NULL, lbpool);
 
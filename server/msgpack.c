@@ -0,0 +1,204 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// MessagePack encoding of the replies, for the clients that ask for it with
+// "Accept: application/x-msgpack". The schema of each reply mirrors its JSON
+// form, cf. PROTOCOL.md. Each value is encoded in its shortest form.
+
+#define MSGPACK_CONTENT_TYPE "application/x-msgpack"
+
+static void
+_mp_append_be (GString *gstr, guint8 tag, guint64 v, guint width)
+{
+	guint8 buf[9];
+	buf[0] = tag;
+	for (guint i = 0; i < width; ++i)
+		buf[width - i] = (v >> (8 * i)) & 0xFF;
+	g_string_append_len (gstr, (gchar *) buf, width + 1);
+}
+
+static void
+_mp_append_nil (GString *gstr)
+{
+	g_string_append_c (gstr, (gchar) 0xC0);
+}
+
+static void
+_mp_append_bool (GString *gstr, gboolean b)
+{
+	g_string_append_c (gstr, (gchar) (b ? 0xC3 : 0xC2));
+}
+
+static void
+_mp_append_int (GString *gstr, gint64 i)
+{
+	if (i >= 0) {
+		if (i < 0x80)
+			g_string_append_c (gstr, (gchar) i);
+		else if (i <= G_MAXUINT8)
+			_mp_append_be (gstr, 0xCC, i, 1);
+		else if (i <= G_MAXUINT16)
+			_mp_append_be (gstr, 0xCD, i, 2);
+		else if (i <= G_MAXUINT32)
+			_mp_append_be (gstr, 0xCE, i, 4);
+		else
+			_mp_append_be (gstr, 0xCF, i, 8);
+	} else {
+		if (i >= -32)
+			g_string_append_c (gstr, (gchar) (0xE0 | (i + 32)));
+		else if (i >= G_MININT8)
+			_mp_append_be (gstr, 0xD0, (guint64) i, 1);
+		else if (i >= G_MININT16)
+			_mp_append_be (gstr, 0xD1, (guint64) i, 2);
+		else if (i >= G_MININT32)
+			_mp_append_be (gstr, 0xD2, (guint64) i, 4);
+		else
+			_mp_append_be (gstr, 0xD3, (guint64) i, 8);
+	}
+}
+
+static void
+_mp_append_str_len (GString *gstr, const gchar *s, gsize len)
+{
+	if (len < 32)
+		g_string_append_c (gstr, (gchar) (0xA0 | len));
+	else if (len <= G_MAXUINT8)
+		_mp_append_be (gstr, 0xD9, len, 1);
+	else if (len <= G_MAXUINT16)
+		_mp_append_be (gstr, 0xDA, len, 2);
+	else
+		_mp_append_be (gstr, 0xDB, len, 4);
+	g_string_append_len (gstr, s, len);
+}
+
+/* A NULL string is encoded as nil */
+static void
+_mp_append_str (GString *gstr, const gchar *s)
+{
+	if (!s)
+		_mp_append_nil (gstr);
+	else
+		_mp_append_str_len (gstr, s, strlen (s));
+}
+
+static void
+_mp_append_gstr (GString *gstr, const GString *s)
+{
+	if (!s)
+		_mp_append_nil (gstr);
+	else
+		_mp_append_str_len (gstr, s->str, s->len);
+}
+
+/* Binary fields, that are hexadecimal strings in the JSON form */
+static void
+_mp_append_bin (GString *gstr, const GByteArray *gba)
+{
+	if (!gba) {
+		_mp_append_nil (gstr);
+		return;
+	}
+	if (gba->len <= G_MAXUINT8)
+		_mp_append_be (gstr, 0xC4, gba->len, 1);
+	else if (gba->len <= G_MAXUINT16)
+		_mp_append_be (gstr, 0xC5, gba->len, 2);
+	else
+		_mp_append_be (gstr, 0xC6, gba->len, 4);
+	g_string_append_len (gstr, (gchar *) gba->data, gba->len);
+}
+
+static void
+_mp_append_array (GString *gstr, guint32 count)
+{
+	if (count < 16)
+		g_string_append_c (gstr, (gchar) (0x90 | count));
+	else if (count <= G_MAXUINT16)
+		_mp_append_be (gstr, 0xDC, count, 2);
+	else
+		_mp_append_be (gstr, 0xDD, count, 4);
+}
+
+static void
+_mp_append_map (GString *gstr, guint32 count)
+{
+	if (count < 16)
+		g_string_append_c (gstr, (gchar) (0x80 | count));
+	else if (count <= G_MAXUINT16)
+		_mp_append_be (gstr, 0xDE, count, 2);
+	else
+		_mp_append_be (gstr, 0xDF, count, 4);
+}
+
+/* The keys are literals of the proxy */
+#define _mp_append_key(G,K) _mp_append_str_len ((G), (K), sizeof (K) - 1)
+
+//------------------------------------------------------------------------------
+
+static void
+_mp_append_status (GString *gstr, gint code, const gchar *msg)
+{
+	_mp_append_key (gstr, "status");
+	_mp_append_int (gstr, code);
+	_mp_append_key (gstr, "message");
+	_mp_append_str (gstr, msg);
+}
+
+static void
+_mp_append_url (GString *gstr, struct hc_url_s *url)
+{
+	_mp_append_key (gstr, "URL");
+	if (!url) {
+		_mp_append_nil (gstr);
+		return;
+	}
+	_mp_append_map (gstr, 3);
+	_mp_append_key (gstr, "ns");
+	_mp_append_str (gstr, hc_url_get (url, HCURL_NS));
+	_mp_append_key (gstr, "ref");
+	_mp_append_str (gstr, hc_url_get (url, HCURL_REFERENCE));
+	_mp_append_key (gstr, "path");
+	_mp_append_str (gstr, hc_url_get (url, HCURL_PATH));
+}
+
+static void
+_mp_append_service_info (GString *gstr, struct service_info_s *si)
+{
+	gchar straddr[128], strtag[256];
+
+	grid_addrinfo_to_string (&(si->addr), straddr, sizeof (straddr));
+	_mp_append_map (gstr, 5);
+	_mp_append_key (gstr, "ns");
+	_mp_append_str (gstr, si->ns_name);
+	_mp_append_key (gstr, "type");
+	_mp_append_str (gstr, si->type);
+	_mp_append_key (gstr, "addr");
+	_mp_append_str (gstr, straddr);
+	_mp_append_key (gstr, "score");
+	_mp_append_int (gstr, si->score.value);
+
+	// The tag values are sent in their string form
+	_mp_append_key (gstr, "tags");
+	guint count = si->tags ? si->tags->len : 0;
+	_mp_append_map (gstr, count);
+	for (guint i = 0; i < count; ++i) {
+		struct service_tag_s *tag = si->tags->pdata[i];
+		service_tag_to_string (tag, strtag, sizeof (strtag));
+		_mp_append_str (gstr, tag->name);
+		_mp_append_str (gstr, strtag);
+	}
+}
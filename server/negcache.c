@@ -0,0 +1,256 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Negative cache of the references the meta1 said unknown. The resolver
+// only caches the positive answers, so without it each probe of a missing
+// reference costs a meta1 round-trip. All the entries share the same TTL,
+// thus the insertion order is also the expiration order and a FIFO is
+// enough to expire and to evict them.
+//
+// A lookup that started before a removal may only answer after it: its
+// insertion would then resurrect the entry. The caller takes the epoch of
+// the key before the lookup, and an insertion with an older epoch is
+// dropped. The epochs are kept per stripe of the keys, so that a removal
+// only cancels the insertions of its own stripe.
+
+#define NEGCACHE_STRIPES 1024
+
+struct negcache_entry_s {
+	gint64 expiry;
+	GList *link; // in negcache_s.fifo
+	gchar key[];
+};
+
+struct negcache_s {
+	GStaticMutex lock;
+	GHashTable *entries; // key -> negcache_entry_s, the key is in the entry
+	GQueue fifo; // oldest first
+	gint64 ttl; // microseconds
+	guint max;
+	guint64 generation; // bumped by each removal
+	guint64 flushed; // generation of the last flush
+	guint64 stamps[NEGCACHE_STRIPES]; // of the last removal
+
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+	guint64 outdated; // insertions dropped for their older epoch
+};
+
+struct negcache_stats_s {
+	guint count;
+	guint max;
+	gint64 ttl; // seconds
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+	guint64 outdated;
+};
+
+static struct negcache_s *
+negcache_create (void)
+{
+	struct negcache_s *nc = g_malloc0 (sizeof (*nc));
+	g_static_mutex_init (&nc->lock);
+	nc->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+			NULL, g_free);
+	g_queue_init (&nc->fifo);
+	return nc;
+}
+
+static void
+negcache_destroy (struct negcache_s *nc)
+{
+	if (!nc)
+		return;
+	g_queue_clear (&nc->fifo);
+	g_hash_table_destroy (nc->entries);
+	g_static_mutex_free (&nc->lock);
+	g_free (nc);
+}
+
+static void
+_negcache_drop_head (struct negcache_s *nc)
+{
+	struct negcache_entry_s *e = g_queue_pop_head (&nc->fifo);
+	g_hash_table_remove (nc->entries, e->key);
+}
+
+/* Must be called under the lock */
+static guint
+_negcache_expire (struct negcache_s *nc, gint64 now)
+{
+	guint count = 0;
+	for (;;) {
+		struct negcache_entry_s *e = g_queue_peek_head (&nc->fifo);
+		if (!e || e->expiry > now)
+			return count;
+		_negcache_drop_head (nc);
+		++ count;
+	}
+}
+
+/* The entries already present keep their expiry */
+static void
+negcache_set_ttl (struct negcache_s *nc, guint ttl)
+{
+	g_static_mutex_lock (&nc->lock);
+	nc->ttl = ((gint64) ttl) * G_TIME_SPAN_SECOND;
+	g_static_mutex_unlock (&nc->lock);
+}
+
+static void
+negcache_set_max (struct negcache_s *nc, guint max)
+{
+	g_static_mutex_lock (&nc->lock);
+	nc->max = max;
+	while (nc->fifo.length > nc->max)
+		_negcache_drop_head (nc);
+	g_static_mutex_unlock (&nc->lock);
+}
+
+static gboolean
+negcache_has (struct negcache_s *nc, const gchar *key)
+{
+	if (!nc || !key)
+		return FALSE;
+
+	gboolean found = FALSE;
+	g_static_mutex_lock (&nc->lock);
+	if (nc->fifo.length) {
+		gint64 now = g_get_monotonic_time ();
+		_negcache_expire (nc, now);
+		// After a TTL change, the FIFO is not exactly sorted by expiry
+		struct negcache_entry_s *e = g_hash_table_lookup (nc->entries, key);
+		found = e && e->expiry > now;
+	}
+	if (found)
+		++ nc->hits;
+	else
+		++ nc->misses;
+	g_static_mutex_unlock (&nc->lock);
+	return found;
+}
+
+static guint
+_negcache_stripe (const gchar *key)
+{
+	return g_str_hash (key) % NEGCACHE_STRIPES;
+}
+
+/* Must be called under the lock */
+static guint64
+_negcache_epoch (struct negcache_s *nc, const gchar *key)
+{
+	return MAX (nc->flushed, nc->stamps[_negcache_stripe (key)]);
+}
+
+/* The epoch of 'key' to pass to negcache_add(), taken before the lookup */
+static guint64
+negcache_epoch (struct negcache_s *nc, const gchar *key)
+{
+	if (!nc || !key)
+		return 0;
+	g_static_mutex_lock (&nc->lock);
+	guint64 epoch = _negcache_epoch (nc, key);
+	g_static_mutex_unlock (&nc->lock);
+	return epoch;
+}
+
+static void
+negcache_add (struct negcache_s *nc, const gchar *key, guint64 epoch)
+{
+	if (!nc || !key)
+		return;
+
+	gint64 now = g_get_monotonic_time ();
+	g_static_mutex_lock (&nc->lock);
+	if (epoch != _negcache_epoch (nc, key))
+		++ nc->outdated;
+	else if (nc->ttl > 0 && nc->max > 0) {
+		struct negcache_entry_s *e = g_hash_table_lookup (nc->entries, key);
+		if (e) {
+			// Renewed: it moves to the tail, with the latest expiry
+			g_queue_unlink (&nc->fifo, e->link);
+			g_queue_push_tail_link (&nc->fifo, e->link);
+		} else {
+			gsize len = strlen (key);
+			e = g_malloc (sizeof (*e) + len + 1);
+			memcpy (e->key, key, len + 1);
+			g_queue_push_tail (&nc->fifo, e);
+			e->link = nc->fifo.tail;
+			g_hash_table_insert (nc->entries, e->key, e);
+		}
+		e->expiry = now + nc->ttl;
+
+		while (nc->fifo.length > nc->max) {
+			_negcache_drop_head (nc);
+			++ nc->evictions;
+		}
+	}
+	g_static_mutex_unlock (&nc->lock);
+}
+
+static void
+negcache_remove (struct negcache_s *nc, const gchar *key)
+{
+	if (!nc || !key)
+		return;
+
+	g_static_mutex_lock (&nc->lock);
+	nc->stamps[_negcache_stripe (key)] = ++ nc->generation;
+	struct negcache_entry_s *e = g_hash_table_lookup (nc->entries, key);
+	if (e) {
+		g_queue_delete_link (&nc->fifo, e->link);
+		g_hash_table_remove (nc->entries, key);
+	}
+	g_static_mutex_unlock (&nc->lock);
+}
+
+static void
+negcache_flush (struct negcache_s *nc)
+{
+	g_static_mutex_lock (&nc->lock);
+	nc->flushed = ++ nc->generation;
+	g_queue_clear (&nc->fifo);
+	g_hash_table_remove_all (nc->entries);
+	g_static_mutex_unlock (&nc->lock);
+}
+
+static guint
+negcache_expire (struct negcache_s *nc)
+{
+	g_static_mutex_lock (&nc->lock);
+	guint count = _negcache_expire (nc, g_get_monotonic_time ());
+	g_static_mutex_unlock (&nc->lock);
+	return count;
+}
+
+static void
+negcache_info (struct negcache_s *nc, struct negcache_stats_s *s)
+{
+	g_static_mutex_lock (&nc->lock);
+	s->count = nc->fifo.length;
+	s->max = nc->max;
+	s->ttl = nc->ttl / G_TIME_SPAN_SECOND;
+	s->hits = nc->hits;
+	s->misses = nc->misses;
+	s->evictions = nc->evictions;
+	s->outdated = nc->outdated;
+	g_static_mutex_unlock (&nc->lock);
+}
@@ -19,8 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 static void
 _append_status (GString * gstr, gint code, const gchar * msg)
 {
-	g_string_append_printf (gstr,
-		"\"status\":%d,\"message\":\"%s\"", code, msg);
+	_json_append_pair_int (gstr, "status", code, TRUE);
+	_json_append_pair_string (gstr, "message", msg, FALSE);
 }
 
 static GString *
@@ -49,14 +49,19 @@ _create_status_error (GError * e)
 static void
 _append_url (GString * gstr, struct hc_url_s *url)
 {
-	if (!url)
-		g_string_append_printf (gstr, "\"URL\":null");
-	else
-		g_string_append_printf (gstr,
-			"\"URL\":{\"ns\":\"%s\",\"ref\":\"%s\",\"path\":\"%s\"}",
-			none (hc_url_get (url, HCURL_NS)),
-			none (hc_url_get (url, HCURL_REFERENCE)),
-			none (hc_url_get (url, HCURL_PATH)));
+	if (!url) {
+		g_string_append (gstr, "\"URL\":null");
+		return;
+	}
+	_json_append_key (gstr, "URL", TRUE);
+	g_string_append_c (gstr, '{');
+	_json_append_pair_string (gstr, "ns",
+			none (hc_url_get (url, HCURL_NS)), TRUE);
+	_json_append_pair_string (gstr, "ref",
+			none (hc_url_get (url, HCURL_REFERENCE)), FALSE);
+	_json_append_pair_string (gstr, "path",
+			none (hc_url_get (url, HCURL_PATH)), FALSE);
+	g_string_append_c (gstr, '}');
 }
 
 static enum http_rc_e
@@ -83,9 +88,33 @@ _reply_json (struct http_reply_ctx_s *rp, int code, const gchar * msg,
 	return HTTPRC_DONE;
 }
 
+/* The error of a request whose deadline passed. Its own domain tells it
+ * from the other CODE_UNAVAILABLE, whatever prefix it gets on its way. */
+static GError *
+_error_deadline (void)
+{
+	return g_error_new_literal (g_quark_from_static_string ("metacd.deadline"),
+			CODE_UNAVAILABLE, "Request deadline exceeded");
+}
+
+static gboolean
+_error_is_deadline (const GError *err)
+{
+	return err && err->domain == g_quark_from_static_string ("metacd.deadline");
+}
+
+static enum http_rc_e
+_reply_deadline_error (struct http_reply_ctx_s *rp, GError * err)
+{
+	return _reply_json (rp, 503, "Service unavailable",
+			_create_status_error (err));
+}
+
 static enum http_rc_e
 _reply_soft_error (struct http_reply_ctx_s *rp, GError * err)
 {
+	if (_error_is_deadline (err))
+		return _reply_deadline_error (rp, err);
 	if (err->code < 100)
 		err->code = CODE_UNAVAILABLE;
 	return _reply_json (rp, 200, "OK", _create_status_error (err));
@@ -100,6 +129,8 @@ _reply_format_error (struct http_reply_ctx_s *rp, GError * err)
 static enum http_rc_e
 _reply_system_error (struct http_reply_ctx_s *rp, GError * err)
 {
+	if (_error_is_deadline (err))
+		return _reply_deadline_error (rp, err);
 	return _reply_json (rp, 500, "Internal error", _create_status_error (err));
 }
 
@@ -126,3 +157,14 @@ _reply_success_json (struct http_reply_ctx_s *rp, GString * gstr)
 {
 	return _reply_json (rp, 200, "OK", gstr);
 }
+
+static enum http_rc_e
+_reply_success_msgpack (struct http_reply_ctx_s *rp, GString * gstr)
+{
+	rp->set_status (200, "OK");
+	rp->set_body_gstr (gstr);
+	rp->set_content_type (MSGPACK_CONTENT_TYPE);
+	rp->add_header ("Vary", g_strdup ("Accept"));
+	rp->finalize ();
+	return HTTPRC_DONE;
+}
@@ -0,0 +1,241 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The resolutions go through the sharded front cache, then the negative
+// cache, and only then through the resolver, whose lock is shared by all
+// the workers. The concurrent misses on the same resolution are coalesced,
+// only one of them reaches the resolver and the meta1. The handlers must
+// use these wrappers instead of calling the hc_resolve_*() and
+// hc_decache_*() functions, or the caches would diverge.
+//
+// The stale entries of the front cache are still served, while a pool of
+// refreshers resolves them again in the background. So the workers do not
+// wait for the meta1 each time a popular reference expires.
+
+/* The meta1 of a reference are cached under this pseudo service type */
+#define RESOLVE_DIRECTORY ""
+
+/* Per tier of the front cache, the time spent by the resolutions served
+ * from the caches, and by those sent to the resolver (coalesced or not) */
+struct resolve_latency_s {
+	struct histogram_s cached;
+	struct histogram_s upstream;
+};
+
+static struct resolve_latency_s dir_latency[SHARDCACHE_TIERS];
+
+struct refresh_s {
+	gchar *srvtype;
+	gchar ref[];
+};
+
+/* Runs in the refresher pool. The outcome is applied here rather than in
+ * the resolution, because a coalesced refresh does not run its own. */
+static void
+_refresh_worker (gpointer p, gpointer u)
+{
+	struct refresh_s *r = p;
+	(void) u;
+
+	if (!g_atomic_int_get (&dir_refresh_stopping)) {
+		struct hc_url_s *url = hc_url_empty ();
+		hc_url_set (url, HCURL_NS, nsname);
+		hc_url_set (url, HCURL_HEXID, r->ref);
+
+		/* The negative entry is added by the leader only, a waiter cannot
+		 * know when the lookup it joined started */
+		GError *resolve (gchar ***out) {
+			guint64 epoch = negcache_epoch (dir_negcache, r->ref);
+			GError *e;
+			if (!*r->srvtype)
+				e = hc_resolve_reference_directory (resolver, url, out);
+			else
+				e = hc_resolve_reference_service (resolver, url, r->srvtype, out);
+			if (e && e->code == CODE_CONTAINER_NOTFOUND)
+				negcache_add (dir_negcache, r->ref, epoch);
+			return e;
+		}
+
+		gchar flight[512];
+		g_snprintf (flight, sizeof (flight), "%s/%s", r->ref, r->srvtype);
+		gchar **urlv = NULL;
+		GError *err = singleflight_do (dir_inflight, flight, resolve, &urlv);
+		if (!err) {
+			shardcache_put (dir_front, r->ref, r->srvtype, urlv);
+			g_strfreev (urlv);
+		} else {
+			if (err->code == CODE_CONTAINER_NOTFOUND) {
+				shardcache_drop (dir_front, r->ref, NULL);
+			} else {
+				GRID_DEBUG ("Refresh failed for [%s/%s]: (%d) %s",
+						r->ref, r->srvtype, err->code, err->message);
+				shardcache_refresh_failed (dir_front, r->ref, r->srvtype,
+						dir_refresh_failures);
+			}
+			g_clear_error (&err);
+		}
+		hc_url_clean (url);
+	}
+
+	g_free (r->srvtype);
+	g_free (r);
+}
+
+/* Looks the front cache up, and queues the refresh of the entry if it is
+ * stale and nobody else already queued it. */
+static gchar **
+_resolve_front (const gchar *ref, const gchar *srvtype)
+{
+	gboolean refresh = FALSE;
+	gchar **urlv = shardcache_get (dir_front, ref, srvtype,
+			dir_refresher ? &refresh : NULL);
+	if (refresh) {
+		gsize len = strlen (ref);
+		struct refresh_s *r = g_malloc0 (sizeof (*r) + len + 1);
+		memcpy (r->ref, ref, len + 1);
+		r->srvtype = g_strdup (srvtype);
+		g_thread_pool_push (dir_refresher, r, NULL);
+	}
+	return urlv;
+}
+
+/* The meta1 answers CODE_CONTAINER_NOTFOUND for the unknown references,
+ * whatever the service type, so the negative entries are per reference. */
+static GError *
+_resolve_reference_service (const struct req_args_s *args,
+		const gchar *srvtype, gchar ***result)
+{
+	struct resolve_latency_s *lat = dir_latency + SHARDCACHE_TIER_LOW;
+	gint64 start = g_get_monotonic_time ();
+	const gchar *key = hc_url_get (args->url, HCURL_HEXID);
+	if (NULL != (*result = _resolve_front (key, srvtype))) {
+		histogram_add (&lat->cached, g_get_monotonic_time () - start);
+		return NULL;
+	}
+	if (negcache_has (dir_negcache, key)) {
+		histogram_add (&lat->cached, g_get_monotonic_time () - start);
+		return NEWERROR (CODE_CONTAINER_NOTFOUND, "Reference not found");
+	}
+
+	GError *resolve (gchar ***out) {
+		guint64 epoch = negcache_epoch (dir_negcache, key);
+		GError *e = hc_resolve_reference_service (resolver, args->url,
+				srvtype, out);
+		if (!e)
+			shardcache_put (dir_front, key, srvtype, *out);
+		else if (e->code == CODE_CONTAINER_NOTFOUND)
+			negcache_add (dir_negcache, key, epoch);
+		return e;
+	}
+
+	gchar flight[512];
+	g_snprintf (flight, sizeof (flight), "%s/%s", key, srvtype);
+	GError *err = singleflight_do (dir_inflight, flight, resolve, result);
+	histogram_add (&lat->upstream, g_get_monotonic_time () - start);
+	return err;
+}
+
+static GError *
+_resolve_reference_directory (const struct req_args_s *args, gchar ***result)
+{
+	struct resolve_latency_s *lat = dir_latency + SHARDCACHE_TIER_HIGH;
+	gint64 start = g_get_monotonic_time ();
+	const gchar *key = hc_url_get (args->url, HCURL_HEXID);
+	if (NULL != (*result = _resolve_front (key, RESOLVE_DIRECTORY))) {
+		histogram_add (&lat->cached, g_get_monotonic_time () - start);
+		return NULL;
+	}
+
+	GError *resolve (gchar ***out) {
+		GError *e = hc_resolve_reference_directory (resolver, args->url, out);
+		if (!e)
+			shardcache_put (dir_front, key, RESOLVE_DIRECTORY, *out);
+		return e;
+	}
+
+	gchar flight[512];
+	g_snprintf (flight, sizeof (flight), "%s/%s", key, RESOLVE_DIRECTORY);
+	GError *err = singleflight_do (dir_inflight, flight, resolve, result);
+	histogram_add (&lat->upstream, g_get_monotonic_time () - start);
+	return err;
+}
+
+static void
+_decache_reference_service (const struct req_args_s *args,
+		const gchar *srvtype)
+{
+	shardcache_drop (dir_front, hc_url_get (args->url, HCURL_HEXID), srvtype);
+	hc_decache_reference_service (resolver, args->url, srvtype);
+}
+
+/* Installs the services the meta1 just returned for 'srvtype', so that the
+ * next request does not resolve them again. The resolver cannot be fed, its
+ * now stale entry is dropped and the front cache, consulted first, takes
+ * the fresh list. Without a type, the list would land on the entry of the
+ * meta1 of the reference, it is only dropped. */
+static void
+_install_reference_service (const struct req_args_s *args,
+		const gchar *srvtype, gchar **urlv)
+{
+	const gchar *key = hc_url_get (args->url, HCURL_HEXID);
+	hc_decache_reference_service (resolver, args->url, srvtype);
+	if (srvtype && *srvtype)
+		shardcache_put (dir_front, key, srvtype, urlv);
+	else
+		shardcache_drop (dir_front, key, NULL);
+	negcache_remove (dir_negcache, key);
+}
+
+/* Also forgets all the services of the reference held by the front cache */
+static void
+_decache_reference (const struct req_args_s *args)
+{
+	shardcache_drop (dir_front, hc_url_get (args->url, HCURL_HEXID), NULL);
+	hc_decache_reference (resolver, args->url);
+}
+
+/* Orders the service URLs 'urlv' fastest first, according to the recent
+ * calls toward their hosts. The URLs with equal scores keep their order,
+ * so does the whole set while no latency is known. For the reads only, the
+ * writes must reach the master first. */
+static void
+_sort_by_latency (const struct req_args_s *args, gchar **urlv)
+{
+	guint count = g_strv_length (urlv);
+	if (count < 2)
+		return;
+
+	gdouble scores[count];
+	for (guint i = 0; i < count; ++i) {
+		struct meta1_service_url_s *u =
+			req_arena_unpack_m1url (args->arena, urlv[i]);
+		scores[i] = u ? upstream_score (upstreams, u->host) : G_MAXDOUBLE;
+	}
+	// A few replicas, an insertion sort is stable and enough
+	for (guint i = 1; i < count; ++i) {
+		gdouble score = scores[i];
+		gchar *url = urlv[i];
+		guint j = i;
+		for (; j > 0 && scores[j - 1] > score; --j) {
+			scores[j] = scores[j - 1];
+			urlv[j] = urlv[j - 1];
+		}
+		scores[j] = score;
+		urlv[j] = url;
+	}
+}
@@ -0,0 +1,202 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The routes are compiled once at startup into a trie whose transitions are
+// stored in a flat table, indexed by (node, character class). A lookup then
+// reads each byte of the path once, and never compares strings.
+
+enum http_method_e {
+	HTTP_METHOD_GET = 0,
+	HTTP_METHOD_HEAD,
+	HTTP_METHOD_PUT,
+	HTTP_METHOD_POST,
+	HTTP_METHOD_DELETE,
+	HTTP_METHOD_MAX,
+};
+
+typedef enum http_rc_e (*route_call_f) (struct http_request_s *rq,
+		struct http_reply_ctx_s *rp, struct req_uri_s *uri,
+		const gchar *path, gconstpointer action);
+
+struct route_s {
+	gchar *prefix;
+	enum http_method_e method; // HTTP_METHOD_MAX stands for any method
+	route_call_f call;
+	gconstpointer action;
+};
+
+struct route_node_s {
+	const struct route_s *routes[HTTP_METHOD_MAX];
+	gboolean terminal;
+};
+
+struct route_index_s {
+	GPtrArray *routes;
+
+	// Filled by route_index_compile()
+	guint8 classes[256];
+	guint width;
+	guint16 *next;
+	struct route_node_s *nodes;
+	guint count;
+};
+
+static enum http_method_e
+_http_method_parse (const gchar *cmd)
+{
+	switch (*cmd) {
+		case 'G':
+			return !strcmp (cmd, "GET") ? HTTP_METHOD_GET : HTTP_METHOD_MAX;
+		case 'H':
+			return !strcmp (cmd, "HEAD") ? HTTP_METHOD_HEAD : HTTP_METHOD_MAX;
+		case 'P':
+			if (!strcmp (cmd, "PUT"))
+				return HTTP_METHOD_PUT;
+			return !strcmp (cmd, "POST") ? HTTP_METHOD_POST : HTTP_METHOD_MAX;
+		case 'D':
+			return !strcmp (cmd, "DELETE") ? HTTP_METHOD_DELETE : HTTP_METHOD_MAX;
+		default:
+			return HTTP_METHOD_MAX;
+	}
+}
+
+static void
+_route_free (gpointer p)
+{
+	struct route_s *r = p;
+	metautils_str_clean (&r->prefix);
+	g_free (r);
+}
+
+static struct route_index_s *
+route_index_create (void)
+{
+	struct route_index_s *ri = g_malloc0 (sizeof (struct route_index_s));
+	ri->routes = g_ptr_array_new_with_free_func (_route_free);
+	return ri;
+}
+
+static void
+route_index_destroy (struct route_index_s *ri)
+{
+	if (!ri)
+		return;
+	g_ptr_array_free (ri->routes, TRUE);
+	g_free (ri->next);
+	g_free (ri->nodes);
+	g_free (ri);
+}
+
+/* 'method' set to NULL matches any method. When several routes share the
+ * same prefix and method, the first registered wins. */
+static void
+route_index_add (struct route_index_s *ri, const gchar *mount,
+		const gchar *prefix, const gchar *method, route_call_f call,
+		gconstpointer action)
+{
+	g_assert (ri->nodes == NULL);
+	struct route_s *r = g_malloc0 (sizeof (struct route_s));
+	r->prefix = g_strconcat (mount, prefix, NULL);
+	r->method = method ? _http_method_parse (method) : HTTP_METHOD_MAX;
+	r->call = call;
+	r->action = action;
+	g_ptr_array_add (ri->routes, r);
+}
+
+static void
+route_index_compile (struct route_index_s *ri)
+{
+	g_assert (ri->nodes == NULL);
+
+	// Only the characters present in a prefix get a class
+	guint max = 1;
+	ri->width = 1;
+	memset (ri->classes, 0, sizeof (ri->classes));
+	for (guint i = 0; i < ri->routes->len; ++i) {
+		struct route_s *r = g_ptr_array_index (ri->routes, i);
+		for (guint8 *p = (guint8 *) r->prefix; *p; ++p, ++max) {
+			if (!ri->classes[*p])
+				ri->classes[*p] = ri->width ++;
+		}
+	}
+	g_assert (max < G_MAXUINT16);
+
+	ri->next = g_malloc0 (max * ri->width * sizeof (guint16));
+	ri->nodes = g_malloc0 (max * sizeof (struct route_node_s));
+	ri->count = 1;
+
+	for (guint i = 0; i < ri->routes->len; ++i) {
+		struct route_s *r = g_ptr_array_index (ri->routes, i);
+		guint s = 0;
+		for (guint8 *p = (guint8 *) r->prefix; *p; ++p) {
+			guint16 *pn = ri->next + (s * ri->width + ri->classes[*p]);
+			if (!*pn)
+				*pn = ri->count ++;
+			s = *pn;
+		}
+
+		struct route_node_s *node = ri->nodes + s;
+		node->terminal = TRUE;
+		for (guint m = 0; m < HTTP_METHOD_MAX; ++m) {
+			if (!node->routes[m] && (r->method == HTTP_METHOD_MAX || r->method == m))
+				node->routes[m] = r;
+		}
+	}
+
+	GRID_DEBUG ("Compiled %u routes in %u nodes, %u classes",
+			ri->routes->len, ri->count, ri->width - 1);
+}
+
+/* Returns the route matching the longest prefix of 'path' for the given
+ * method. When no route is found, 'pmatched' tells if the path matched a
+ * prefix for another method. */
+static const struct route_s *
+route_index_lookup (const struct route_index_s *ri, const gchar *path,
+		enum http_method_e method, gsize *plen, gboolean *pmatched)
+{
+	const struct route_s *found = NULL;
+	gboolean matched = FALSE;
+	guint s = 0;
+
+	// No class is ever assigned to '\0', the walk stops at the end of 'path'
+	for (const guint8 *p = (const guint8 *) path; ;) {
+		guint8 c = ri->classes[*p];
+		if (!c || !(s = ri->next[s * ri->width + c]))
+			break;
+		++p;
+		const struct route_node_s *node = ri->nodes + s;
+		if (node->terminal) {
+			matched = TRUE;
+			if (method < HTTP_METHOD_MAX && node->routes[method]) {
+				found = node->routes[method];
+				*plen = p - (const guint8 *) path;
+			}
+		}
+	}
+
+	*pmatched = matched;
+	return found;
+}
+
+static void
+route_index_add_actions (struct route_index_s *ri, const gchar *mount,
+		const struct req_action_s *actions)
+{
+	for (const struct req_action_s *pa = actions; pa->prefix; ++pa)
+		route_index_add (ri, mount, pa->prefix, pa->method, req_args_call, pa);
+}
@@ -0,0 +1,631 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A cache of resolutions (reference, service type) -> URL array, split in
+// independent shards. Each shard has its own lock, its own LRU and its own
+// expiration, so the workers only contend when they look for references
+// that hash to the same shard. All the entries of a reference belong to the
+// same shard. The shards are aligned on cache lines, to avoid false sharing
+// between the locks. The entries are expired by a timer wheel per shard,
+// so that an expiration only touches the entries that are due.
+//
+// An entry is fresh until its soft TTL, then stale until its hard TTL. A
+// stale entry is still served, and the first lookup that finds it stale is
+// asked to refresh it in the background. It is evicted at its hard TTL, or
+// after too many failed refreshes.
+//
+// The counters are kept apart for the meta1 of the references (empty type)
+// and for their services, the two tiers of the resolver behind. Each tier
+// has its own LRU, so that it can also be bounded by the bytes its entries
+// hold. The bound in elements applies to both tiers, it evicts the least
+// recently used of their two oldest entries.
+
+#ifndef SHARDCACHE_LINE
+#define SHARDCACHE_LINE 64
+#endif
+
+#define SHARDCACHE_TIER_HIGH 0 // the meta1 of a reference
+#define SHARDCACHE_TIER_LOW 1 // the services of a reference
+#define SHARDCACHE_TIERS 2
+
+struct shardcache_entry_s {
+	gint64 soft; // stale past it
+	gint64 expiry; // evicted past it
+	guint failures; // consecutive failed refreshes
+	gboolean refreshing;
+	guint tier;
+	gsize bytes;
+	gint64 used; // last hit
+	GList *lru;  // in shard.lru[tier], most recently used first
+	struct twheel_node_s timer; // in shard.wheel, at 'expiry'
+	gchar **urlv;
+	gchar key[]; // "REF/TYPE"
+};
+
+struct shardcache_counters_s {
+	guint64 hits;
+	guint64 misses;
+	guint64 stale; // hits on stale entries
+	guint64 inserts;
+	guint64 evictions; // for the room or after failed refreshes
+	guint64 expiries;
+	guint64 decaches;
+	guint64 refreshes;
+	guint64 refresh_failures;
+};
+
+struct shardcache_shard_s {
+	GStaticMutex lock;
+	GHashTable *entries;
+	GQueue lru[SHARDCACHE_TIERS];
+	gsize bytes[SHARDCACHE_TIERS];
+	gsize max_bytes[SHARDCACHE_TIERS]; // 0 for no limit
+	guint max_count[SHARDCACHE_TIERS]; // 0 for no limit
+	struct twheel_s wheel; // ticks are seconds of the monotonic clock
+	struct shardcache_counters_s tiers[SHARDCACHE_TIERS];
+} __attribute__ ((aligned (SHARDCACHE_LINE)));
+
+struct shardcache_s {
+	guint mask;
+	volatile gint ttl[SHARDCACHE_TIERS]; // seconds, the soft TTL
+	volatile gint hard_ttl[SHARDCACHE_TIERS]; // seconds, never below 'ttl'
+	volatile gint max; // per shard, all the tiers
+	struct shardcache_shard_s *shards;
+	gpointer raw; // allocated block, 'shards' is aligned in it
+};
+
+struct shardcache_stats_s {
+	guint shards;
+	guint count;
+	guint max;
+	guint ttl; // the longest of the tiers
+	guint hard_ttl; // the longest of the tiers
+	guint ttls[SHARDCACHE_TIERS];
+	guint hard_ttls[SHARDCACHE_TIERS];
+	guint max_counts[SHARDCACHE_TIERS];
+	guint counts[SHARDCACHE_TIERS];
+	guint64 bytes[SHARDCACHE_TIERS];
+	guint64 max_bytes[SHARDCACHE_TIERS];
+	struct shardcache_counters_s total;
+	struct shardcache_counters_s tiers[SHARDCACHE_TIERS];
+};
+
+/* The reference IDs are hexadecimal hashes, but nothing forces it */
+static guint
+_shardcache_hash (const gchar *ref)
+{
+	guint h = 5381;
+	for (; *ref; ++ref)
+		h = (h << 5) + h + (guint8) *ref;
+	return h ^ (h >> 16);
+}
+
+static guint
+_shardcache_tier (const gchar *type)
+{
+	return type && *type ? SHARDCACHE_TIER_LOW : SHARDCACHE_TIER_HIGH;
+}
+
+static gchar *
+_shardcache_key (const gchar *ref, const gchar *type, gchar *buf, gsize len)
+{
+	g_snprintf (buf, len, "%s/%s", ref, type ? type : "");
+	return buf;
+}
+
+static void
+_shardcache_entry_free (struct shardcache_entry_s *e)
+{
+	if (e->urlv)
+		g_strfreev (e->urlv);
+	g_free (e);
+}
+
+/* The memory held by an entry, its key and its URL. The hash table and the
+ * wheel add a constant overhead per entry, not accounted. */
+static gsize
+_shardcache_size (const gchar *key, gchar **urlv)
+{
+	gsize bytes = sizeof (struct shardcache_entry_s) + strlen (key) + 1
+		+ sizeof (GList) + sizeof (gchar *);
+	for (gchar **p = urlv; *p; ++p)
+		bytes += sizeof (gchar *) + strlen (*p) + 1;
+	return bytes;
+}
+
+static void
+_shardcache_remove (struct shardcache_shard_s *shard,
+		struct shardcache_entry_s *e)
+{
+	g_queue_delete_link (shard->lru + e->tier, e->lru);
+	shard->bytes[e->tier] -= e->bytes;
+	twheel_remove (&shard->wheel, &e->timer);
+	g_hash_table_remove (shard->entries, e->key);
+}
+
+static guint
+_shardcache_count (struct shardcache_shard_s *shard)
+{
+	guint count = 0;
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t)
+		count += shard->lru[t].length;
+	return count;
+}
+
+static void
+_shardcache_evict (struct shardcache_shard_s *shard,
+		struct shardcache_entry_s *e)
+{
+	++ shard->tiers[e->tier].evictions;
+	_shardcache_remove (shard, e);
+}
+
+/* Must be called under the lock of the shard */
+static void
+_shardcache_shrink (struct shardcache_shard_s *shard, guint max)
+{
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+		while (shard->max_bytes[t] && shard->bytes[t] > shard->max_bytes[t])
+			_shardcache_evict (shard, g_queue_peek_tail (shard->lru + t));
+		while (shard->max_count[t] && shard->lru[t].length > shard->max_count[t])
+			_shardcache_evict (shard, g_queue_peek_tail (shard->lru + t));
+	}
+	while (_shardcache_count (shard) > max) {
+		struct shardcache_entry_s *oldest = NULL;
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+			struct shardcache_entry_s *e = g_queue_peek_tail (shard->lru + t);
+			if (e && (!oldest || e->used < oldest->used))
+				oldest = e;
+		}
+		_shardcache_evict (shard, oldest);
+	}
+}
+
+static struct shardcache_s *
+shardcache_create (guint nb_shards, guint max, guint ttl, guint hard_ttl)
+{
+	guint count = 1;
+	while (count < nb_shards && count < 65536)
+		count <<= 1;
+
+	struct shardcache_s *sc = g_malloc0 (sizeof (*sc));
+	sc->mask = count - 1;
+	sc->raw = g_malloc0 (count * sizeof (struct shardcache_shard_s)
+			+ SHARDCACHE_LINE);
+	sc->shards = (gpointer) (((guintptr) sc->raw + SHARDCACHE_LINE - 1)
+			& ~((guintptr) SHARDCACHE_LINE - 1));
+	for (guint i = 0; i < count; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		g_static_mutex_init (&shard->lock);
+		shard->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+				NULL, (GDestroyNotify) _shardcache_entry_free);
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t)
+			g_queue_init (shard->lru + t);
+		twheel_init (&shard->wheel, g_get_monotonic_time () / G_TIME_SPAN_SECOND);
+	}
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+		sc->ttl[t] = ttl;
+		sc->hard_ttl[t] = MAX (ttl, hard_ttl);
+	}
+	sc->max = count > 1 ? (max + count - 1) / count : max;
+	return sc;
+}
+
+static void
+shardcache_destroy (struct shardcache_s *sc)
+{
+	if (!sc)
+		return;
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t)
+			g_queue_clear (shard->lru + t);
+		g_hash_table_destroy (shard->entries);
+		g_static_mutex_free (&shard->lock);
+	}
+	g_free (sc->raw);
+	g_free (sc);
+}
+
+static struct shardcache_shard_s *
+_shardcache_shard (struct shardcache_s *sc, const gchar *ref)
+{
+	return sc->shards + (_shardcache_hash (ref) & sc->mask);
+}
+
+/* Returns a copy of the cached URL, to be freed with g_strfreev(), or NULL
+ * if the resolution is not cached. '*refresh' is set if the entry is stale
+ * and the caller is the first to notice it: the caller is then in charge of
+ * its refresh, with shardcache_put() or shardcache_refresh_failed(). */
+static gchar **
+shardcache_get (struct shardcache_s *sc, const gchar *ref, const gchar *type,
+		gboolean *refresh)
+{
+	gchar buf[512];
+	if (refresh)
+		*refresh = FALSE;
+	if (!sc || !ref)
+		return NULL;
+	guint tier = _shardcache_tier (type);
+	if (g_atomic_int_get (sc->ttl + tier) <= 0)
+		return NULL;
+
+	const gchar *key = _shardcache_key (ref, type, buf, sizeof (buf));
+	struct shardcache_shard_s *shard = _shardcache_shard (sc, ref);
+	struct shardcache_counters_s *c = shard->tiers + tier;
+	gchar **result = NULL;
+	gint64 now = g_get_monotonic_time ();
+
+	g_static_mutex_lock (&shard->lock);
+	struct shardcache_entry_s *e = g_hash_table_lookup (shard->entries, key);
+	if (e && e->expiry <= now) {
+		_shardcache_remove (shard, e);
+		++ c->expiries;
+		e = NULL;
+	}
+	if (e) {
+		++ c->hits;
+		e->used = now;
+		GQueue *lru = shard->lru + e->tier;
+		if (lru->head != e->lru) {
+			g_queue_unlink (lru, e->lru);
+			g_queue_push_head_link (lru, e->lru);
+		}
+		result = g_strdupv (e->urlv);
+		if (e->soft <= now) {
+			++ c->stale;
+			if (refresh && !e->refreshing) {
+				e->refreshing = TRUE;
+				*refresh = TRUE;
+				++ c->refreshes;
+			}
+		}
+	} else {
+		++ c->misses;
+	}
+	g_static_mutex_unlock (&shard->lock);
+	return result;
+}
+
+static void
+_shardcache_insert (struct shardcache_s *sc, const gchar *ref,
+		const gchar *key, guint tier, gchar **urlv, gint64 soft, gint64 expiry)
+{
+	gint max;
+	if ((max = g_atomic_int_get (&sc->max)) <= 0)
+		return;
+
+	gsize len = strlen (key);
+	struct shardcache_entry_s *e = g_malloc0 (sizeof (*e) + len + 1);
+	memcpy (e->key, key, len + 1);
+	e->urlv = g_strdupv (urlv);
+	e->soft = soft;
+	e->expiry = expiry;
+	e->tier = tier;
+	e->bytes = _shardcache_size (key, urlv);
+	e->used = g_get_monotonic_time ();
+
+	struct shardcache_shard_s *shard = _shardcache_shard (sc, ref);
+	g_static_mutex_lock (&shard->lock);
+	struct shardcache_entry_s *old = g_hash_table_lookup (shard->entries, key);
+	if (old)
+		_shardcache_remove (shard, old);
+	// An entry bigger than the share of its tier would empty it for nothing
+	if (shard->max_bytes[tier] && e->bytes > shard->max_bytes[tier]) {
+		g_static_mutex_unlock (&shard->lock);
+		_shardcache_entry_free (e);
+		return;
+	}
+	g_queue_push_head (shard->lru + tier, e);
+	e->lru = shard->lru[tier].head;
+	shard->bytes[tier] += e->bytes;
+	twheel_add (&shard->wheel, &e->timer,
+			(expiry + G_TIME_SPAN_SECOND - 1) / G_TIME_SPAN_SECOND);
+	g_hash_table_insert (shard->entries, e->key, e);
+	++ shard->tiers[tier].inserts;
+	_shardcache_shrink (shard, max);
+	g_static_mutex_unlock (&shard->lock);
+}
+
+/* Caches a copy of 'urlv' */
+static void
+shardcache_put (struct shardcache_s *sc, const gchar *ref, const gchar *type,
+		gchar **urlv)
+{
+	gchar buf[512];
+	gint ttl, hard_ttl;
+	if (!sc || !ref || !urlv)
+		return;
+	guint tier = _shardcache_tier (type);
+	hard_ttl = g_atomic_int_get (sc->hard_ttl + tier);
+	if ((ttl = g_atomic_int_get (sc->ttl + tier)) <= 0)
+		return;
+
+	gint64 now = g_get_monotonic_time ();
+	_shardcache_insert (sc, ref, _shardcache_key (ref, type, buf, sizeof (buf)),
+			tier, urlv, now + ttl * G_TIME_SPAN_SECOND,
+			now + MAX (ttl, hard_ttl) * G_TIME_SPAN_SECOND);
+}
+
+/* Caches a copy of 'urlv' under its "REF/TYPE" key, with the time left
+ * before the entry becomes stale and before it expires (microseconds). Used
+ * to restore a dump, the entries must be restored least recently used
+ * first. */
+static void
+shardcache_restore (struct shardcache_s *sc, const gchar *key, gchar **urlv,
+		gint64 soft_left, gint64 hard_left)
+{
+	gchar buf[512];
+	gint ttl, hard_ttl;
+	if (!sc || !key || !urlv || hard_left <= 0)
+		return;
+
+	g_strlcpy (buf, key, sizeof (buf));
+	gchar *slash = strchr (buf, '/');
+	if (!slash)
+		return;
+	*slash = '\0';
+
+	guint tier = _shardcache_tier (slash + 1);
+	hard_ttl = g_atomic_int_get (sc->hard_ttl + tier);
+	if ((ttl = g_atomic_int_get (sc->ttl + tier)) <= 0)
+		return;
+
+	// The TTLs may have been lowered since the dump
+	hard_left = MIN (hard_left, MAX (ttl, hard_ttl) * G_TIME_SPAN_SECOND);
+	soft_left = MIN (soft_left, ttl * G_TIME_SPAN_SECOND);
+
+	gint64 now = g_get_monotonic_time ();
+	_shardcache_insert (sc, buf, key, tier, urlv,
+			now + MIN (soft_left, hard_left), now + hard_left);
+}
+
+/* Calls 'hook' on each entry, least recently used first in its tier, under
+ * the lock of its shard, with the time left before the entry becomes stale and before it expires
+ * (microseconds). The expired entries are skipped. */
+static void
+shardcache_foreach (struct shardcache_s *sc,
+		void (*hook) (const gchar *key, gchar **urlv, gint64 soft_left,
+			gint64 hard_left))
+{
+	if (!sc)
+		return;
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		gint64 now = g_get_monotonic_time ();
+		g_static_mutex_lock (&shard->lock);
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+			for (GList *l = shard->lru[t].tail; l ; l = l->prev) {
+				struct shardcache_entry_s *e = l->data;
+				if (e->expiry > now)
+					hook (e->key, e->urlv, e->soft - now, e->expiry - now);
+			}
+		}
+		g_static_mutex_unlock (&shard->lock);
+	}
+}
+
+/* Forgets the resolution of 'ref' for 'type', or all the resolutions of
+ * 'ref' if 'type' is NULL. */
+static void
+shardcache_drop (struct shardcache_s *sc, const gchar *ref, const gchar *type)
+{
+	gchar buf[512];
+	if (!sc || !ref)
+		return;
+
+	struct shardcache_shard_s *shard = _shardcache_shard (sc, ref);
+	g_static_mutex_lock (&shard->lock);
+	if (type) {
+		const gchar *key = _shardcache_key (ref, type, buf, sizeof (buf));
+		struct shardcache_entry_s *e = g_hash_table_lookup (shard->entries, key);
+		if (e) {
+			++ shard->tiers[e->tier].decaches;
+			_shardcache_remove (shard, e);
+		}
+	} else {
+		const gchar *prefix = _shardcache_key (ref, "", buf, sizeof (buf));
+		gsize len = strlen (prefix);
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+			for (GList *l = shard->lru[t].head; l ;) {
+				struct shardcache_entry_s *e = l->data;
+				l = l->next;
+				if (!strncmp (e->key, prefix, len)) {
+					++ shard->tiers[e->tier].decaches;
+					_shardcache_remove (shard, e);
+				}
+			}
+		}
+	}
+	g_static_mutex_unlock (&shard->lock);
+}
+
+/* A refresh of 'ref' for 'type' failed. The stale entry is kept for the
+ * next refresh, unless it already failed 'max_failures' times in a row. */
+static void
+shardcache_refresh_failed (struct shardcache_s *sc, const gchar *ref,
+		const gchar *type, guint max_failures)
+{
+	gchar buf[512];
+	if (!sc || !ref)
+		return;
+
+	const gchar *key = _shardcache_key (ref, type, buf, sizeof (buf));
+	struct shardcache_shard_s *shard = _shardcache_shard (sc, ref);
+	struct shardcache_counters_s *c = shard->tiers + _shardcache_tier (type);
+	g_static_mutex_lock (&shard->lock);
+	++ c->refresh_failures;
+	struct shardcache_entry_s *e = g_hash_table_lookup (shard->entries, key);
+	if (e) {
+		e->refreshing = FALSE;
+		if (++ e->failures >= max_failures)
+			_shardcache_evict (shard, e);
+	}
+	g_static_mutex_unlock (&shard->lock);
+}
+
+static void
+shardcache_flush (struct shardcache_s *sc)
+{
+	if (!sc)
+		return;
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		g_static_mutex_lock (&shard->lock);
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+			g_queue_clear (shard->lru + t);
+			shard->bytes[t] = 0;
+		}
+		g_hash_table_remove_all (shard->entries);
+		twheel_init (&shard->wheel, shard->wheel.current);
+		g_static_mutex_unlock (&shard->lock);
+	}
+}
+
+static void
+_shardcache_expired (struct twheel_node_s *n, gpointer u)
+{
+	struct shardcache_entry_s *e = (struct shardcache_entry_s *)
+		((guint8 *) n - offsetof (struct shardcache_entry_s, timer));
+	struct shardcache_shard_s *shard = u;
+	++ shard->tiers[e->tier].expiries;
+	_shardcache_remove (shard, e);
+}
+
+/* The shards are expired one after the other, the workers are never
+ * blocked for more than the expiration of a single shard. The entries are
+ * due at the second following their expiry. */
+static guint
+shardcache_expire (struct shardcache_s *sc)
+{
+	guint count = 0;
+	if (!sc)
+		return 0;
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		gint64 now = g_get_monotonic_time () / G_TIME_SPAN_SECOND;
+		g_static_mutex_lock (&shard->lock);
+		count += twheel_advance (&shard->wheel, now, _shardcache_expired, shard);
+		g_static_mutex_unlock (&shard->lock);
+	}
+	return count;
+}
+
+/* The entries of 'tier' already cached keep their expiry */
+static void
+shardcache_set_ttl (struct shardcache_s *sc, guint tier, guint ttl,
+		guint hard_ttl)
+{
+	if (!sc || tier >= SHARDCACHE_TIERS)
+		return;
+	g_atomic_int_set (sc->ttl + tier, ttl);
+	g_atomic_int_set (sc->hard_ttl + tier, MAX (ttl, hard_ttl));
+}
+
+/* The longest hard TTL of the tiers, in seconds */
+static gint
+shardcache_get_hard_ttl (struct shardcache_s *sc)
+{
+	gint hard_ttl = 0;
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t)
+		hard_ttl = MAX (hard_ttl, g_atomic_int_get (sc->hard_ttl + t));
+	return hard_ttl;
+}
+
+/* Bounds the number of entries of 'tier', 0 for no limit but the one of
+ * the whole cache. The limit is split between the shards. */
+static void
+shardcache_set_max (struct shardcache_s *sc, guint tier, guint max)
+{
+	if (!sc || tier >= SHARDCACHE_TIERS)
+		return;
+	guint count = sc->mask + 1;
+	guint per_shard = (max + count - 1) / count;
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		g_static_mutex_lock (&shard->lock);
+		shard->max_count[tier] = per_shard;
+		_shardcache_shrink (shard, g_atomic_int_get (&sc->max));
+		g_static_mutex_unlock (&shard->lock);
+	}
+}
+
+/* Bounds the bytes held by the entries of 'tier', 0 for no limit. The
+ * limit is split between the shards. */
+static void
+shardcache_set_bytes (struct shardcache_s *sc, guint tier, guint64 max_bytes)
+{
+	if (!sc || tier >= SHARDCACHE_TIERS)
+		return;
+	guint count = sc->mask + 1;
+	gsize per_shard = (max_bytes + count - 1) / count;
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		g_static_mutex_lock (&shard->lock);
+		shard->max_bytes[tier] = per_shard;
+		_shardcache_shrink (shard, g_atomic_int_get (&sc->max));
+		g_static_mutex_unlock (&shard->lock);
+	}
+}
+
+static void
+_shardcache_counters_add (struct shardcache_counters_s *dst,
+		const struct shardcache_counters_s *src)
+{
+	dst->hits += src->hits;
+	dst->misses += src->misses;
+	dst->stale += src->stale;
+	dst->inserts += src->inserts;
+	dst->evictions += src->evictions;
+	dst->expiries += src->expiries;
+	dst->decaches += src->decaches;
+	dst->refreshes += src->refreshes;
+	dst->refresh_failures += src->refresh_failures;
+}
+
+static void
+shardcache_info (struct shardcache_s *sc, struct shardcache_stats_s *s)
+{
+	memset (s, 0, sizeof (*s));
+	if (!sc)
+		return;
+	s->shards = sc->mask + 1;
+	s->max = g_atomic_int_get (&sc->max) * s->shards;
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+		s->ttls[t] = g_atomic_int_get (sc->ttl + t);
+		s->hard_ttls[t] = g_atomic_int_get (sc->hard_ttl + t);
+		s->ttl = MAX (s->ttl, s->ttls[t]);
+		s->hard_ttl = MAX (s->hard_ttl, s->hard_ttls[t]);
+	}
+	for (guint i = 0; i <= sc->mask; ++i) {
+		struct shardcache_shard_s *shard = sc->shards + i;
+		g_static_mutex_lock (&shard->lock);
+		for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+			s->counts[t] += shard->lru[t].length;
+			s->bytes[t] += shard->bytes[t];
+			s->max_bytes[t] += shard->max_bytes[t];
+			s->max_counts[t] += shard->max_count[t];
+			_shardcache_counters_add (s->tiers + t, shard->tiers + t);
+		}
+		g_static_mutex_unlock (&shard->lock);
+	}
+	for (guint t = 0; t < SHARDCACHE_TIERS; ++t) {
+		s->count += s->counts[t];
+		_shardcache_counters_add (&s->total, s->tiers + t);
+	}
+}
@@ -0,0 +1,166 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Coalescing of the concurrent resolutions of the same key. The first
+// worker that misses (the leader) performs the resolution, the workers that
+// miss the same key meanwhile wait for its result instead of querying the
+// meta1 too. A waiter gives up after 'wait' and resolves on its own, so that
+// a stuck leader cannot stall them beyond that delay.
+
+struct flight_s {
+	GCond *cond;
+	guint refs; // the leader and the waiters
+	gboolean done;
+	GError *err;
+	gchar **urlv;
+	gchar key[];
+};
+
+struct singleflight_s {
+	GStaticMutex lock;
+	GHashTable *flights; // key -> flight_s, the key is in the flight
+	volatile gint wait; // milliseconds, 0 disables the coalescing
+
+	guint64 leaders;
+	guint64 coalesced;
+	guint64 timeouts;
+};
+
+struct singleflight_stats_s {
+	guint pending;
+	guint wait;
+	guint64 leaders;
+	guint64 coalesced;
+	guint64 timeouts;
+};
+
+static struct singleflight_s *
+singleflight_create (guint wait)
+{
+	struct singleflight_s *sf = g_malloc0 (sizeof (*sf));
+	g_static_mutex_init (&sf->lock);
+	sf->flights = g_hash_table_new (g_str_hash, g_str_equal);
+	sf->wait = wait;
+	return sf;
+}
+
+/* No resolution may be running */
+static void
+singleflight_destroy (struct singleflight_s *sf)
+{
+	if (!sf)
+		return;
+	g_hash_table_destroy (sf->flights);
+	g_static_mutex_free (&sf->lock);
+	g_free (sf);
+}
+
+/* Must be called under the lock */
+static void
+_flight_unref (struct flight_s *f)
+{
+	if (--f->refs)
+		return;
+	g_cond_free (f->cond);
+	if (f->err)
+		g_clear_error (&f->err);
+	if (f->urlv)
+		g_strfreev (f->urlv);
+	g_free (f);
+}
+
+/* Calls 'resolve' once for all the concurrent callers with the same 'key'.
+ * Each caller gets its own copy of the result or of the error. */
+static GError *
+singleflight_do (struct singleflight_s *sf, const gchar *key,
+		GError * (*resolve) (gchar ***), gchar ***result)
+{
+	gint wait;
+	if (!sf || !key || (wait = g_atomic_int_get (&sf->wait)) <= 0)
+		return resolve (result);
+
+	GError *err = NULL;
+	struct flight_s *f;
+
+	g_static_mutex_lock (&sf->lock);
+	if (NULL != (f = g_hash_table_lookup (sf->flights, key))) {
+		// A resolution is running, wait for its result
+		++ f->refs;
+		++ sf->coalesced;
+		GTimeVal deadline;
+		g_get_current_time (&deadline);
+		g_time_val_add (&deadline, wait * 1000L);
+		while (!f->done) {
+			if (!g_cond_timed_wait (f->cond,
+						g_static_mutex_get_mutex (&sf->lock), &deadline))
+				break;
+		}
+		gboolean done = f->done;
+		if (done) {
+			if (f->err)
+				err = g_error_copy (f->err);
+			else
+				*result = g_strdupv (f->urlv);
+		} else {
+			++ sf->timeouts;
+		}
+		_flight_unref (f);
+		g_static_mutex_unlock (&sf->lock);
+		return done ? err : resolve (result);
+	}
+
+	gsize len = strlen (key);
+	f = g_malloc0 (sizeof (*f) + len + 1);
+	memcpy (f->key, key, len + 1);
+	f->cond = g_cond_new ();
+	f->refs = 1;
+	g_hash_table_insert (sf->flights, f->key, f);
+	++ sf->leaders;
+	g_static_mutex_unlock (&sf->lock);
+
+	err = resolve (result);
+
+	g_static_mutex_lock (&sf->lock);
+	g_hash_table_remove (sf->flights, f->key);
+	if (f->refs > 1) {
+		if (err)
+			f->err = g_error_copy (err);
+		else
+			f->urlv = g_strdupv (*result);
+	}
+	f->done = TRUE;
+	g_cond_broadcast (f->cond);
+	_flight_unref (f);
+	g_static_mutex_unlock (&sf->lock);
+	return err;
+}
+
+static void
+singleflight_info (struct singleflight_s *sf, struct singleflight_stats_s *s)
+{
+	memset (s, 0, sizeof (*s));
+	if (!sf)
+		return;
+	g_static_mutex_lock (&sf->lock);
+	s->pending = g_hash_table_size (sf->flights);
+	s->wait = g_atomic_int_get (&sf->wait);
+	s->leaders = sf->leaders;
+	s->coalesced = sf->coalesced;
+	s->timeouts = sf->timeouts;
+	g_static_mutex_unlock (&sf->lock);
+}
@@ -0,0 +1,243 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Snapshot of the front cache, dumped at exit and loaded at startup, so
+// that a restarted proxy does not send all its resolutions to the meta1 at
+// once. The file is read through a mapping, all the integers are little
+// endian and the records are packed:
+//
+//   header  : "MCDFRONT" version:u32 count:u32 written:i64 crc32:u32 size:u32
+//   record  : soft:i64 hard:i64 keylen:u16 nburl:u16 key (len:u16 url)*
+//
+// 'written' is the wall-clock time of the dump, 'soft' and 'hard' the time
+// left at that instant before the entry becomes stale and before it
+// expires (microseconds). 'crc32' covers the 'size' bytes of records.
+
+#define SNAPSHOT_MAGIC "MCDFRONT"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 32
+
+static void
+_snap_u16 (GString *gs, guint16 v)
+{
+	v = GUINT16_TO_LE (v);
+	g_string_append_len (gs, (gchar *) &v, sizeof (v));
+}
+
+static void
+_snap_u32 (GString *gs, guint32 v)
+{
+	v = GUINT32_TO_LE (v);
+	g_string_append_len (gs, (gchar *) &v, sizeof (v));
+}
+
+static void
+_snap_i64 (GString *gs, gint64 v)
+{
+	v = GINT64_TO_LE (v);
+	g_string_append_len (gs, (gchar *) &v, sizeof (v));
+}
+
+struct snap_reader_s {
+	const guint8 *p;
+	const guint8 *end;
+};
+
+/* Each read fails once the data is exhausted, the mapped file is never
+ * accessed beyond its length. */
+static gboolean
+_snap_read (struct snap_reader_s *r, gpointer out, gsize len)
+{
+	if ((gsize) (r->end - r->p) < len)
+		return FALSE;
+	memcpy (out, r->p, len);
+	r->p += len;
+	return TRUE;
+}
+
+static gboolean
+_snap_read_u16 (struct snap_reader_s *r, guint16 *v)
+{
+	if (!_snap_read (r, v, sizeof (*v)))
+		return FALSE;
+	*v = GUINT16_FROM_LE (*v);
+	return TRUE;
+}
+
+static gboolean
+_snap_read_u32 (struct snap_reader_s *r, guint32 *v)
+{
+	if (!_snap_read (r, v, sizeof (*v)))
+		return FALSE;
+	*v = GUINT32_FROM_LE (*v);
+	return TRUE;
+}
+
+static gboolean
+_snap_read_i64 (struct snap_reader_s *r, gint64 *v)
+{
+	if (!_snap_read (r, v, sizeof (*v)))
+		return FALSE;
+	*v = GINT64_FROM_LE (*v);
+	return TRUE;
+}
+
+/* The file is replaced atomically, a crash during the dump leaves the
+ * previous snapshot in place. */
+static GError *
+snapshot_dump (struct shardcache_s *sc, const gchar *path, guint *count)
+{
+	GString *records = g_string_sized_new (65536);
+	guint32 nb = 0;
+
+	void _append (const gchar *key, gchar **urlv, gint64 soft, gint64 hard) {
+		gsize keylen = strlen (key);
+		guint nburl = g_strv_length (urlv);
+		if (keylen > G_MAXUINT16 || nburl > G_MAXUINT16)
+			return;
+		for (guint i = 0; i < nburl; ++i) {
+			if (strlen (urlv[i]) > G_MAXUINT16)
+				return;
+		}
+		_snap_i64 (records, soft);
+		_snap_i64 (records, hard);
+		_snap_u16 (records, keylen);
+		_snap_u16 (records, nburl);
+		g_string_append_len (records, key, keylen);
+		for (guint i = 0; i < nburl; ++i) {
+			gsize len = strlen (urlv[i]);
+			_snap_u16 (records, len);
+			g_string_append_len (records, urlv[i], len);
+		}
+		++ nb;
+	}
+	shardcache_foreach (sc, _append);
+
+	GString *gs = g_string_sized_new (SNAPSHOT_HEADER_SIZE + records->len);
+	g_string_append_len (gs, SNAPSHOT_MAGIC, 8);
+	_snap_u32 (gs, SNAPSHOT_VERSION);
+	_snap_u32 (gs, nb);
+	_snap_i64 (gs, g_get_real_time ());
+	_snap_u32 (gs, crc32 (crc32 (0, NULL, 0), (Bytef *) records->str,
+				records->len));
+	_snap_u32 (gs, records->len);
+	g_string_append_len (gs, records->str, records->len);
+	g_string_free (records, TRUE);
+
+	GError *err = NULL;
+	if (!g_file_set_contents (path, gs->str, gs->len, &err)) {
+		GError *e = NEWERROR (CODE_INTERNAL_ERROR, "Snapshot write error: %s",
+				err ? err->message : "?");
+		g_clear_error (&err);
+		err = e;
+	}
+	g_string_free (gs, TRUE);
+	if (count)
+		*count = nb;
+	return err;
+}
+
+static GError *
+_snapshot_parse (struct shardcache_s *sc, const guint8 *data, gsize len,
+		guint *count)
+{
+	struct snap_reader_s r = {data, data + len};
+	gchar magic[8];
+	guint32 version, nb, crc, size;
+	gint64 written;
+
+	if (!_snap_read (&r, magic, sizeof (magic))
+			|| memcmp (magic, SNAPSHOT_MAGIC, sizeof (magic)))
+		return NEWERROR (CODE_BAD_REQUEST, "Not a snapshot");
+	if (!_snap_read_u32 (&r, &version) || version != SNAPSHOT_VERSION)
+		return NEWERROR (CODE_BAD_REQUEST, "Unsupported snapshot version");
+	if (!_snap_read_u32 (&r, &nb) || !_snap_read_i64 (&r, &written)
+			|| !_snap_read_u32 (&r, &crc) || !_snap_read_u32 (&r, &size))
+		return NEWERROR (CODE_BAD_REQUEST, "Truncated snapshot header");
+	if (size != (gsize) (r.end - r.p))
+		return NEWERROR (CODE_BAD_REQUEST, "Truncated snapshot");
+	if (crc != crc32 (crc32 (0, NULL, 0), r.p, size))
+		return NEWERROR (CODE_BAD_REQUEST, "Corrupted snapshot");
+
+	// A dump from the future means the clock moved, the TTLs are unknown
+	gint64 age = g_get_real_time () - written;
+	if (age < 0)
+		return NEWERROR (CODE_BAD_REQUEST, "Snapshot from the future");
+	if (age >= ((gint64) shardcache_get_hard_ttl (sc)) * G_TIME_SPAN_SECOND)
+		return NEWERROR (CODE_BAD_REQUEST, "Snapshot too old");
+
+	// All the records are checked before any is restored
+	const guint8 *first = r.p;
+	for (int pass = 0; pass < 2; ++pass) {
+		r.p = first;
+		for (guint32 i = 0; i < nb; ++i) {
+			gint64 soft, hard;
+			guint16 keylen, nburl, urllen;
+			if (!_snap_read_i64 (&r, &soft) || !_snap_read_i64 (&r, &hard)
+					|| !_snap_read_u16 (&r, &keylen)
+					|| !_snap_read_u16 (&r, &nburl))
+				return NEWERROR (CODE_BAD_REQUEST, "Truncated snapshot record");
+			gchar key[keylen + 1];
+			if (!_snap_read (&r, key, keylen))
+				return NEWERROR (CODE_BAD_REQUEST, "Truncated snapshot record");
+			key[keylen] = '\0';
+			gchar **urlv = g_malloc0 ((nburl + 1) * sizeof (gchar *));
+			GError *err = NULL;
+			for (guint16 j = 0; !err && j < nburl; ++j) {
+				if (!_snap_read_u16 (&r, &urllen)
+						|| (gsize) (r.end - r.p) < urllen)
+					err = NEWERROR (CODE_BAD_REQUEST, "Truncated snapshot record");
+				else if (pass)
+					urlv[j] = g_strndup ((gchar *) r.p, urllen);
+				if (!err)
+					r.p += urllen;
+			}
+			if (!err && pass && hard - age > 0) {
+				shardcache_restore (sc, key, urlv, soft - age, hard - age);
+				++ *count;
+			}
+			g_strfreev (urlv);
+			if (err)
+				return err;
+		}
+		if (r.p != r.end)
+			return NEWERROR (CODE_BAD_REQUEST, "Trailing data in snapshot");
+	}
+	return NULL;
+}
+
+/* The entries keep the TTLs they had at the dump, minus the age of the
+ * snapshot. A corrupted or truncated file is ignored as a whole. */
+static GError *
+snapshot_load (struct shardcache_s *sc, const gchar *path, guint *count)
+{
+	GError *err = NULL;
+	GMappedFile *mf = g_mapped_file_new (path, FALSE, &err);
+	if (!mf) {
+		GError *e = NEWERROR (CODE_NOT_FOUND, "Snapshot open error: %s",
+				err ? err->message : "?");
+		g_clear_error (&err);
+		return e;
+	}
+
+	*count = 0;
+	err = _snapshot_parse (sc, (guint8 *) g_mapped_file_get_contents (mf),
+			g_mapped_file_get_length (mf), count);
+	g_mapped_file_unref (mf);
+	return err;
+}
@@ -0,0 +1,164 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Snapshots of the service lists of the conscience, one per service type,
+// refreshed by the downstream thread. They are kept already encoded, in
+// JSON and in MessagePack, so that serving a poll only costs a copy.
+
+struct srvlist_s {
+	gint64 mtime; // wall-clock seconds of the list
+	GString *json;
+	GString *mp;
+};
+
+struct srvlists_s {
+	GStaticMutex lock;
+	GHashTable *lists; // type -> srvlist_s
+
+	guint64 hits;
+	guint64 live;
+	guint64 errors;
+};
+
+struct srvlists_stats_s {
+	guint count;
+	guint64 hits;
+	guint64 live;
+	guint64 errors;
+};
+
+static void
+_srvlist_free (struct srvlist_s *l)
+{
+	g_string_free (l->json, TRUE);
+	g_string_free (l->mp, TRUE);
+	g_free (l);
+}
+
+static struct srvlists_s *
+srvlists_create (void)
+{
+	struct srvlists_s *sl = g_malloc0 (sizeof (*sl));
+	g_static_mutex_init (&sl->lock);
+	sl->lists = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify) _srvlist_free);
+	return sl;
+}
+
+static void
+srvlists_destroy (struct srvlists_s *sl)
+{
+	if (!sl)
+		return;
+	g_hash_table_destroy (sl->lists);
+	g_static_mutex_free (&sl->lock);
+	g_free (sl);
+}
+
+/* Returns a copy of the encoded list of 'type', or NULL if there is none.
+ * '*mtime' is set to the time of the list. */
+static GString *
+srvlists_get (struct srvlists_s *sl, const gchar *type, gboolean msgpack,
+		gint64 *mtime)
+{
+	if (!sl || !type)
+		return NULL;
+
+	GString *result = NULL;
+	g_static_mutex_lock (&sl->lock);
+	struct srvlist_s *l = g_hash_table_lookup (sl->lists, type);
+	if (l) {
+		GString *body = msgpack ? l->mp : l->json;
+		result = g_string_new_len (body->str, body->len);
+		*mtime = l->mtime;
+		++ sl->hits;
+	}
+	g_static_mutex_unlock (&sl->lock);
+	return result;
+}
+
+/* Takes ownership of both encodings */
+static void
+srvlists_set (struct srvlists_s *sl, const gchar *type, gint64 mtime,
+		GString *json, GString *mp)
+{
+	struct srvlist_s *l = g_malloc0 (sizeof (*l));
+	l->mtime = mtime;
+	l->json = json;
+	l->mp = mp;
+	g_static_mutex_lock (&sl->lock);
+	g_hash_table_replace (sl->lists, g_strdup (type), l);
+	g_static_mutex_unlock (&sl->lock);
+}
+
+static void
+srvlists_drop (struct srvlists_s *sl, const gchar *type)
+{
+	if (!sl || !type)
+		return;
+	g_static_mutex_lock (&sl->lock);
+	g_hash_table_remove (sl->lists, type);
+	g_static_mutex_unlock (&sl->lock);
+}
+
+/* Accounts the live fetches asked by the clients, and the failed ones */
+static void
+srvlists_count_live (struct srvlists_s *sl, gboolean failed)
+{
+	if (!sl)
+		return;
+	g_static_mutex_lock (&sl->lock);
+	++ sl->live;
+	if (failed)
+		++ sl->errors;
+	g_static_mutex_unlock (&sl->lock);
+}
+
+/* The snapshots of the types that disappeared are dropped. The others are
+ * kept as long as their refresh fails, their mtime tells their age. */
+static void
+srvlists_retain (struct srvlists_s *sl, gchar **types)
+{
+	gboolean _is_unknown (gpointer k, gpointer v, gpointer u) {
+		(void) v, (void) u;
+		for (gchar **p = types; p && *p; ++p) {
+			if (!strcmp (*p, k))
+				return FALSE;
+		}
+		return TRUE;
+	}
+	if (!sl)
+		return;
+	g_static_mutex_lock (&sl->lock);
+	g_hash_table_foreach_remove (sl->lists, _is_unknown, NULL);
+	g_static_mutex_unlock (&sl->lock);
+}
+
+static void
+srvlists_info (struct srvlists_s *sl, struct srvlists_stats_s *s)
+{
+	memset (s, 0, sizeof (*s));
+	if (!sl)
+		return;
+	g_static_mutex_lock (&sl->lock);
+	s->count = g_hash_table_size (sl->lists);
+	s->hits = sl->hits;
+	s->live = sl->live;
+	s->errors = sl->errors;
+	g_static_mutex_unlock (&sl->lock);
+}
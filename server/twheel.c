@@ -0,0 +1,163 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Hierarchical timer wheel. The nodes are embedded in the elements they
+// schedule, and adding or removing a node costs O(1) whatever the number of
+// elements. Level 0 has one slot per tick, each upper level covers 64
+// times the span of the level below. When level 0 wraps, the next slot of
+// level 1 is cascaded into it, and so on. Thus an advance only touches the
+// nodes that are due, plus the occasional cascade of a slot.
+//
+// The wheel is not thread-safe, the caller locks.
+
+#define TWHEEL_BITS 6
+#define TWHEEL_SIZE (1 << TWHEEL_BITS)
+#define TWHEEL_MASK (TWHEEL_SIZE - 1)
+#define TWHEEL_LEVELS 4
+
+struct twheel_node_s {
+	struct twheel_node_s *prev;
+	struct twheel_node_s *next;
+	gint64 when; // tick
+};
+
+struct twheel_s {
+	gint64 current; // next tick to be processed
+	guint count;
+	struct twheel_node_s slots[TWHEEL_LEVELS][TWHEEL_SIZE]; // list heads
+};
+
+static void
+twheel_init (struct twheel_s *w, gint64 now)
+{
+	w->current = now;
+	w->count = 0;
+	for (guint l = 0; l < TWHEEL_LEVELS; ++l) {
+		for (guint i = 0; i < TWHEEL_SIZE; ++i)
+			w->slots[l][i].prev = w->slots[l][i].next = &w->slots[l][i];
+	}
+}
+
+static void
+_twheel_link (struct twheel_node_s *head, struct twheel_node_s *n)
+{
+	n->next = head;
+	n->prev = head->prev;
+	head->prev->next = n;
+	head->prev = n;
+}
+
+static void
+_twheel_unlink (struct twheel_node_s *n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	n->prev = n->next = NULL;
+}
+
+static void
+_twheel_place (struct twheel_s *w, struct twheel_node_s *n)
+{
+	gint64 when = MAX (n->when, w->current);
+	gint64 delta = when - w->current;
+	guint level = 0;
+	while (level < TWHEEL_LEVELS - 1
+			&& delta >= ((gint64) 1) << (TWHEEL_BITS * (level + 1)))
+		++ level;
+	// Beyond the span of the wheel, the node waits in the last slot and
+	// is cascaded again until it is due.
+	if (delta >= ((gint64) 1) << (TWHEEL_BITS * TWHEEL_LEVELS))
+		when = w->current + (((gint64) 1) << (TWHEEL_BITS * TWHEEL_LEVELS)) - 1;
+	guint idx = (when >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+	_twheel_link (&w->slots[level][idx], n);
+}
+
+/* Schedules 'n' at tick 'when'. A tick already passed is due at the next
+ * advance. */
+static void
+twheel_add (struct twheel_s *w, struct twheel_node_s *n, gint64 when)
+{
+	n->when = when;
+	_twheel_place (w, n);
+	++ w->count;
+}
+
+static void
+twheel_remove (struct twheel_s *w, struct twheel_node_s *n)
+{
+	if (!n->next)
+		return;
+	_twheel_unlink (n);
+	-- w->count;
+}
+
+/* Moves the nodes of the current slot of 'level' to the lower levels.
+ * Returns whether the upper level must be cascaded too. */
+static gboolean
+_twheel_cascade (struct twheel_s *w, guint level)
+{
+	guint idx = (w->current >> (TWHEEL_BITS * level)) & TWHEEL_MASK;
+	struct twheel_node_s *head = &w->slots[level][idx];
+	struct twheel_node_s pending = {&pending, &pending, 0};
+
+	// Detached first, a node may land back in the same slot
+	if (head->next != head) {
+		pending.next = head->next;
+		pending.prev = head->prev;
+		pending.next->prev = &pending;
+		pending.prev->next = &pending;
+		head->prev = head->next = head;
+	}
+	while (pending.next != &pending) {
+		struct twheel_node_s *n = pending.next;
+		_twheel_unlink (n);
+		_twheel_place (w, n);
+	}
+	return idx == 0;
+}
+
+/* Processes all the ticks up to 'now' included, and calls 'hook' on each
+ * node that is due, after it has been removed from the wheel. The hook may
+ * free the node. Returns the number of nodes that were due. */
+static guint
+twheel_advance (struct twheel_s *w, gint64 now,
+		void (*hook) (struct twheel_node_s *n, gpointer u), gpointer u)
+{
+	guint count = 0;
+	// An idle wheel jumps directly to the present
+	if (!w->count && now >= w->current) {
+		w->current = now + 1;
+		return 0;
+	}
+	while (w->current <= now) {
+		guint idx = w->current & TWHEEL_MASK;
+		if (!idx) {
+			for (guint l = 1; l < TWHEEL_LEVELS && _twheel_cascade (w, l); ++l) {}
+		}
+		struct twheel_node_s *head = &w->slots[0][idx];
+		while (head->next != head) {
+			struct twheel_node_s *n = head->next;
+			_twheel_unlink (n);
+			-- w->count;
+			++ count;
+			hook (n, u);
+		}
+		++ w->current;
+	}
+	return count;
+}
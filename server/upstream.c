@@ -0,0 +1,404 @@
+/*
+Metacd-http, a http proxy for redcurrant's services
+Copyright (C) 2014 Jean-Francois Smigielski
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Accounting of the calls to the upstream services (meta1, meta2,
+// conscience), per address. Their clients open a connection for each call
+// and close it after, and they cannot be handed a connection: the
+// connections cannot be kept alive. They are bounded instead, at most 'max'
+// calls run at once toward an address and the others wait for their turn,
+// up to 'wait'. So a burst toward a slow service cannot pile up connections
+// and exhaust the ephemeral ports. The addresses idle for long are reaped.
+//
+// Each address also has a circuit breaker. After 'threshold' consecutive
+// network errors or timeouts, the circuit opens and the calls toward the
+// address fail at once with a network error, so that the callers move to
+// the next replica without waiting for a timeout. Once the backoff elapsed,
+// the circuit is half-open: a single call at a time goes through as a
+// probe. Its success closes the circuit, its failure opens it again for
+// twice the backoff, up to UPSTREAM_BACKOFF_SHIFT doublings.
+//
+// The latency and the rate of network errors of the calls toward each
+// address are averaged (EWMA, each call weighing 'weight' percent), so that
+// the replicas of a read may be tried fastest first. An error counts as
+// UPSTREAM_ERROR_PENALTY of latency. The addresses without any call since
+// UPSTREAM_EWMA_STALE are scored as unknown, i.e. first, so a replica once
+// slow is tried again.
+
+#define UPSTREAM_BACKOFF_SHIFT 6
+#define UPSTREAM_ERROR_PENALTY (1.0 * G_TIME_SPAN_SECOND)
+#define UPSTREAM_EWMA_STALE (60 * G_TIME_SPAN_SECOND)
+
+struct upstream_s {
+	GCond *cond;
+	guint inflight;
+	guint waiting;
+	gint64 last; // monotonic, last call
+	guint failures; // consecutive
+	guint openings; // consecutive, without a success between them
+	gint64 open_until; // monotonic, 0 while the circuit is closed
+	gboolean probing;
+	gboolean sampled;
+	gdouble latency; // EWMA, microseconds
+	gdouble failing; // EWMA of the network errors, from 0 to 1
+	gchar addr[];
+};
+
+struct upstreams_s {
+	GStaticMutex lock;
+	GHashTable *byaddr; // addr -> upstream_s, the key is in the upstream
+	volatile gint max; // per address, 0 for no limit
+	volatile gint wait; // milliseconds
+	volatile gint threshold; // failures opening a circuit, 0 disables them
+	volatile gint backoff; // milliseconds, of the first opening
+	volatile gint weight; // percent, of a call in the EWMA, 0 for no ordering
+
+	guint64 dials;
+	guint64 waits;
+	guint64 timeouts;
+	guint64 errors; // network errors, the call may not have reached it
+	guint64 reaped;
+	guint64 opens;
+	guint64 probes;
+	guint64 closes;
+	guint64 rejected; // by an open circuit
+};
+
+struct upstreams_stats_s {
+	guint count;
+	guint inflight;
+	guint max;
+	guint wait;
+	guint64 dials;
+	guint64 waits;
+	guint64 timeouts;
+	guint64 errors;
+	guint64 reaped;
+	guint open; // circuits open or half-open
+	guint threshold;
+	guint backoff;
+	guint weight;
+	guint64 opens;
+	guint64 probes;
+	guint64 closes;
+	guint64 rejected;
+};
+
+static void
+_upstream_free (struct upstream_s *u)
+{
+	g_cond_free (u->cond);
+	g_free (u);
+}
+
+static struct upstreams_s *
+upstreams_create (guint max, guint wait, guint threshold, guint backoff,
+		guint weight)
+{
+	struct upstreams_s *ups = g_malloc0 (sizeof (*ups));
+	g_static_mutex_init (&ups->lock);
+	ups->byaddr = g_hash_table_new_full (g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify) _upstream_free);
+	ups->max = max;
+	ups->wait = wait;
+	ups->threshold = threshold;
+	ups->backoff = backoff;
+	ups->weight = MIN (weight, 100);
+	return ups;
+}
+
+/* No call may be running */
+static void
+upstreams_destroy (struct upstreams_s *ups)
+{
+	if (!ups)
+		return;
+	g_hash_table_destroy (ups->byaddr);
+	g_static_mutex_free (&ups->lock);
+	g_free (ups);
+}
+
+/* Must be called under the lock */
+static struct upstream_s *
+_upstream_get (struct upstreams_s *ups, const gchar *addr)
+{
+	struct upstream_s *u = g_hash_table_lookup (ups->byaddr, addr);
+	if (!u) {
+		gsize len = strlen (addr);
+		u = g_malloc0 (sizeof (*u) + len + 1);
+		memcpy (u->addr, addr, len + 1);
+		u->cond = g_cond_new ();
+		g_hash_table_insert (ups->byaddr, u->addr, u);
+	}
+	return u;
+}
+
+/* Must be called under the lock. Tells if a call may go through the
+ * circuit of 'u', and if it is a probe. */
+static gboolean
+_upstream_admit (struct upstreams_s *ups, struct upstream_s *u,
+		gboolean *probe)
+{
+	*probe = FALSE;
+	if (!u->open_until)
+		return TRUE;
+	if (u->probing || g_get_monotonic_time () < u->open_until) {
+		++ ups->rejected;
+		return FALSE;
+	}
+	*probe = u->probing = TRUE;
+	++ ups->probes;
+	return TRUE;
+}
+
+/* Must be called under the lock */
+static void
+_upstream_account (struct upstreams_s *ups, struct upstream_s *u,
+		gboolean probe, GError *err, gint64 elapsed)
+{
+	if (probe)
+		u->probing = FALSE;
+
+	gdouble failed = (err && err->code < 100) ? 1.0 : 0.0;
+	if (!u->sampled) {
+		u->sampled = TRUE;
+		u->latency = elapsed;
+		u->failing = failed;
+	} else {
+		gdouble w = g_atomic_int_get (&ups->weight) / 100.0;
+		u->latency += w * (elapsed - u->latency);
+		u->failing += w * (failed - u->failing);
+	}
+	if (!err || err->code >= 100) {
+		u->failures = 0;
+		if (u->open_until) {
+			u->open_until = 0;
+			u->openings = 0;
+			++ ups->closes;
+		}
+		return;
+	}
+
+	++ ups->errors;
+	++ u->failures;
+	gint threshold = g_atomic_int_get (&ups->threshold);
+	if (probe || (!u->open_until && threshold > 0
+				&& u->failures >= (guint) threshold)) {
+		gint64 backoff = ((gint64) g_atomic_int_get (&ups->backoff)) * 1000;
+		backoff <<= MIN (u->openings, UPSTREAM_BACKOFF_SHIFT);
+		u->open_until = g_get_monotonic_time () + backoff;
+		++ u->openings;
+		++ ups->opens;
+	}
+}
+
+/* Tells if a call toward 'addr' would go through its circuit now. The
+ * callers that cannot skip an address may try the others first. */
+static gboolean
+upstream_healthy (struct upstreams_s *ups, const gchar *addr)
+{
+	if (!ups || !addr)
+		return TRUE;
+	g_static_mutex_lock (&ups->lock);
+	struct upstream_s *u = g_hash_table_lookup (ups->byaddr, addr);
+	gboolean healthy = !u || !u->open_until
+		|| (!u->probing && g_get_monotonic_time () >= u->open_until);
+	g_static_mutex_unlock (&ups->lock);
+	return healthy;
+}
+
+/* Runs 'call' toward 'addr' once a slot is free for it, unless the circuit
+ * of the address is open. The wait for a slot stops at 'deadline' (on the
+ * monotonic clock, 0 for none). */
+static GError *
+upstream_call (struct upstreams_s *ups, const gchar *addr, gint64 deadline,
+		GError * (*call) (const gchar *addr))
+{
+	if (!ups || !addr)
+		return call (addr);
+
+	gboolean probe = FALSE;
+	g_static_mutex_lock (&ups->lock);
+	struct upstream_s *u = _upstream_get (ups, addr);
+	if (!_upstream_admit (ups, u, &probe)) {
+		g_static_mutex_unlock (&ups->lock);
+		return NEWERROR (CODE_NETWORK_ERROR, "Circuit open toward [%s]", addr);
+	}
+	gint max = g_atomic_int_get (&ups->max);
+	if (max > 0 && u->inflight >= (guint) max) {
+		gint64 wait = g_atomic_int_get (&ups->wait) * G_TIME_SPAN_MILLISECOND;
+		gboolean cut = FALSE;
+		if (deadline) {
+			gint64 left = MAX (deadline - g_get_monotonic_time (), 0);
+			if ((cut = left < wait))
+				wait = left;
+		}
+		GTimeVal until;
+		g_get_current_time (&until);
+		g_time_val_add (&until, wait);
+		++ ups->waits;
+		++ u->waiting;
+		while (u->inflight >= (guint) max) {
+			if (!g_cond_timed_wait (u->cond,
+						g_static_mutex_get_mutex (&ups->lock), &until))
+				break;
+		}
+		-- u->waiting;
+		if (u->inflight >= (guint) max) {
+			++ ups->timeouts;
+			if (probe)
+				u->probing = FALSE;
+			g_static_mutex_unlock (&ups->lock);
+			if (cut)
+				return _error_deadline ();
+			return NEWERROR (CODE_NETWORK_ERROR,
+					"Too many calls pending toward [%s]", addr);
+		}
+	}
+	++ u->inflight;
+	++ ups->dials;
+	g_static_mutex_unlock (&ups->lock);
+
+	gint64 start = g_get_monotonic_time ();
+	GError *err = call (addr);
+
+	g_static_mutex_lock (&ups->lock);
+	-- u->inflight;
+	u->last = g_get_monotonic_time ();
+	_upstream_account (ups, u, probe, err, u->last - start);
+	if (u->waiting)
+		g_cond_signal (u->cond);
+	g_static_mutex_unlock (&ups->lock);
+	return err;
+}
+
+/* The lower, the sooner 'addr' should be tried. 0 for the addresses without
+ * recent calls, G_MAXDOUBLE for those whose circuit refuses the calls. */
+static gdouble
+upstream_score (struct upstreams_s *ups, const gchar *addr)
+{
+	if (!ups || !addr || g_atomic_int_get (&ups->weight) <= 0)
+		return 0.0;
+	gdouble score = 0.0;
+	gint64 now = g_get_monotonic_time ();
+	g_static_mutex_lock (&ups->lock);
+	struct upstream_s *u = g_hash_table_lookup (ups->byaddr, addr);
+	if (u) {
+		if (u->open_until && (u->probing || now < u->open_until))
+			score = G_MAXDOUBLE;
+		else if (u->sampled && now - u->last < UPSTREAM_EWMA_STALE)
+			score = u->latency + u->failing * UPSTREAM_ERROR_PENALTY;
+	}
+	g_static_mutex_unlock (&ups->lock);
+	return score;
+}
+
+/* Forgets the addresses without any call since 'idle' seconds */
+static guint
+upstreams_reap (struct upstreams_s *ups, guint idle)
+{
+	gint64 oldest = g_get_monotonic_time () - ((gint64) idle) * G_TIME_SPAN_SECOND;
+	gboolean _is_idle (gpointer k, gpointer v, gpointer x) {
+		(void) k, (void) x;
+		struct upstream_s *u = v;
+		return !u->inflight && !u->waiting && u->last < oldest;
+	}
+	if (!ups)
+		return 0;
+	g_static_mutex_lock (&ups->lock);
+	guint count = g_hash_table_foreach_remove (ups->byaddr, _is_idle, NULL);
+	ups->reaped += count;
+	g_static_mutex_unlock (&ups->lock);
+	return count;
+}
+
+static void
+upstreams_info (struct upstreams_s *ups, struct upstreams_stats_s *s)
+{
+	void _sum (gpointer k, gpointer v, gpointer x) {
+		(void) k, (void) x;
+		struct upstream_s *u = v;
+		s->inflight += u->inflight;
+		if (u->open_until)
+			++ s->open;
+	}
+	memset (s, 0, sizeof (*s));
+	if (!ups)
+		return;
+	g_static_mutex_lock (&ups->lock);
+	s->count = g_hash_table_size (ups->byaddr);
+	g_hash_table_foreach (ups->byaddr, _sum, NULL);
+	s->max = g_atomic_int_get (&ups->max);
+	s->wait = g_atomic_int_get (&ups->wait);
+	s->dials = ups->dials;
+	s->waits = ups->waits;
+	s->timeouts = ups->timeouts;
+	s->errors = ups->errors;
+	s->reaped = ups->reaped;
+	s->threshold = g_atomic_int_get (&ups->threshold);
+	s->backoff = g_atomic_int_get (&ups->backoff);
+	s->weight = g_atomic_int_get (&ups->weight);
+	s->opens = ups->opens;
+	s->probes = ups->probes;
+	s->closes = ups->closes;
+	s->rejected = ups->rejected;
+	g_static_mutex_unlock (&ups->lock);
+}
+
+/* Appends a "prefix.ADDR = open|half-open" property for each circuit not
+ * closed */
+static void
+upstreams_circuits (GString *gstr, const gchar *prefix,
+		struct upstreams_s *ups)
+{
+	gint64 now = g_get_monotonic_time ();
+	void _append (gpointer k, gpointer v, gpointer x) {
+		(void) x;
+		struct upstream_s *u = v;
+		if (u->open_until)
+			g_string_append_printf (gstr, "%s.%s = %s\n", prefix,
+					(gchar *) k, now < u->open_until ? "open" : "half-open");
+	}
+	if (!ups)
+		return;
+	g_static_mutex_lock (&ups->lock);
+	g_hash_table_foreach (ups->byaddr, _append, NULL);
+	g_static_mutex_unlock (&ups->lock);
+}
+
+/* Appends the "prefix.latency.ADDR" (microseconds) and "prefix.errors.ADDR"
+ * (percent) averages of the addresses recently called */
+static void
+upstreams_ewma (GString *gstr, const gchar *prefix, struct upstreams_s *ups)
+{
+	gint64 now = g_get_monotonic_time ();
+	void _append (gpointer k, gpointer v, gpointer x) {
+		(void) x;
+		struct upstream_s *u = v;
+		if (!u->sampled || now - u->last >= UPSTREAM_EWMA_STALE)
+			return;
+		g_string_append_printf (gstr, "%s.latency.%s = %.0f\n", prefix,
+				(gchar *) k, u->latency);
+		g_string_append_printf (gstr, "%s.errors.%s = %.1f\n", prefix,
+				(gchar *) k, u->failing * 100.0);
+	}
+	if (!ups)
+		return;
+	g_static_mutex_lock (&ups->lock);
+	g_hash_table_foreach (ups->byaddr, _append, NULL);
+	g_static_mutex_unlock (&ups->lock);
+}
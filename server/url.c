@@ -31,19 +31,31 @@ enum {
 	TOK_TAGV    = 0x0400,
 	TOK_STGCLS  = 0x0800,
 	TOK_KEY     = 0x1000,
+
+	TOK_MARKER    = 0x2000,
+	TOK_PREFIX    = 0x4000,
+	TOK_DELIMITER = 0x8000,
+	TOK_MAX       = 0x10000,
 };
 
 enum {
 	FLAG_NOEMPTY = 0x0001,
+	FLAG_MSGPACK = 0x0002,
+	FLAG_NOCACHE = 0x0004,
 };
 
+/* The components point into a single copy of the original URI, allocated
+ * in the arena of the request, that is then tokenized in place. */
 struct req_uri_s {
 	const gchar *original;
 	gchar *path;
 	gchar *query;
 	gchar *fragment;
+
+	struct req_arena_s *arena;
 };
 
+/* All the tokens point into the req_uri_s buffer, they must not be freed */
 struct req_args_s {
 	// path tokens
 	gchar *ns;
@@ -61,6 +73,10 @@ struct req_args_s {
 	gchar *verpol;
 	gchar *stgcls;
 	gchar *key;
+	gchar *marker;
+	gchar *prefix;
+	gchar *delimiter;
+	gchar *max;
 
 	struct hc_url_s *url;
 
@@ -68,10 +84,12 @@ struct req_args_s {
 	const gchar *uri;
 
 	struct req_uri_s *req_uri;
+	struct req_arena_s *arena;
 	struct http_request_s *rq;
 	struct http_reply_ctx_s *rp;
 
 	guint32 flags;
+	gint64 deadline; // monotonic, 0 for none
 };
 
 struct req_action_s {
@@ -82,6 +100,7 @@ struct req_action_s {
 	guint32 path;
 	guint32 query;
 	guint32 query_opt;
+	guint32 deadline; // milliseconds, 0 for RequestDeadline
 };
 
 struct url_action_s {
@@ -92,65 +111,79 @@ struct url_action_s {
 //------------------------------------------------------------------------------
 
 static void
-_req_uri_extract_components (const gchar * str, struct req_uri_s *uri)
+_req_uri_extract_components (const gchar * str, struct req_uri_s *uri,
+		struct req_arena_s *arena)
 {
-	gchar *pq = strchr (str, '?');
-	gchar *pa = pq ? strchr (pq, '#') : strchr (str, '#');
+	static gchar empty[] = "";
 
 	uri->original = str;
-	if (pq || pa)
-		uri->path = g_strndup (uri->original, (pq ? pq : pa) - str);
-	else
-		uri->path = g_strdup (uri->original);
-
+	uri->arena = arena;
+	uri->path = req_arena_strdup (arena, str);
+	uri->query = empty;
+	uri->fragment = empty;
+
+	gchar *pa = strchr (uri->path, '#');
+	if (pa) {
+		*(pa++) = '\0';
+		uri->fragment = pa;
+	}
+	gchar *pq = strchr (uri->path, '?');
 	if (pq) {
-		if (pa)
-			uri->query = g_strndup (pq + 1, pa - pq);
-		else
-			uri->query = g_strdup (pq + 1);
-	} else
-		uri->query = g_strdup("");
-
-	if (pa)
-		uri->fragment = g_strdup (pa + 1);
-	else
-		uri->fragment = g_strdup("");
+		*(pq++) = '\0';
+		uri->query = pq;
+	}
 }
 
 static void
 _req_uri_free_components (struct req_uri_s *uri)
 {
-	metautils_str_clean (&uri->path);
-	metautils_str_clean (&uri->query);
-	metautils_str_clean (&uri->fragment);
+	if (uri->arena)
+		req_arena_clear (uri->arena);
+	uri->path = uri->query = uri->fragment = NULL;
 }
 
 //------------------------------------------------------------------------------
 
+/* Decodes the %XX sequences of 's' in place, the output is never longer
+ * than the input. */
+static gboolean
+_unescape_inplace (gchar *s)
+{
+	gchar *out = s;
+	for (; *s; ++s) {
+		if (*s != '%') {
+			*(out++) = *s;
+			continue;
+		}
+		gint hi = g_ascii_xdigit_value (s[1]);
+		gint lo = hi < 0 ? -1 : g_ascii_xdigit_value (s[2]);
+		if (lo < 0 || (!hi && !lo))
+			return FALSE;
+		*(out++) = (hi << 4) | lo;
+		s += 2;
+	}
+	*out = '\0';
+	return TRUE;
+}
+
 static GError *
-_parse_pair (gchar ** t, struct url_action_s *pa)
+_parse_pair (gchar *k, gchar *v, struct url_action_s *pa)
 {
-	if (0 == strlen (t[0]))
+	if (!*k)
 		return BADREQ ("empty key");
-	if (0 == strlen (t[1]))
+	if (!*v)
 		return BADREQ ("empty value");
+	if (strchr (v, '%') && !_unescape_inplace (v))
+		return BADREQ ("Invalid escape sequence for [%s]", k);
 
-	gchar *escaped = g_uri_unescape_string (t[1], NULL);
-
-	for (;; ++pa) {
-		if (!pa->token) {		// reached the last expectable token, none matched
-			GError *e = BADREQ ("Unexpected URI token [%s]", t[0]);
-			g_free (escaped);
-			return e;
-		} else if (!g_ascii_strcasecmp (t[0], pa->token)) {
-			metautils_str_reuse (pa->to, escaped);
+	for (; pa->token; ++pa) {
+		if (!g_ascii_strcasecmp (k, pa->token)) {
+			*(pa->to) = v;
 			return NULL;
 		}
 	}
-
-	g_free (escaped);
-	g_assert_not_reached ();
-	return NULL;
+	// reached the last expectable token, none matched
+	return BADREQ ("Unexpected URI token [%s]", k);
 }
 
 static GError *
@@ -164,24 +197,30 @@ _req_path_extract_tokens (struct req_args_s *args)
 		{NULL, NULL}
 	};
 
-	gchar **tokens = g_strsplit (args->uri, "/", 0);
-	if (!tokens)
-		return NEWERROR (500, "Internal error");
+	// args->uri points into the copy of the URI held by the arena
+	gchar *k = (gchar *) args->uri;
+	if (!*k)
+		return NULL;
 
 	GError *e = NULL;
-	for (gchar ** t = tokens; !e && *t; t += 2) {
-		if (!*(t + 1))
-			e = NEWERROR (400, "Invalid URI");
-		else
-			e = _parse_pair (t, actions);
+	while (!e && k) {
+		gchar *v = strchr (k, '/');
+		if (!v)
+			return NEWERROR (400, "Invalid URI");
+		*(v++) = '\0';
+		gchar *next = strchr (v, '/');
+		if (next)
+			*(next++) = '\0';
+		e = _parse_pair (k, v, actions);
+		k = next;
 	}
-	g_strfreev (tokens);
 	return e;
 }
 
 static GError *
 _req_query_extract_args (struct req_args_s *args)
 {
+	static gchar empty[] = "";
 	struct url_action_s actions[] = {
 		{"action", &args->action},
 		{"tagk", &args->tagk},
@@ -192,25 +231,28 @@ _req_query_extract_args (struct req_args_s *args)
 		{"verpol", &args->verpol},
 		{"version", &args->version},
 		{"key", &args->key},
+		{"marker", &args->marker},
+		{"prefix", &args->prefix},
+		{"delimiter", &args->delimiter},
+		{"max", &args->max},
 		{NULL, NULL}
 	};
 
-	gchar **pairs = g_strsplit (args->req_uri->query, "&", 0);
-	if (!pairs)
-		return NEWERROR (500, "Internal error");
+	gchar *k = args->req_uri->query;
+	if (!*k)
+		return NULL;
 
 	GError *e = NULL;
-	for (gchar **pair = pairs; !e && *pair; pair++) {
-		if (strchr(*pair, '=')) {
-			gchar **kv = g_strsplit(*pair, "=", 2);
-			e = _parse_pair (kv, actions);
-			g_strfreev(kv);
-		} else {
-			gchar *kv[3] = { *pair, "", NULL };
-			e = _parse_pair (kv, actions);
-		}
+	while (!e && k) {
+		gchar *next = strchr (k, '&');
+		if (next)
+			*(next++) = '\0';
+		gchar *v = strchr (k, '=');
+		if (v)
+			*(v++) = '\0';
+		e = _parse_pair (k, v ? v : empty, actions);
+		k = next;
 	}
-	g_strfreev (pairs);
 	return e;
 }
 
@@ -266,6 +308,10 @@ _req_query_check_tokens (struct req_args_s *args,
 	PRESENCE (STGPOL, stgpol);
 	PRESENCE (STGCLS, stgcls);
 	PRESENCE (KEY, key);
+	PRESENCE (MARKER, marker);
+	PRESENCE (PREFIX, prefix);
+	PRESENCE (DELIMITER, delimiter);
+	PRESENCE (MAX, max);
 	return NULL;
 #undef PRESENCE
 }
@@ -273,73 +319,165 @@ _req_query_check_tokens (struct req_args_s *args,
 static void
 _req_path_clear_tokens (struct req_args_s *args)
 {
-	metautils_str_clean (&args->ns);
-	metautils_str_clean (&args->ref);
-	metautils_str_clean (&args->path);
-	metautils_str_clean (&args->type);
-
-	metautils_str_clean (&args->size);
-	metautils_str_clean (&args->tagk);
-	metautils_str_clean (&args->tagv);
-	metautils_str_clean (&args->action);
-	metautils_str_clean (&args->version);
-	metautils_str_clean (&args->stgpol);
-	metautils_str_clean (&args->verpol);
-	metautils_str_clean (&args->stgcls);
-	metautils_str_clean (&args->key);
-
 	if (args->url)
 		hc_url_clean (args->url);
+	if (args->arena)
+		req_arena_clear (args->arena);
 	memset (args, 0, sizeof (struct req_args_s));
 }
 
+/* json-c tokeners are reused by the worker threads, instead of being
+ * allocated for each request body. */
+static GStaticPrivate tokener_key = G_STATIC_PRIVATE_INIT;
+
+static struct json_tokener *
+_req_json_tokener (void)
+{
+	struct json_tokener *tok = g_static_private_get (&tokener_key);
+	if (!tok) {
+		tok = json_tokener_new ();
+		g_static_private_set (&tokener_key, tok,
+				(GDestroyNotify) json_tokener_free);
+	} else {
+		json_tokener_reset (tok);
+	}
+	return tok;
+}
+
+static struct json_object *
+_req_json_parse (const struct req_args_s *args)
+{
+	return json_tokener_parse_ex (_req_json_tokener (),
+			(char *) args->rq->body->data, args->rq->body->len);
+}
+
+/* JSON stays the default encoding, MessagePack is only sent to the clients
+ * that explicitly list it in their Accept header. */
+static gboolean
+_accepts_msgpack (const gchar *accept)
+{
+	if (!accept)
+		return FALSE;
+	for (const gchar *p = accept; (p = strchr (p, '/')); ++p) {
+		const gchar *sub = p + 1;
+		if (!g_ascii_strncasecmp (sub, "x-msgpack", 9))
+			sub += 2;
+		if (!g_ascii_strncasecmp (sub, "msgpack", 7)
+				&& (!sub[7] || sub[7] == ';' || sub[7] == ','
+					|| g_ascii_isspace (sub[7])))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* The client asks for an answer from the service itself with the standard
+ * "Cache-Control: no-cache" */
+static gboolean
+_refuses_cache (const gchar *cc)
+{
+	if (!cc)
+		return FALSE;
+	gchar **tokv = g_strsplit (cc, ",", -1);
+	gboolean refused = FALSE;
+	for (gchar **ptok = tokv; *ptok && !refused; ++ptok) {
+		gchar *tok = g_strstrip (*ptok);
+		refused = !g_ascii_strcasecmp (tok, "no-cache")
+			|| !g_ascii_strcasecmp (tok, "no-store");
+	}
+	g_strfreev (tokv);
+	return refused;
+}
+
+#ifndef REQUEST_DEFAULT_DEADLINE
+#define REQUEST_DEFAULT_DEADLINE 0
+#endif
+
+/* Milliseconds, the budget of the routes without their own, 0 for none.
+ * Defined here so that everything parsing the requests can be built alone. */
+static guint request_deadline = REQUEST_DEFAULT_DEADLINE;
+
+/* The budget of the request, from the route or the configuration, that
+ * the client may shorten with "X-Deadline-Ms" */
+static GError *
+_req_deadline (const struct req_args_s *args, guint32 route, gint64 *deadline)
+{
+	gint64 budget = route ? route : request_deadline;
+	const gchar *hdr = g_tree_lookup (args->rq->tree_headers, "x-deadline-ms");
+	if (hdr) {
+		errno = 0;
+		gchar *end = NULL;
+		gint64 asked = g_ascii_strtoll (hdr, &end, 10);
+		if (!end || end == hdr || *end || errno == ERANGE || asked <= 0
+				|| asked > G_MAXINT64 / 1000)
+			return BADREQ ("Invalid X-Deadline-Ms");
+		budget = budget > 0 ? MIN (budget, asked) : asked;
+	}
+	gint64 now = g_get_monotonic_time ();
+	*deadline = budget > 0 ? now + MIN (budget * 1000, G_MAXINT64 - now) : 0;
+	return NULL;
+}
+
+/* Once the deadline passed, no other service is called for the request */
+static GError *
+_req_check_deadline (const struct req_args_s *args)
+{
+	if (args->deadline && g_get_monotonic_time () >= args->deadline)
+		return _error_deadline ();
+	return NULL;
+}
+
+/* The timeout of a call to a service (seconds), shortened to what remains
+ * of the deadline of the request */
+static gdouble
+_req_timeout (const struct req_args_s *args, gdouble max)
+{
+	if (!args->deadline)
+		return max;
+	gint64 left = MAX (args->deadline - g_get_monotonic_time (), 1000);
+	return MIN (max, (gdouble) left / G_TIME_SPAN_SECOND);
+}
+
 //------------------------------------------------------------------------------
 
 static enum http_rc_e
 req_args_call (struct http_request_s *rq, struct http_reply_ctx_s *rp,
-	struct req_uri_s *uri, const gchar * path, struct req_action_s *actions)
+	struct req_uri_s *uri, const gchar * path, gconstpointer action)
 {
+	const struct req_action_s *pa = action;
+
 	gboolean _boolhdr (const gchar * n) {
 		return metautils_cfg_get_bool (
 			(gchar *) g_tree_lookup (rq->tree_headers, n), FALSE);
 	}
 
-	gboolean matched = FALSE;
-	for (struct req_action_s * pa = actions; pa->prefix; ++pa) {
-
-		if (!g_str_has_prefix (path, pa->prefix))
-			continue;
-		matched = TRUE;
-		if (0 != strcmp (rq->cmd, pa->method))
-			continue;
-
-		struct req_args_s args;
-		memset (&args, 0, sizeof (struct req_args_s));
-		args.url = hc_url_empty ();
-		args.uri = path + strlen (pa->prefix);
-		args.req_uri = uri;
-		args.rq = rq;
-		args.rp = rp;
-		if (_boolhdr ("x-disallow-empty-service-list"))
-			args.flags |= FLAG_NOEMPTY;
-
-		enum http_rc_e e;
-		GError *err;
-		if (!(err = _req_path_extract_tokens (&args))
-				&& !(err = _req_query_extract_args (&args))
-				&& !(err = _req_path_check_tokens (&args, pa->path))
-				&& !(err = _req_query_check_tokens (&args, pa->query, pa->query_opt)))
-			e = pa->hook (&args);
-		else if (err->code == CODE_NAMESPACE_NOTMANAGED || err->code == 404)
-			e = _reply_notfound_error (rp, err);
-		else
-			e = _reply_format_error (rp, err);
-
-		_req_path_clear_tokens (&args);
-		return e;
-	}
+	struct req_args_s args;
+	memset (&args, 0, sizeof (struct req_args_s));
+	args.url = hc_url_empty ();
+	args.uri = path;
+	args.req_uri = uri;
+	args.arena = uri->arena;
+	args.rq = rq;
+	args.rp = rp;
+	if (_boolhdr ("x-disallow-empty-service-list"))
+		args.flags |= FLAG_NOEMPTY;
+	if (_accepts_msgpack (g_tree_lookup (rq->tree_headers, "accept")))
+		args.flags |= FLAG_MSGPACK;
+	if (_refuses_cache (g_tree_lookup (rq->tree_headers, "cache-control")))
+		args.flags |= FLAG_NOCACHE;
+
+	enum http_rc_e e;
+	GError *err;
+	if (!(err = _req_deadline (&args, pa->deadline, &args.deadline))
+			&& !(err = _req_path_extract_tokens (&args))
+			&& !(err = _req_query_extract_args (&args))
+			&& !(err = _req_path_check_tokens (&args, pa->path))
+			&& !(err = _req_query_check_tokens (&args, pa->query, pa->query_opt)))
+		e = pa->hook (&args);
+	else if (err->code == CODE_NAMESPACE_NOTMANAGED || err->code == 404)
+		e = _reply_notfound_error (rp, err);
+	else
+		e = _reply_format_error (rp, err);
 
-	if (matched)
-		return _reply_method_error (rp);
-	return _reply_no_handler (rp);
+	_req_path_clear_tokens (&args);
+	return e;
 }